@@ -0,0 +1,242 @@
+// Sparse brick map 3D texture.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _BRICK_TEXTURE_3D_H_
+#define _BRICK_TEXTURE_3D_H_
+
+#include <Resources/Texture3D.h>
+#include <boost/shared_ptr.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+namespace OpenEngine {
+namespace Resources {
+
+template <class T> class BrickTexture3D;
+typedef BrickTexture3D<float> FloatBrickTexture3D;
+typedef boost::shared_ptr<FloatBrickTexture3D> FloatBrickTexture3DPtr;
+
+/**
+ * Sparse 3D texture stored as BRICK^3 voxel bricks. Only bricks that
+ * differ from a per channel background value are allocated, an
+ * occupancy index maps brick coordinates to slots in a brick pool.
+ *
+ * Voxel addressing wraps around like Texture3D::GetVoxel. Volumes
+ * whose sides are not a multiple of BRICK get partially used bricks
+ * along the far faces.
+ */
+template <class T> class BrickTexture3D {
+ public:
+    static const unsigned int BRICK = 8;
+    static const unsigned int BRICK_VOXELS = BRICK*BRICK*BRICK;
+
+ private:
+    unsigned int width, height, depth, channels;
+    unsigned int bw, bh, bd;
+    // brick slot or -1 for background bricks
+    std::vector<int> index;
+    std::vector<T> pool;
+    std::vector<int> freeSlots;
+    std::vector<T> background;
+
+    unsigned int Wrap(int i, unsigned int n) const {
+        int r = i % (int)n;
+        return r < 0 ? r + n : r;
+    }
+
+ public:
+    BrickTexture3D(unsigned int w, unsigned int h, unsigned int d,
+                   unsigned int c, T bg = 0)
+        : width(w), height(h), depth(d), channels(c),
+          bw((w+BRICK-1)/BRICK), bh((h+BRICK-1)/BRICK), bd((d+BRICK-1)/BRICK),
+          index(bw*bh*bd, -1), background(c, bg) {}
+
+    /**
+     * Build from a dense texture. Bricks where every voxel is within
+     * epsilon of the background are left empty.
+     */
+    static boost::shared_ptr<BrickTexture3D<T> >
+    FromDense(boost::shared_ptr<Texture3D<T> > tex, T bg = 0, T epsilon = 0) {
+        unsigned int w = tex->GetWidth();
+        unsigned int h = tex->GetHeight();
+        unsigned int d = tex->GetDepth();
+        unsigned int c = tex->GetChannels();
+        boost::shared_ptr<BrickTexture3D<T> >
+            out(new BrickTexture3D<T>(w,h,d,c,bg));
+        const T* din = tex->GetData();
+        for (unsigned int bz=0; bz<out->bd; bz++)
+            for (unsigned int by=0; by<out->bh; by++)
+                for (unsigned int bx=0; bx<out->bw; bx++) {
+                    unsigned int x0 = bx*BRICK, y0 = by*BRICK, z0 = bz*BRICK;
+                    unsigned int nx = std::min(BRICK, w-x0);
+                    unsigned int ny = std::min(BRICK, h-y0);
+                    unsigned int nz = std::min(BRICK, d-z0);
+                    bool empty = true;
+                    for (unsigned int z=0; z<nz && empty; z++)
+                        for (unsigned int y=0; y<ny && empty; y++) {
+                            const T* row = din + ((z0+z)*h + y0+y)*w*c + x0*c;
+                            for (unsigned int i=0; i<nx*c; i++)
+                                if (std::fabs(row[i] - bg) > epsilon) {
+                                    empty = false;
+                                    break;
+                                }
+                        }
+                    if (empty) continue;
+                    T* brick = out->Allocate(bx,by,bz);
+                    for (unsigned int z=0; z<nz; z++)
+                        for (unsigned int y=0; y<ny; y++)
+                            std::memcpy(brick + (y + z*BRICK)*BRICK*c,
+                                        din + ((z0+z)*h + y0+y)*w*c + x0*c,
+                                        sizeof(T)*nx*c);
+                }
+        return out;
+    }
+
+    // Expand to a dense texture, empty bricks are filled with the
+    // background.
+    boost::shared_ptr<Texture3D<T> > ToDense() const {
+        boost::shared_ptr<Texture3D<T> >
+            out(new Texture3D<T>(width,height,depth,channels));
+        T* dout = out->GetData();
+        for (unsigned int i=0; i<width*height*depth; i++)
+            for (unsigned int ch=0; ch<channels; ch++)
+                dout[i*channels+ch] = background[ch];
+        for (unsigned int bz=0; bz<bd; bz++)
+            for (unsigned int by=0; by<bh; by++)
+                for (unsigned int bx=0; bx<bw; bx++) {
+                    const T* brick = GetBrick(bx,by,bz);
+                    if (!brick) continue;
+                    unsigned int x0 = bx*BRICK, y0 = by*BRICK, z0 = bz*BRICK;
+                    unsigned int nx = std::min(BRICK, width-x0);
+                    unsigned int ny = std::min(BRICK, height-y0);
+                    unsigned int nz = std::min(BRICK, depth-z0);
+                    for (unsigned int z=0; z<nz; z++)
+                        for (unsigned int y=0; y<ny; y++)
+                            std::memcpy(dout + ((z0+z)*height + y0+y)*width*channels
+                                        + x0*channels,
+                                        brick + (y + z*BRICK)*BRICK*channels,
+                                        sizeof(T)*nx*channels);
+                }
+        return out;
+    }
+
+    unsigned int GetWidth() const { return width; }
+    unsigned int GetHeight() const { return height; }
+    unsigned int GetDepth() const { return depth; }
+    unsigned int GetChannels() const { return channels; }
+    unsigned int GetBricksX() const { return bw; }
+    unsigned int GetBricksY() const { return bh; }
+    unsigned int GetBricksZ() const { return bd; }
+
+    const T* GetBackground() const { return &background[0]; }
+    void SetBackground(unsigned int ch, T v) { background[ch] = v; }
+
+    unsigned int GetOccupiedBricks() const {
+        return pool.size() / (BRICK_VOXELS*channels) - freeSlots.size();
+    }
+
+    // Bytes used by the brick pool and the index.
+    unsigned long GetMemoryUsage() const {
+        return pool.size()*sizeof(T) + index.size()*sizeof(int);
+    }
+
+    bool IsOccupied(unsigned int bx, unsigned int by, unsigned int bz) const {
+        return index[bx + (by + bz*bh)*bw] >= 0;
+    }
+
+    /**
+     * Voxel data of a brick, x fastest then y then z, or NULL for an
+     * empty brick.
+     */
+    T* GetBrick(unsigned int bx, unsigned int by, unsigned int bz) {
+        int slot = index[bx + (by + bz*bh)*bw];
+        return slot < 0 ? NULL : &pool[slot*BRICK_VOXELS*channels];
+    }
+
+    const T* GetBrick(unsigned int bx, unsigned int by, unsigned int bz) const {
+        int slot = index[bx + (by + bz*bh)*bw];
+        return slot < 0 ? NULL : &pool[slot*BRICK_VOXELS*channels];
+    }
+
+    /**
+     * Make a brick occupied, a new brick is filled with the background.
+     */
+    T* Allocate(unsigned int bx, unsigned int by, unsigned int bz) {
+        int& slot = index[bx + (by + bz*bh)*bw];
+        if (slot < 0) {
+            if (freeSlots.empty()) {
+                slot = pool.size() / (BRICK_VOXELS*channels);
+                pool.resize(pool.size() + BRICK_VOXELS*channels);
+            } else {
+                slot = freeSlots.back();
+                freeSlots.pop_back();
+            }
+            T* brick = &pool[slot*BRICK_VOXELS*channels];
+            for (unsigned int i=0; i<BRICK_VOXELS; i++)
+                for (unsigned int ch=0; ch<channels; ch++)
+                    brick[i*channels+ch] = background[ch];
+        }
+        return &pool[slot*BRICK_VOXELS*channels];
+    }
+
+    void Free(unsigned int bx, unsigned int by, unsigned int bz) {
+        int& slot = index[bx + (by + bz*bh)*bw];
+        if (slot < 0) return;
+        freeSlots.push_back(slot);
+        slot = -1;
+    }
+
+    /**
+     * Voxel lookup with wrap around, returns the background for
+     * voxels in empty bricks.
+     */
+    const T* GetVoxel(int x, int y, int z) const {
+        unsigned int X = Wrap(x,width), Y = Wrap(y,height), Z = Wrap(z,depth);
+        const T* brick = GetBrick(X/BRICK, Y/BRICK, Z/BRICK);
+        if (!brick) return &background[0];
+        return brick + ((X%BRICK) + ((Y%BRICK) + (Z%BRICK)*BRICK)*BRICK)*channels;
+    }
+
+    /**
+     * Free every brick whose used voxels are all within epsilon of
+     * the background.
+     */
+    void Compact(T epsilon = 0) {
+        for (unsigned int bz=0; bz<bd; bz++)
+            for (unsigned int by=0; by<bh; by++)
+                for (unsigned int bx=0; bx<bw; bx++) {
+                    const T* brick = GetBrick(bx,by,bz);
+                    if (!brick) continue;
+                    unsigned int nx = std::min(BRICK, width-bx*BRICK);
+                    unsigned int ny = std::min(BRICK, height-by*BRICK);
+                    unsigned int nz = std::min(BRICK, depth-bz*BRICK);
+                    bool empty = true;
+                    for (unsigned int z=0; z<nz && empty; z++)
+                        for (unsigned int y=0; y<ny && empty; y++)
+                            for (unsigned int x=0; x<nx && empty; x++)
+                                for (unsigned int ch=0; ch<channels; ch++)
+                                    if (std::fabs(brick[(x+(y+z*BRICK)*BRICK)*channels+ch]
+                                                  - background[ch]) > epsilon) {
+                                        empty = false;
+                                        break;
+                                    }
+                    if (empty) Free(bx,by,bz);
+                }
+    }
+};
+
+template <class T> const unsigned int BrickTexture3D<T>::BRICK;
+template <class T> const unsigned int BrickTexture3D<T>::BRICK_VOXELS;
+
+} // NS Resources
+} // NS OpenEngine
+
+#endif // _BRICK_TEXTURE_3D_H_
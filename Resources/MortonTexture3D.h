@@ -0,0 +1,165 @@
+// Tiled Morton order 3D texture.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _MORTON_TEXTURE_3D_H_
+#define _MORTON_TEXTURE_3D_H_
+
+#include <Resources/Texture3D.h>
+#include <Math/Vector.h>
+#include <boost/shared_ptr.hpp>
+#include <cmath>
+#include <vector>
+
+namespace OpenEngine {
+namespace Resources {
+
+template <class T> class MortonTexture3D;
+typedef MortonTexture3D<float> FloatMortonTexture3D;
+typedef boost::shared_ptr<FloatMortonTexture3D> FloatMortonTexture3DPtr;
+
+/**
+ * 3D texture stored as TILE^3 voxel tiles. Tiles are laid out x
+ * fastest, the voxels inside a tile in Morton (Z) order, so the 26
+ * neighbours of a voxel are almost always within the same 2KB tile or
+ * an adjacent one instead of a whole slice away.
+ *
+ * Sides are padded to a multiple of TILE, padding voxels are never
+ * read by the lookups since addressing wraps at the real size like
+ * Texture3D::GetVoxel.
+ */
+template <class T> class MortonTexture3D {
+ public:
+    static const unsigned int TILE = 8;
+    static const unsigned int TILE_VOXELS = TILE*TILE*TILE;
+
+ private:
+    unsigned int width, height, depth, channels;
+    unsigned int tx, ty, tz;
+    std::vector<T> data;
+
+    // spreads the three low bits of v three bits apart
+    static unsigned int Spread(unsigned int v) {
+        return (v & 1) | ((v & 2) << 2) | ((v & 4) << 4);
+    }
+
+    static unsigned int Wrap(int i, unsigned int n) {
+        int r = i % (int)n;
+        return r < 0 ? r + n : r;
+    }
+
+ public:
+    MortonTexture3D(unsigned int w, unsigned int h, unsigned int d,
+                    unsigned int c)
+        : width(w), height(h), depth(d), channels(c),
+          tx((w+TILE-1)/TILE), ty((h+TILE-1)/TILE), tz((d+TILE-1)/TILE),
+          data(tx*ty*tz*TILE_VOXELS*c, T()) {}
+
+    static boost::shared_ptr<MortonTexture3D<T> >
+    FromLinear(boost::shared_ptr<Texture3D<T> > tex) {
+        unsigned int w = tex->GetWidth();
+        unsigned int h = tex->GetHeight();
+        unsigned int d = tex->GetDepth();
+        unsigned int c = tex->GetChannels();
+        boost::shared_ptr<MortonTexture3D<T> >
+            out(new MortonTexture3D<T>(w,h,d,c));
+        const T* din = tex->GetData();
+        for (unsigned int z=0; z<d; z++)
+            for (unsigned int y=0; y<h; y++) {
+                const T* row = din + (y + z*h)*w*c;
+                for (unsigned int x=0; x<w; x++) {
+                    T* v = &out->data[out->Index(x,y,z)*c];
+                    for (unsigned int ch=0; ch<c; ch++)
+                        v[ch] = row[x*c+ch];
+                }
+            }
+        return out;
+    }
+
+    boost::shared_ptr<Texture3D<T> > ToLinear() const {
+        boost::shared_ptr<Texture3D<T> >
+            out(new Texture3D<T>(width,height,depth,channels));
+        T* dout = out->GetData();
+        for (unsigned int z=0; z<depth; z++)
+            for (unsigned int y=0; y<height; y++) {
+                T* row = dout + (y + z*height)*width*channels;
+                for (unsigned int x=0; x<width; x++) {
+                    const T* v = &data[Index(x,y,z)*channels];
+                    for (unsigned int ch=0; ch<channels; ch++)
+                        row[x*channels+ch] = v[ch];
+                }
+            }
+        return out;
+    }
+
+    unsigned int GetWidth() const { return width; }
+    unsigned int GetHeight() const { return height; }
+    unsigned int GetDepth() const { return depth; }
+    unsigned int GetChannels() const { return channels; }
+    unsigned int GetTilesX() const { return tx; }
+    unsigned int GetTilesY() const { return ty; }
+    unsigned int GetTilesZ() const { return tz; }
+
+    // Raw tiled storage including padding.
+    T* GetData() { return &data[0]; }
+    unsigned int GetSize() const { return data.size(); }
+
+    /**
+     * Voxel index of in-range coordinates, multiply by the number of
+     * channels for the offset into GetData.
+     */
+    unsigned int Index(unsigned int x, unsigned int y, unsigned int z) const {
+        unsigned int tile = x/TILE + (y/TILE + (z/TILE)*ty)*tx;
+        return tile*TILE_VOXELS
+            | Spread(x%TILE) | (Spread(y%TILE) << 1) | (Spread(z%TILE) << 2);
+    }
+
+    // First voxel of a tile.
+    T* GetTile(unsigned int i, unsigned int j, unsigned int k) {
+        return &data[(i + (j + k*ty)*tx)*TILE_VOXELS*channels];
+    }
+
+    // Voxel lookup with wrap around.
+    T* GetVoxel(int x, int y, int z) {
+        return &data[Index(Wrap(x,width), Wrap(y,height), Wrap(z,depth))
+                     * channels];
+    }
+
+    const T* GetVoxel(int x, int y, int z) const {
+        return &data[Index(Wrap(x,width), Wrap(y,height), Wrap(z,depth))
+                     * channels];
+    }
+
+    /**
+     * Trilinear lookup at normalized coordinates with wrap around.
+     */
+    Math::Vector<4,T> InterpolatedVoxel(float x, float y, float z) const {
+        float fx = x*width, fy = y*height, fz = z*depth;
+        int x0 = (int)std::floor(fx), y0 = (int)std::floor(fy);
+        int z0 = (int)std::floor(fz);
+        float ax = fx - x0, ay = fy - y0, az = fz - z0;
+        Math::Vector<4,T> v;
+        for (unsigned int i=0; i<8; i++) {
+            float wgt = ((i&1) ? ax : 1-ax) * ((i&2) ? ay : 1-ay)
+                * ((i&4) ? az : 1-az);
+            if (wgt == 0) continue;
+            const T* p = GetVoxel(x0 + (i&1), y0 + ((i>>1)&1), z0 + (i>>2));
+            for (unsigned int ch=0; ch<channels && ch<4; ch++)
+                v[ch] += p[ch] * wgt;
+        }
+        return v;
+    }
+};
+
+template <class T> const unsigned int MortonTexture3D<T>::TILE;
+template <class T> const unsigned int MortonTexture3D<T>::TILE_VOXELS;
+
+} // NS Resources
+} // NS OpenEngine
+
+#endif // _MORTON_TEXTURE_3D_H_
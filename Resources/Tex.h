@@ -7,93 +7,154 @@
 #include <Math/Math.h>
 #include <Math/Exceptions.h>
 #include <Logging/Logger.h>
+#include <Core/Exceptions.h>
+#include <algorithm>
+#include <new>
 
 using namespace OpenEngine;
 using namespace OpenEngine::Math;
 using namespace std;
 
 
-// @todo template parameter specifing number of dimensions
-template <typename T>
+/**
+ * D dimensional grid of T, x fastest. Storage is 64 byte aligned and
+ * every row (a run along x) starts on a 64 byte boundary, rows are
+ * GetPitch() elements apart. All elements, padding included, are
+ * value initialized.
+ */
+template <typename T, unsigned int D = 2>
 class Tex {
+public:
+    static const unsigned int ALIGNMENT = 64;
+
 private:
+    unsigned int dims[D];
+    // first two sizes, height is 1 for D = 1
     unsigned int width, height;
+    unsigned int pitch, rows;
+    unsigned char* block;
     T* data;
+
+    void Allocate(const unsigned int d[D]) {
+        rows = 1;
+        for (unsigned int i=0; i<D; i++) {
+            dims[i] = d[i];
+            if (i > 0) rows *= d[i];
+        }
+        width = dims[0];
+        height = D > 1 ? dims[1] : 1;
+        // smallest pitch that keeps every row aligned
+        pitch = dims[0];
+        while ((pitch * sizeof(T)) % ALIGNMENT) pitch++;
+        unsigned long n = (unsigned long)pitch * rows;
+        block = new unsigned char[n * sizeof(T) + ALIGNMENT];
+        unsigned long off = (unsigned long)block % ALIGNMENT;
+        data = (T*)(block + (off ? ALIGNMENT - off : 0));
+        for (unsigned long i=0; i<n; i++)
+            new (data + i) T();
+    }
+
+    // sizes beyond D are ignored, missing ones are 1
+    void Allocate(unsigned int width, unsigned int height, unsigned int depth) {
+        unsigned int d[D];
+        for (unsigned int i=0; i<D; i++)
+            d[i] = i == 0 ? width : (i == 1 ? height : (i == 2 ? depth : 1));
+        Allocate(d);
+    }
+
+    void Release() {
+        if (!block) return;
+        unsigned long n = (unsigned long)pitch * rows;
+        for (unsigned long i=0; i<n; i++)
+            data[i].~T();
+        delete[] block;
+        block = 0;
+        data = 0;
+    }
+
+    void CopyFrom(const Tex<T,D>& t) {
+        std::copy(t.data, t.data + (unsigned long)pitch * rows, data);
+    }
+
 public:
-    Tex(const Tex<T> & copyFromMe) : width(copyFromMe.width),
-                                     height(copyFromMe.height),
-                                     data(new T[width*height]) {
-        memcpy(data, copyFromMe.data, sizeof(T)*width*height);    
-        /*
-         std::copy(copyFromMe.data, 
-                   copyFromMe.data + (width*height), 
-                   data);
-        */
-    }
-
-    Tex(EmptyTextureResource& copyFromMe) {
-        width = copyFromMe.GetWidth();
-        height = copyFromMe.GetHeight();
-        data = new T[width*height];
-        unsigned char* d = copyFromMe.GetData();
-        for (unsigned int x=0; x<width; x++)
-            for (unsigned int y=0; y<height; y++)
-                (*this)(x,y) = (T) d[x+y*width] / (T)255;
-    }
-
-    Tex(unsigned int width, unsigned int height)
-      :  width(width), height(height) {
-      data = new T[height*width];
-      memset(data,height*width,0);
-    }
-
-
-    Tex<T> operator=(const Tex<T>& copy) {
-        if (width != copy.width && height != copy.height)
-            throw 42;
-        
-        memcpy(data, copy.data, sizeof(T)*width*height);    
-        /*
-        std::copy(copy.data,
-                  copy.data+(width*height),
-                  data);
-        */
+    Tex(const Tex<T,D> & copyFromMe) : block(0), data(0) {
+        Allocate(copyFromMe.dims);
+        CopyFrom(copyFromMe);
+    }
+
+    Tex(EmptyTextureResource& copyFromMe) : block(0), data(0) {
+        unsigned int w = copyFromMe.GetWidth(), h = copyFromMe.GetHeight();
+        Allocate(w, h, 1);
+        unsigned char* p = copyFromMe.GetData();
+        for (unsigned int x=0; x<w; x++)
+            for (unsigned int y=0; y<h; y++)
+                (*this)(x,y) = (T) p[x+y*w] / (T)255;
+    }
+
+    Tex(unsigned int width, unsigned int height) : block(0), data(0) {
+        Allocate(width, height, 1);
+    }
+
+    Tex(unsigned int width, unsigned int height, unsigned int depth)
+        : block(0), data(0) {
+        Allocate(width, height, depth);
+    }
+
+    // Sizes along each of the D dimensions.
+    Tex(const unsigned int size[D]) : block(0), data(0) {
+        Allocate(size);
+    }
+
+    Tex<T,D>& operator=(const Tex<T,D>& copy) {
+        if (this == &copy) return *this;
+        for (unsigned int i=0; i<D; i++)
+            if (dims[i] != copy.dims[i])
+                throw Core::Exception("Tex: dimensions differ");
+        CopyFrom(copy);
         return *this;
     }
 
+    // First element, rows are GetPitch() elements apart.
     T* GetData() {return data;}
 
     ~Tex() {
-        delete[] data;
-        data = 0;
+        Release();
     }
 
     unsigned int GetWidth() { return width; }
     unsigned int GetHeight() { return height; }
-
-    void SetTex(Tex<T>& t) {
-        width = t.width;
-        height = t.height;
-        if (data)
-            delete[] data;
-        data = new T[width*height];
-
-        memcpy(data, t.data, sizeof(T)*width*height);    
-        /*
-        std::copy(t.data, 
-                  t.data + (width*height), 
-                  data);
-        */
+    unsigned int GetDepth() { return D > 2 ? dims[2] : 1; }
+    unsigned int GetSize(unsigned int dim) { return dims[dim]; }
+    unsigned int GetPitch() { return pitch; }
+    unsigned int GetRows() { return rows; }
+
+    void SetTex(Tex<T,D>& t) {
+        Release();
+        Allocate(t.dims);
+        CopyFrom(t);
     }
 
+    // Row iy counting over all dimensions above x.
     T* operator[](const unsigned int iy) {
-        return data+ iy*width;
+        return data + (unsigned long)iy*pitch;
     }
 
     T& operator()(const unsigned int ix, const unsigned int iy) {
-      
-        return data[ix+iy*width];
+        return data[ix+(unsigned long)iy*pitch];
+    }
+
+    T& operator()(const unsigned int ix, const unsigned int iy,
+                  const unsigned int iz) {
+        return data[ix+((unsigned long)iz*height+iy)*pitch];
     }
+
+    T& operator()(const unsigned int i[D]) {
+        unsigned long row = 0;
+        for (unsigned int k=D-1; k>0; k--)
+            row = row*dims[k] + i[k];
+        return data[i[0]+row*pitch];
+    }
+
     void ToTexture(EmptyTextureResourcePtr t, bool dbg=false) ; 
     void CopyToTexture(EmptyTextureResourcePtr texture);
 
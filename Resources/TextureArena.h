@@ -0,0 +1,138 @@
+// Contiguous storage for many small textures.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _TEXTURE_ARENA_H_
+#define _TEXTURE_ARENA_H_
+
+#include <Resources/Texture2D.h>
+#include <algorithm>
+#include <vector>
+
+namespace OpenEngine {
+namespace Resources {
+
+template <class T> class TextureArena;
+typedef TextureArena<float> FloatTextureArena;
+typedef TextureArena<unsigned char> UCharTextureArena;
+
+/**
+ * Placement of a texture inside a larger texture, in texels.
+ */
+struct TextureRect {
+    unsigned int x, y, width, height;
+};
+
+/**
+ * Many small textures stored back to back in one buffer, used as the
+ * output of the batched TexUtils functions. Each entry is tightly
+ * packed with rows of width*channels elements.
+ *
+ * Pointers returned by GetData are invalidated when entries are
+ * added.
+ */
+template <class T> class TextureArena {
+ public:
+    struct Entry {
+        unsigned long offset;
+        unsigned int width, height, channels;
+    };
+
+ private:
+    // raw storage, new entries are not zero filled since the batch
+    // functions overwrite them anyway
+    T* data;
+    unsigned long size, capacity;
+    std::vector<Entry> entries;
+
+    void Grow(unsigned long elements) {
+        if (elements <= capacity) return;
+        T* grown = new T[elements];
+        std::copy(data, data + size, grown);
+        delete[] data;
+        data = grown;
+        capacity = elements;
+    }
+
+ public:
+    TextureArena() : data(NULL), size(0), capacity(0) {}
+
+    TextureArena(const TextureArena<T>& o)
+        : data(NULL), size(0), capacity(0), entries(o.entries) {
+        Grow(o.size);
+        std::copy(o.data, o.data + o.size, data);
+        size = o.size;
+    }
+
+    TextureArena<T>& operator=(const TextureArena<T>& o) {
+        if (this != &o) {
+            TextureArena<T> copy(o);
+            std::swap(data, copy.data);
+            std::swap(size, copy.size);
+            std::swap(capacity, copy.capacity);
+            entries.swap(copy.entries);
+        }
+        return *this;
+    }
+
+    ~TextureArena() { delete[] data; }
+
+    // Reserve room for a number of elements, to avoid regrowing.
+    void Reserve(unsigned long elements) { Grow(elements); }
+
+    /**
+     * Append an uninitialized entry.
+     *
+     * @return index of the new entry
+     */
+    unsigned int Add(unsigned int width, unsigned int height,
+                     unsigned int channels) {
+        Entry e;
+        e.offset = size;
+        e.width = width;
+        e.height = height;
+        e.channels = channels;
+        unsigned long end = size + (unsigned long)width*height*channels;
+        // grow geometrically like a vector when not reserved
+        if (end > capacity) Grow(std::max(end, 2 * capacity));
+        entries.push_back(e);
+        size = end;
+        return entries.size() - 1;
+    }
+
+    void Clear() {
+        size = 0;
+        entries.clear();
+    }
+
+    unsigned int GetCount() const { return entries.size(); }
+    const Entry& GetEntry(unsigned int i) const { return entries[i]; }
+
+    // Elements in use by all entries.
+    unsigned long GetSize() const { return size; }
+
+    T* GetData() { return size ? data : NULL; }
+    T* GetData(unsigned int i) { return data + entries[i].offset; }
+    const T* GetData(unsigned int i) const { return data + entries[i].offset; }
+
+    // Copy an entry out as a stand alone texture.
+    boost::shared_ptr<Texture2D<T> > GetTexture(unsigned int i) const {
+        const Entry& e = entries[i];
+        boost::shared_ptr<Texture2D<T> >
+            tex(new Texture2D<T>(e.width, e.height, e.channels));
+        const T* from = data + e.offset;
+        std::copy(from, from + (unsigned long)e.width*e.height*e.channels,
+                  tex->GetData());
+        return tex;
+    }
+};
+
+} // NS Resources
+} // NS OpenEngine
+
+#endif // _TEXTURE_ARENA_H_
@@ -0,0 +1,277 @@
+// Texture atlas with skyline packing.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _TEXTURE_ATLAS_H_
+#define _TEXTURE_ATLAS_H_
+
+#include <Core/Event.h>
+#include <Core/Exceptions.h>
+#include <Math/Vector.h>
+#include "EmptyTextureResource.h"
+#include "Tex.h"
+#include "TextureArena.h"
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+namespace OpenEngine {
+namespace Resources {
+
+class TextureAtlas;
+
+/**
+ * Region of the atlas written since the last flush.
+ */
+struct TextureAtlasDirtyEventArg {
+    TextureAtlas* atlas;
+    TextureRect rect;
+};
+
+/**
+ * Packs many byte textures into one EmptyTextureResource. Placement
+ * uses a bottom left skyline, which handles a stream of incremental
+ * inserts well and needs no knowledge of later sizes.
+ *
+ * Texture data is copied a row at a time. Written regions are
+ * collected and reported through dirtyEvent on Flush, so a renderer
+ * can upload sub rectangles instead of the whole atlas.
+ *
+ * Entries are identified by the index returned from Insert or
+ * Allocate, GetUVTable lists their texture coordinates in that order.
+ */
+class TextureAtlas {
+ private:
+    struct SkylineNode {
+        unsigned int x, y, width;
+    };
+
+    EmptyTextureResourcePtr texture;
+    unsigned int width, height, channels, padding;
+    std::vector<SkylineNode> skyline;
+    std::vector<TextureRect> rects;
+    std::vector<TextureRect> dirty;
+    unsigned long used;
+
+    /**
+     * Lowest y a w x h rectangle can be placed at when its left side
+     * is at skyline node i, or false if it does not fit.
+     */
+    bool Fit(unsigned int i, unsigned int w, unsigned int h,
+             unsigned int& y) const {
+        unsigned int x = skyline[i].x;
+        if (x + w > width) return false;
+        int left = w;
+        y = skyline[i].y;
+        for (unsigned int j=i; left > 0; j++) {
+            if (skyline[j].y > y) y = skyline[j].y;
+            if (y + h > height) return false;
+            left -= skyline[j].width;
+        }
+        return true;
+    }
+
+    void AddLevel(unsigned int i, unsigned int x, unsigned int y,
+                  unsigned int w, unsigned int h) {
+        SkylineNode n = { x, y + h, w };
+        skyline.insert(skyline.begin() + i, n);
+        // cut the nodes now covered by the new one
+        for (unsigned int j=i+1; j<skyline.size(); j++) {
+            const SkylineNode& prev = skyline[j-1];
+            if (skyline[j].x >= prev.x + prev.width) break;
+            unsigned int shrink = prev.x + prev.width - skyline[j].x;
+            if (shrink >= skyline[j].width) {
+                skyline.erase(skyline.begin() + j);
+                j--;
+            } else {
+                skyline[j].x += shrink;
+                skyline[j].width -= shrink;
+                break;
+            }
+        }
+        // merge neighbours at the same height
+        for (unsigned int j=0; j+1<skyline.size(); j++) {
+            if (skyline[j].y == skyline[j+1].y) {
+                skyline[j].width += skyline[j+1].width;
+                skyline.erase(skyline.begin() + j + 1);
+                j--;
+            }
+        }
+    }
+
+    void CheckFormat(unsigned int c) const {
+        if (c != channels)
+            throw Core::Exception("TextureAtlas: channel count differs from atlas");
+    }
+
+ public:
+    /**
+     * @param depth bits per texel of the atlas, 8, 24 or 32
+     * @param padding empty texels kept to the right of and below each
+     * entry, against filtering bleed, except at the atlas edges
+     */
+    TextureAtlas(unsigned int width, unsigned int height,
+                 unsigned int depth = 32, unsigned int padding = 1)
+        : texture(EmptyTextureResource::Create(width, height, depth)),
+          width(width), height(height), channels(depth/8),
+          padding(padding), used(0) {
+        Clear();
+    }
+
+    // Drop all entries, the texture data is left as is.
+    void Clear() {
+        skyline.clear();
+        SkylineNode n = { 0, 0, width };
+        skyline.push_back(n);
+        rects.clear();
+        dirty.clear();
+        used = 0;
+    }
+
+    /**
+     * Reserve a w x h region without copying anything, for callers
+     * that write the texels themselves, e.g. through the atlas
+     * overloads of the TexUtils batch functions. The region is marked
+     * dirty.
+     *
+     * @return entry index or -1 if the atlas is full
+     */
+    int Allocate(unsigned int w, unsigned int h) {
+        int best = -1;
+        unsigned int bestY = 0, bestTop = 0, bestWidth = 0, bestPW = 0, bestPH = 0;
+        for (unsigned int i=0; i<skyline.size(); i++) {
+            // no padding is needed against the atlas edges
+            unsigned int x = skyline[i].x;
+            if (x + w > width) continue;
+            unsigned int pw = std::min(w + padding, width - x);
+            unsigned int y;
+            if (!Fit(i, pw, h, y)) continue;
+            unsigned int ph = std::min(h + padding, height - y);
+            unsigned int top = y + ph;
+            if (best < 0 || top < bestTop ||
+                (top == bestTop && skyline[i].width < bestWidth)) {
+                best = i;
+                bestY = y;
+                bestTop = top;
+                bestWidth = skyline[i].width;
+                bestPW = pw;
+                bestPH = ph;
+            }
+        }
+        if (best < 0) return -1;
+
+        TextureRect r = { skyline[best].x, bestY, w, h };
+        AddLevel(best, r.x, r.y, bestPW, bestPH);
+        rects.push_back(r);
+        dirty.push_back(r);
+        used += (unsigned long)w * h;
+        return rects.size() - 1;
+    }
+
+    /**
+     * Copy tightly packed texels into a new region.
+     *
+     * @return entry index or -1 if the atlas is full
+     */
+    int Insert(const unsigned char* data, unsigned int w, unsigned int h,
+               unsigned int c) {
+        CheckFormat(c);
+        int id = Allocate(w, h);
+        if (id < 0) return id;
+        const TextureRect& r = rects[id];
+        unsigned char* dst = texture->GetData();
+        for (unsigned int y=0; y<h; y++)
+            std::memcpy(dst + ((r.y + y) * width + r.x) * channels,
+                        data + y * w * c, w * c);
+        return id;
+    }
+
+    int Insert(ITexture2DPtr tex) {
+        if (tex->GetType() != Types::UBYTE)
+            throw Core::Exception("TextureAtlas: not a byte texture");
+        return Insert((const unsigned char*)tex->GetVoidDataPtr(),
+                      tex->GetWidth(), tex->GetHeight(), tex->GetChannels());
+    }
+
+    /**
+     * Insert a Tex export into a single channel atlas, values are
+     * mapped to bytes as by Tex::CopyToTexture.
+     */
+    template <class T> int Insert(Tex<T>& tex) {
+        CheckFormat(1);
+        unsigned int w = tex.GetWidth(), h = tex.GetHeight();
+        int id = Allocate(w, h);
+        if (id < 0) return id;
+        const TextureRect& r = rects[id];
+        unsigned char* dst = texture->GetData();
+        for (unsigned int y=0; y<h; y++) {
+            unsigned char* row = dst + (r.y + y) * width + r.x;
+            const T* src = tex[y];
+            for (unsigned int x=0; x<w; x++)
+                row[x] = (unsigned char)(src[x] * 255);
+        }
+        return id;
+    }
+
+    /**
+     * Report the regions written since the last flush through
+     * dirtyEvent. With rebind set the texture changed event is fired
+     * as well, for listeners that only upload whole textures.
+     */
+    void Flush(bool rebind = false) {
+        std::vector<TextureRect> pending;
+        pending.swap(dirty);
+        for (unsigned int i=0; i<pending.size(); i++) {
+            TextureAtlasDirtyEventArg arg = { this, pending[i] };
+            dirtyEvent.Notify(arg);
+        }
+        if (rebind && !pending.empty())
+            texture->RebindTexture();
+    }
+
+    Core::Event<TextureAtlasDirtyEventArg> dirtyEvent;
+
+    EmptyTextureResourcePtr GetTexture() { return texture; }
+    unsigned int GetWidth() const { return width; }
+    unsigned int GetHeight() const { return height; }
+    unsigned int GetChannels() const { return channels; }
+    unsigned int GetCount() const { return rects.size(); }
+
+    const TextureRect& GetRect(unsigned int id) const { return rects[id]; }
+    const std::vector<TextureRect>& GetRects() const { return rects; }
+    const std::vector<TextureRect>& GetDirtyRects() const { return dirty; }
+
+    // Fraction of the atlas covered by entries, padding excluded.
+    float GetOccupancy() const {
+        return (float)used / ((float)width * height);
+    }
+
+    /**
+     * Texture coordinates of an entry as (u0, v0, u1, v1), at the
+     * outer texel edges.
+     */
+    Math::Vector<4,float> GetUV(unsigned int id) const {
+        const TextureRect& r = rects[id];
+        return Math::Vector<4,float>((float)r.x / width,
+                                     (float)r.y / height,
+                                     (float)(r.x + r.width) / width,
+                                     (float)(r.y + r.height) / height);
+    }
+
+    std::vector<Math::Vector<4,float> > GetUVTable() const {
+        std::vector<Math::Vector<4,float> > uvs(rects.size());
+        for (unsigned int i=0; i<rects.size(); i++)
+            uvs[i] = GetUV(i);
+        return uvs;
+    }
+};
+
+} // NS Resources
+} // NS OpenEngine
+
+#endif // _TEXTURE_ATLAS_H_
@@ -0,0 +1,560 @@
+// Incrementally animated value noise.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _ANIMATED_VALUE_NOISE_
+#define _ANIMATED_VALUE_NOISE_
+
+#include <Core/Exceptions.h>
+#include <Math/Vector.h>
+#include <Utils/ValueNoise.h>
+#include <Utils/ParallelFor.h>
+#include <Utils/TexProfiler.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+namespace OpenEngine {
+namespace Utils {
+
+/**
+ * Value noise that moves over time without being regenerated.
+ *
+ * The octaves are built like ValueNoise::Generate and Generate3D, each
+ * is the coarser result interpolated up, plus its own lattice, then
+ * blurred. Lattices are unbounded and hashed from their world cell
+ * instead of drawn from the random generator, and the texture is a
+ * window of the result. The window moves with velocity, so every
+ * cell keeps its value while it stays inside the window.
+ *
+ * Every octave is stored as a ring buffer over its window. When the
+ * time changes, only the cells that entered a window are computed,
+ * with the blur margins they need. The finest ring buffer is the
+ * texture itself, texel i holds the window cell congruent to i modulo
+ * the size, and GetOffset gives the texture coordinate offset that
+ * follows the window, fraction included.
+ *
+ * SetDrift lets an octave evolve by moving its lattice relative to the
+ * window, interpolated linearly between whole cells so it moves
+ * without steps. The construction is linear, so a drifting octave's
+ * share of the texture is its lattice alone carried through the finer
+ * levels, and shifting that lattice by a whole cell shifts the share
+ * by ratio^octave texels. Each drifting octave therefore keeps its own
+ * stack of ring buffers, one such span wider along the drift, whose
+ * window follows the whole cells of the drift and is updated like the
+ * main window. The texture is the sum of the other octaves and the
+ * drifting shares blended at the fraction, composed every update at a
+ * few reads per texel. Halfway between cells the blend lowers the
+ * contrast of that octave slightly.
+ *
+ * Octave spacing is the integer ratio nearest 1/mResolution. Like
+ * PointNoise the result matches ValueNoise statistically, not value
+ * for value.
+ */
+class AnimatedValueNoise {
+ private:
+    struct Level {
+        int n[3];           // window size in cells
+        int origin[3];      // world cell at the window start
+        float amplitude;    // signed, lattice values in [0;2*bandwidth)
+        unsigned int seed;
+        bool lattice;       // adds its own lattice values
+        bool blur;          // blurred after combining, all but the coarsest octave
+        float* data;        // ring buffer
+        std::vector<float> storage;
+    };
+
+    /**
+     * Levels from the finest up to a top octave. The first stack holds
+     * the lattices of every octave that does not drift, the others
+     * one drifting octave each.
+     */
+    struct Stack {
+        std::vector<Level> levels;
+        float driftVelocity[3];
+        int drift[3];       // whole cells of the drift
+        float frac[3];      // and the fraction towards the next
+        int span;           // finest cells per top cell
+    };
+
+    std::vector<Stack> stacks;
+    NoiseParameters params;
+    std::vector<Math::Vector<3,float> > drifts;
+    unsigned int dims, ratio, passes;
+    int size[3];
+    float velocity[3];
+    double time;
+    bool built;
+    unsigned long updated;
+    REAL (*curve)(REAL);
+    FloatTexture2DPtr tex;
+    FloatTexture3DPtr tex3d;
+
+    // levels point into their own storage
+    AnimatedValueNoise(const AnimatedValueNoise&);
+    AnimatedValueNoise& operator=(const AnimatedValueNoise&);
+
+    static unsigned int Hash(unsigned int x, unsigned int y, unsigned int z,
+                             unsigned int seed) {
+        unsigned int h = (x * 0x8da6b343u) ^ (y * 0xd8163841u)
+            ^ (z * 0xcb1ab31fu) ^ seed;
+        h ^= h >> 16;
+        h *= 0x7feb352du;
+        h ^= h >> 15;
+        h *= 0x846ca68bu;
+        h ^= h >> 16;
+        return h;
+    }
+
+    static int FloorDiv(int a, int b) {
+        int q = a / b;
+        return (a % b != 0 && a < 0) ? q - 1 : q;
+    }
+
+    static int Mod(int a, int b) {
+        int r = a % b;
+        return r < 0 ? r + b : r;
+    }
+
+    // lattice value of a level at a world cell
+    static float Value(const Level& l, int x, int y, int z) {
+        unsigned int h = Hash(x, y, z, l.seed);
+        return (h >> 8) * (1.0f / 16777216.0f) * l.amplitude;
+    }
+
+    bool Drifts(unsigned int octave) const {
+        for (unsigned int a=0; a<dims; a++)
+            if (drifts[octave][a] != 0) return true;
+        return false;
+    }
+
+    // window of level k for a given window of level k-1
+    void CoarserOrigin(const int finer[3], int coarser[3]) const {
+        for (unsigned int a=0; a<3; a++)
+            coarser[a] = a < dims ? FloorDiv(finer[a] - (int)passes, ratio) : 0;
+    }
+
+    // one box blur pass along an axis, out is two cells shorter
+    static void Box(const std::vector<float>& in, const int m[3],
+                    unsigned int axis, std::vector<float>& out) {
+        int o[3] = { m[0], m[1], m[2] };
+        o[axis] -= 2;
+        out.resize(o[0] * o[1] * o[2]);
+        const int step = axis == 0 ? 1 : (axis == 1 ? m[0] : m[0] * m[1]);
+        for (int z=0; z<o[2]; z++)
+            for (int y=0; y<o[1]; y++) {
+                const float* src = &in[(y + z*m[1]) * m[0]];
+                float* dst = &out[(y + z*o[1]) * o[0]];
+                for (int x=0; x<o[0]; x++) {
+                    const float* c = src + x + step;
+                    dst[x] = (c[-step] + c[0] + c[step]) / 3;
+                }
+            }
+    }
+
+    /**
+     * Compute the cells [lo;hi) of level k of a stack from its lattice
+     * and the coarser level, which must already cover them.
+     */
+    void ComputeBox(Stack& s, unsigned int k, const int lo[3], const int hi[3]) {
+        Level& l = s.levels[k];
+        int m[3];
+        for (unsigned int a=0; a<3; a++)
+            m[a] = hi[a] - lo[a];
+        if (m[0] <= 0 || m[1] <= 0 || m[2] <= 0) return;
+        TEXUTILS_PROFILE_SCOPE("AnimatedValueNoise::Update", m[0] * m[1] * m[2],
+                               m[0] * m[1] * m[2] * sizeof(float), k);
+        updated += (unsigned long)m[0] * m[1] * m[2];
+
+        // margins for the blur passes
+        int e[3], b[3];
+        for (unsigned int a=0; a<3; a++) {
+            e[a] = l.blur && a < dims ? passes : 0;
+            b[a] = lo[a] - e[a];
+            m[a] += 2 * e[a];
+        }
+        std::vector<float> p(m[0] * m[1] * m[2], 0.0f), q;
+        if (k + 1 < s.levels.size()) {
+            const Level& c = s.levels[k+1];
+            std::vector<int> i0[3], i1[3];
+            std::vector<float> t[3];
+            for (unsigned int a=0; a<3; a++) {
+                i0[a].resize(m[a]); i1[a].resize(m[a]); t[a].resize(m[a]);
+                for (int j=0; j<m[a]; j++) {
+                    int w = b[a] + j;
+                    int f = a < dims ? FloorDiv(w, ratio) : w;
+                    t[a][j] = a < dims ? (float)(w - f * (int)ratio) / ratio : 0;
+                    i0[a][j] = Mod(f, c.n[a]);
+                    i1[a][j] = Mod(f + 1, c.n[a]);
+                }
+            }
+            for (int z=0; z<m[2]; z++) {
+                const float* s0 = c.data + i0[2][z] * c.n[0] * c.n[1];
+                const float* s1 = c.data + i1[2][z] * c.n[0] * c.n[1];
+                const float tz = t[2][z];
+                for (int y=0; y<m[1]; y++) {
+                    const int r0 = i0[1][y] * c.n[0], r1 = i1[1][y] * c.n[0];
+                    const float ty = t[1][y];
+                    float* out = &p[(y + z*m[1]) * m[0]];
+                    for (int x=0; x<m[0]; x++) {
+                        const int x0 = i0[0][x], x1 = i1[0][x];
+                        const float tx = t[0][x];
+                        float a0 = s0[r0+x0] + (s0[r0+x1] - s0[r0+x0]) * tx;
+                        float a1 = s0[r1+x0] + (s0[r1+x1] - s0[r1+x0]) * tx;
+                        float v = a0 + (a1 - a0) * ty;
+                        if (tz != 0) {
+                            float b0 = s1[r0+x0] + (s1[r0+x1] - s1[r0+x0]) * tx;
+                            float b1 = s1[r1+x0] + (s1[r1+x1] - s1[r1+x0]) * tx;
+                            v += (b0 + (b1 - b0) * ty - v) * tz;
+                        }
+                        out[x] = v;
+                    }
+                }
+            }
+        }
+        if (l.lattice)
+            for (int z=0; z<m[2]; z++)
+                for (int y=0; y<m[1]; y++) {
+                    float* out = &p[(y + z*m[1]) * m[0]];
+                    for (int x=0; x<m[0]; x++)
+                        out[x] += Value(l, b[0]+x, b[1]+y, b[2]+z);
+                }
+        if (l.blur)
+            for (unsigned int i=0; i<passes; i++)
+                for (unsigned int a=0; a<dims; a++) {
+                    Box(p, m, a, q);
+                    m[a] -= 2;
+                    p.swap(q);
+                }
+
+        // the curve goes on the texture, when nothing drifts that is
+        // this ring buffer
+        const bool final = k == 0 && curve && stacks.size() == 1;
+        for (int z=0; z<m[2]; z++) {
+            const int rz = Mod(lo[2] + z, l.n[2]);
+            for (int y=0; y<m[1]; y++) {
+                float* row = l.data + (Mod(lo[1] + y, l.n[1]) + rz * l.n[1]) * l.n[0];
+                const float* in = &p[(y + z*m[1]) * m[0]];
+                int rx = Mod(lo[0], l.n[0]);
+                for (int x=0; x<m[0]; x++) {
+                    row[rx] = final ? curve(in[x]) : in[x];
+                    if (++rx == l.n[0]) rx = 0;
+                }
+            }
+        }
+    }
+
+    // cells of the new window of level k outside the old one
+    void ComputeExposed(Stack& s, unsigned int k, const int old[3]) {
+        const Level& l = s.levels[k];
+        int lo[3], hi[3];
+        for (unsigned int a=0; a<3; a++) {
+            lo[a] = l.origin[a];
+            hi[a] = l.origin[a] + l.n[a];
+        }
+        for (unsigned int a=0; a<3; a++) {
+            int d = l.origin[a] - old[a];
+            if (d == 0) continue;
+            int slo[3] = { lo[0], lo[1], lo[2] };
+            int shi[3] = { hi[0], hi[1], hi[2] };
+            if (d > 0) {
+                slo[a] = old[a] + l.n[a];
+                hi[a] = slo[a];
+            } else {
+                shi[a] = old[a];
+                lo[a] = shi[a];
+            }
+            ComputeBox(s, k, slo, shi);
+        }
+    }
+
+    // move the windows of a stack so the finest starts at origin
+    void Update(Stack& s, const int origin[3]) {
+        const unsigned int n = s.levels.size();
+        std::vector<int> origins(3 * n);
+        for (unsigned int a=0; a<3; a++)
+            origins[a] = origin[a];
+        for (unsigned int k=1; k<n; k++)
+            CoarserOrigin(&origins[3*(k-1)], &origins[3*k]);
+
+        bool full = !built;
+        for (int k=n-1; k>=0; k--) {
+            Level& l = s.levels[k];
+            int old[3];
+            bool far = false;
+            for (unsigned int a=0; a<3; a++) {
+                old[a] = l.origin[a];
+                l.origin[a] = origins[3*k + a];
+                if (std::abs(l.origin[a] - old[a]) >= l.n[a]) far = true;
+            }
+            if (full || far) {
+                int hi[3] = { l.origin[0] + l.n[0], l.origin[1] + l.n[1],
+                              l.origin[2] + l.n[2] };
+                ComputeBox(s, k, l.origin, hi);
+                // every finer cell depends on this octave
+                full = true;
+            } else
+                ComputeExposed(s, k, old);
+        }
+    }
+
+    // rows of the texture, the first stack plus the weighted corners
+    struct ComposeRows {
+        const float* base;
+        float* out;
+        int n[3];
+        unsigned int corners;
+        const float* weight;
+        const float* const* data;
+        // per corner the x indices and the y and z offsets
+        const int *xs, *ys, *zs;
+        REAL (*curve)(REAL);
+
+        void operator()(unsigned int from, unsigned int to) {
+            for (unsigned int r=from; r<to; r++) {
+                const int y = r % n[1], z = r / n[1];
+                float* row = out + r * n[0];
+                std::copy(base + r * n[0], base + (r+1) * n[0], row);
+                // a corner at a time, so the inner loops stay simple
+                for (unsigned int i=0; i<corners; i++) {
+                    const float* src = data[i] + ys[i*n[1] + y] + zs[i*n[2] + z];
+                    const int* x = xs + i * n[0];
+                    const float w = weight[i];
+                    for (int j=0; j<n[0]; j++)
+                        row[j] += w * src[x[j]];
+                }
+                if (curve)
+                    for (int j=0; j<n[0]; j++)
+                        row[j] = curve(row[j]);
+            }
+        }
+    };
+
+    // the texture from the first stack and the blended drifting shares
+    void Compose() {
+        const Level& base = stacks[0].levels[0];
+        const int* n = base.n;
+
+        // every corner of a drifting octave with a nonzero weight, with
+        // its ring buffer offsets along the three axes
+        std::vector<float> weight;
+        std::vector<const float*> data;
+        std::vector<int> offsets[3];
+        for (unsigned int i=1; i<stacks.size(); i++) {
+            const Stack& s = stacks[i];
+            const Level& l = s.levels[0];
+            const int stride[3] = { 1, l.n[0], l.n[0] * l.n[1] };
+            for (unsigned int c=0; c<8; c++) {
+                float w = 1;
+                for (unsigned int a=0; a<3; a++)
+                    w *= (c >> a & 1) ? s.frac[a] : 1 - s.frac[a];
+                if (w == 0) continue;
+                weight.push_back(w);
+                data.push_back(l.data);
+                for (unsigned int a=0; a<3; a++) {
+                    const int shift = (s.drift[a] + (c >> a & 1)) * s.span;
+                    for (int j=0; j<n[a]; j++) {
+                        // world cell held by texel j
+                        const int cell = base.origin[a] + Mod(j - base.origin[a], n[a]);
+                        offsets[a].push_back(Mod(cell + shift, l.n[a]) * stride[a]);
+                    }
+                }
+            }
+        }
+        const unsigned int corners = weight.size();
+        TEXUTILS_PROFILE_SCOPE("AnimatedValueNoise::Compose", n[0] * n[1] * n[2],
+                               n[0] * n[1] * n[2] * (corners + 2) * sizeof(float), -1);
+        updated += (unsigned long)n[0] * n[1] * n[2];
+
+        ComposeRows job = { base.data, dims == 3 ? tex3d->GetData() : tex->GetData(),
+                            { n[0], n[1], n[2] }, corners, &weight[0], &data[0],
+                            &offsets[0][0], &offsets[1][0], &offsets[2][0], curve };
+        ParallelFor::Run(0, n[1] * n[2], job, 0, 16);
+    }
+
+    /**
+     * Lay out the stacks for the current drifts, the first stack
+     * covering the texture and the non drifting lattices, then one per
+     * drifting octave up to that octave only.
+     */
+    void Build() {
+        const unsigned int octaves = params.layers + 1;
+        stacks.clear();
+        for (unsigned int top=0; top<=octaves; top++) {
+            const bool first = top == octaves;
+            if (!first && !Drifts(top)) continue;
+            Stack s;
+            const unsigned int count = first ? octaves : top + 1;
+            s.span = 1;
+            for (unsigned int k=0; !first && k<top; k++)
+                s.span *= ratio;
+            for (unsigned int a=0; a<3; a++) {
+                s.driftVelocity[a] = first ? 0 : drifts[top][a];
+                s.drift[a] = 0;
+                s.frac[a] = 0;
+            }
+            s.levels.resize(count);
+            unsigned int bandwidth = params.bandwidth;
+            for (unsigned int k=0; k<count; k++) {
+                Level& l = s.levels[k];
+                for (unsigned int a=0; a<3; a++) {
+                    if (k == 0)
+                        // room for the cell the blend reaches
+                        l.n[a] = size[a] + (s.driftVelocity[a] != 0 ? s.span : 0);
+                    else l.n[a] = a < dims
+                        ? (s.levels[k-1].n[a] + 2*passes + ratio - 1) / ratio + 2 : 1;
+                    l.origin[a] = 0;
+                }
+                l.amplitude = 2.0f * bandwidth;
+                // the 3D generator negates even levels above the coarsest
+                unsigned int level = params.layers - k;
+                if (dims == 3 && level != 0 && level % 2 == 0)
+                    l.amplitude = -l.amplitude;
+                l.seed = Hash(params.seed, k, 0x9e3779b9u, 0);
+                l.lattice = first ? !Drifts(k) : k == top;
+                l.blur = k < params.layers;
+                bandwidth = (unsigned int)(bandwidth * params.mBandwidth);
+            }
+            // the first stack is put in front
+            if (first) stacks.insert(stacks.begin(), s);
+            else stacks.push_back(s);
+        }
+
+        for (unsigned int i=0; i<stacks.size(); i++)
+            for (unsigned int k=0; k<stacks[i].levels.size(); k++) {
+                Level& l = stacks[i].levels[k];
+                if (i == 0 && k == 0 && stacks.size() == 1) {
+                    l.storage.clear();
+                    l.data = dims == 3 ? tex3d->GetData() : tex->GetData();
+                } else {
+                    l.storage.resize(l.n[0] * l.n[1] * l.n[2]);
+                    l.data = &l.storage[0];
+                }
+            }
+        built = false;
+    }
+
+ public:
+    /**
+     * @param velocity window movement in texels per time unit
+     * @param curve optional function applied to the output texels as
+     * they are computed, e.g. a fixed range tone curve
+     */
+    AnimatedValueNoise(const NoiseParameters& params,
+                       Math::Vector<3,float> velocity,
+                       REAL (*curve)(REAL) = NULL)
+        : params(params), drifts(params.layers + 1),
+          dims(params.Is3D() ? 3 : 2), time(0), built(false), updated(0),
+          curve(curve) {
+        if (params.mResolution <= 0 || params.mResolution >= 1)
+            throw Core::Exception("AnimatedValueNoise: mResolution must be in (0;1)");
+        ratio = (unsigned int)(1.0f / params.mResolution + 0.5f);
+        if (ratio < 2) ratio = 2;
+        // Generate3D blurs params.blur times, Generate once
+        passes = params.Is3D() ? params.blur : 1;
+        for (unsigned int a=0; a<3; a++)
+            this->velocity[a] = a < dims ? velocity[a] : 0;
+
+        size[0] = params.xResolution;
+        size[1] = params.yResolution;
+        size[2] = params.Is3D() ? params.zResolution : 1;
+        if (size[0] == 0 || size[1] == 0)
+            throw Core::Exception("AnimatedValueNoise: empty resolution");
+        if (dims == 3)
+            tex3d = FloatTexture3DPtr(new FloatTexture3D(size[0], size[1], size[2], 1));
+        else
+            tex = FloatTexture2DPtr(new FloatTexture2D(size[0], size[1], 1));
+        Build();
+        SetTime(0);
+    }
+
+    /**
+     * Move the lattice of an octave, 0 being the finest, by the given
+     * number of its own cells per time unit, measured from time 0.
+     * Changing which octaves drift lays out the ring buffers again and
+     * rebuilds the texture at the current time.
+     */
+    void SetDrift(unsigned int octave, Math::Vector<3,float> cellsPerTime) {
+        if (octave >= drifts.size())
+            throw Core::Exception("AnimatedValueNoise: no such octave");
+        const bool drifted = Drifts(octave);
+        for (unsigned int a=0; a<3; a++)
+            drifts[octave][a] = a < dims ? cellsPerTime[a] : 0;
+        // the stack of an octave drifting along the same axes is kept
+        bool same = drifted == Drifts(octave);
+        for (unsigned int i=1; same && i<stacks.size(); i++) {
+            Stack& s = stacks[i];
+            if (s.levels.size() != octave + 1) continue;
+            for (unsigned int a=0; a<3; a++) {
+                if ((s.driftVelocity[a] != 0) != (drifts[octave][a] != 0))
+                    same = false;
+                s.driftVelocity[a] = drifts[octave][a];
+            }
+        }
+        if (!same) Build();
+        SetTime(time);
+    }
+
+    /**
+     * Bring the texture to time t, computing only what changed since
+     * the last update.
+     */
+    void SetTime(double t) {
+        updated = 0;
+        int origin[3];
+        for (unsigned int a=0; a<3; a++)
+            origin[a] = a < dims ? (int)std::floor(velocity[a] * t) : 0;
+        Update(stacks[0], origin);
+        for (unsigned int i=1; i<stacks.size(); i++) {
+            Stack& s = stacks[i];
+            int shifted[3];
+            for (unsigned int a=0; a<3; a++) {
+                double d = s.driftVelocity[a] * t;
+                s.drift[a] = (int)std::floor(d);
+                s.frac[a] = (float)(d - s.drift[a]);
+                shifted[a] = origin[a] + s.drift[a] * s.span;
+            }
+            Update(s, shifted);
+        }
+        if (stacks.size() > 1) Compose();
+        built = true;
+        time = t;
+    }
+
+    void Advance(double dt) { SetTime(time + dt); }
+
+    double GetTime() const { return time; }
+
+    /**
+     * Cells of all octaves computed by the last update, plus the
+     * texels composed when octaves drift.
+     */
+    unsigned long GetUpdatedTexels() const { return updated; }
+
+    /**
+     * Offset to add to texture coordinates to sample the window at
+     * the current time.
+     */
+    Math::Vector<3,float> GetOffset() const {
+        return Math::Vector<3,float>((float)(velocity[0] * time / size[0]),
+                                     (float)(velocity[1] * time / size[1]),
+                                     (float)(velocity[2] * time / size[2]));
+    }
+
+    // The ring buffered result, for 2D parameters.
+    FloatTexture2DPtr GetTexture() { return tex; }
+
+    // The ring buffered result, for 3D parameters.
+    FloatTexture3DPtr GetTexture3D() { return tex3d; }
+};
+
+} // NS Utils
+} // NS OpenEngine
+
+#endif // _ANIMATED_VALUE_NOISE_
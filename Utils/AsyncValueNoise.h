@@ -0,0 +1,310 @@
+// Asynchronous value noise generation.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _ASYNC_VALUE_NOISE_
+#define _ASYNC_VALUE_NOISE_
+
+#include <Utils/ValueNoise.h>
+#include <Utils/NoiseCache.h>
+#include <Utils/TexProfiler.h>
+#include <Resources/EmptyTextureResource.h>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <algorithm>
+#include <vector>
+
+namespace OpenEngine {
+namespace Utils {
+
+class NoiseRequest;
+typedef boost::shared_ptr<NoiseRequest> NoiseRequestPtr;
+
+/**
+ * Handle to a queued noise generation. All methods except Wait are
+ * non-blocking and may be polled from the main thread.
+ */
+class NoiseRequest {
+ public:
+    enum State { QUEUED, RUNNING, DONE, CANCELLED };
+
+ private:
+    friend class AsyncValueNoise;
+
+    NoiseParameters params;
+    int priority;
+    unsigned long order;
+    State state;
+    bool upload;
+    FloatTexture2DPtr tex;
+    FloatTexture3DPtr tex3d;
+    EmptyTextureResourcePtr uploadTex;
+    mutable boost::mutex lock;
+    boost::condition_variable finished;
+
+    NoiseRequest(NoiseParameters params, int priority,
+                 unsigned long order, bool upload)
+        : params(params), priority(priority), order(order),
+          state(QUEUED), upload(upload) {}
+
+ public:
+    State GetState() const {
+        boost::mutex::scoped_lock l(lock);
+        return state;
+    }
+
+    bool IsDone() const { return GetState() == DONE; }
+    bool IsCancelled() const { return GetState() == CANCELLED; }
+    int GetPriority() const { return priority; }
+    const NoiseParameters& GetParameters() const { return params; }
+
+    /**
+     * Mark the request as stale. A queued request is never started,
+     * the result of a running request is dropped when it finishes.
+     */
+    void Cancel() {
+        boost::mutex::scoped_lock l(lock);
+        if (state == DONE) return;
+        state = CANCELLED;
+        finished.notify_all();
+    }
+
+    /**
+     * Block until the request is done or cancelled. Never call this
+     * from a frame critical thread, poll IsDone instead.
+     */
+    void Wait() {
+        boost::mutex::scoped_lock l(lock);
+        while (state == QUEUED || state == RUNNING)
+            finished.wait(l);
+    }
+
+    // The generated float texture, or an empty pointer until done.
+    FloatTexture2DPtr GetTexture() {
+        boost::mutex::scoped_lock l(lock);
+        return state == DONE ? tex : FloatTexture2DPtr();
+    }
+
+    FloatTexture3DPtr GetTexture3D() {
+        boost::mutex::scoped_lock l(lock);
+        return state == DONE ? tex3d : FloatTexture3DPtr();
+    }
+
+    /**
+     * The 2D result quantized to an 8 bit luminance texture, ready to
+     * be handed to the renderer. Only available for requests submitted
+     * with upload set.
+     */
+    EmptyTextureResourcePtr GetUploadTexture() {
+        boost::mutex::scoped_lock l(lock);
+        return state == DONE ? uploadTex : EmptyTextureResourcePtr();
+    }
+};
+
+/**
+ * Runs ValueNoise generation on a fixed number of worker threads.
+ * Requests with a higher priority are started first, requests with
+ * equal priority in submission order.
+ */
+class AsyncValueNoise {
+ private:
+    struct Compare {
+        bool operator()(const NoiseRequestPtr& a,
+                        const NoiseRequestPtr& b) const {
+            if (a->priority != b->priority)
+                return a->priority < b->priority;
+            return a->order > b->order;
+        }
+    };
+
+    std::vector<NoiseRequestPtr> queue;
+    unsigned long submitted;
+    bool stopping;
+    boost::mutex lock;
+    boost::condition_variable wakeup;
+    boost::thread_group workers;
+    NoiseCache* cache;
+
+    NoiseRequestPtr Next() {
+        boost::mutex::scoped_lock l(lock);
+        for (;;) {
+            while (!stopping && queue.empty())
+                wakeup.wait(l);
+            if (stopping) return NoiseRequestPtr();
+            std::pop_heap(queue.begin(), queue.end(), Compare());
+            NoiseRequestPtr req = queue.back();
+            queue.pop_back();
+            boost::mutex::scoped_lock rl(req->lock);
+            if (req->state == NoiseRequest::QUEUED) {
+                req->state = NoiseRequest::RUNNING;
+                return req;
+            }
+            // cancelled while queued, skip it
+        }
+    }
+
+    static EmptyTextureResourcePtr ToUpload(FloatTexture2DPtr tex) {
+        unsigned int w = tex->GetWidth();
+        unsigned int h = tex->GetHeight();
+        EmptyTextureResourcePtr out = EmptyTextureResource::Create(w,h,8);
+        const float* din = tex->GetData();
+        unsigned char* dout = out->GetData();
+        for (unsigned int i=0; i<w*h; i++) {
+            float v = din[i];
+            v = v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v);
+            dout[i] = (unsigned char)(v * 255);
+        }
+        return out;
+    }
+
+    void Run(NoiseRequestPtr req) {
+        TEXUTILS_PROFILE_SCOPE("AsyncValueNoise::Run", 0, 0, -1);
+        const NoiseParameters& p = req->params;
+        FloatTexture2DPtr tex;
+        FloatTexture3DPtr tex3d;
+        EmptyTextureResourcePtr uploadTex;
+        if (p.zResolution == 0) {
+            tex = cache ? cache->Generate(p) : ValueNoise::Generate(p);
+            if (p.normalize)
+                TexUtils::Normalize(tex, 0, 1);
+            if (req->upload)
+                uploadTex = ToUpload(tex);
+        } else {
+            tex3d = cache ? cache->Generate3D(p) : ValueNoise::Generate3D(p);
+            if (p.normalize)
+                TexUtils::Normalize3D(tex3d, 0, 1);
+        }
+
+        boost::mutex::scoped_lock l(req->lock);
+        if (req->state == NoiseRequest::CANCELLED) return;
+        req->tex = tex;
+        req->tex3d = tex3d;
+        req->uploadTex = uploadTex;
+        req->state = NoiseRequest::DONE;
+        req->finished.notify_all();
+    }
+
+    void WorkerLoop() {
+        for (;;) {
+            NoiseRequestPtr req = Next();
+            if (!req) return;
+            Run(req);
+        }
+    }
+
+ public:
+    /**
+     * Start the worker pool. With zero threads one less than the
+     * number of hardware threads is used, leaving a core for the
+     * main thread. If a cache is given it is consulted before
+     * generating, it must outlive the pool.
+     */
+    AsyncValueNoise(unsigned int threads = 0, NoiseCache* cache = NULL)
+        : submitted(0), stopping(false), cache(cache) {
+        if (threads == 0) {
+            unsigned int hw = boost::thread::hardware_concurrency();
+            threads = hw > 1 ? hw - 1 : 1;
+        }
+        for (unsigned int i=0; i<threads; i++)
+            workers.add_thread(new boost::thread(&AsyncValueNoise::WorkerLoop,
+                                                 this));
+    }
+
+    /**
+     * Stops the pool. Queued requests are cancelled, running ones are
+     * allowed to finish.
+     */
+    ~AsyncValueNoise() {
+        {
+            boost::mutex::scoped_lock l(lock);
+            stopping = true;
+            for (unsigned int i=0; i<queue.size(); i++)
+                queue[i]->Cancel();
+            queue.clear();
+        }
+        wakeup.notify_all();
+        workers.join_all();
+    }
+
+    /**
+     * Queue a request. Set upload to also produce an 8 bit texture
+     * for 2D requests.
+     */
+    NoiseRequestPtr Submit(NoiseParameters params, int priority = 0,
+                           bool upload = false) {
+        boost::mutex::scoped_lock l(lock);
+        NoiseRequestPtr req(new NoiseRequest(params, priority,
+                                             submitted++, upload));
+        queue.push_back(req);
+        std::push_heap(queue.begin(), queue.end(), Compare());
+        wakeup.notify_one();
+        return req;
+    }
+
+    NoiseRequestPtr Generate(unsigned int xResolution,
+                             unsigned int yResolution,
+                             unsigned int bandwidth,
+                             float mResolution,
+                             float mBandwidth,
+                             unsigned int blur,
+                             unsigned int layers,
+                             unsigned int seed,
+                             int priority = 0) {
+        NoiseParameters p;
+        p.xResolution = xResolution;
+        p.yResolution = yResolution;
+        p.bandwidth = bandwidth;
+        p.mResolution = mResolution;
+        p.mBandwidth = mBandwidth;
+        p.blur = blur;
+        p.layers = layers;
+        p.seed = seed;
+        return Submit(p, priority, true);
+    }
+
+    NoiseRequestPtr Generate3D(unsigned int xResolution,
+                               unsigned int yResolution,
+                               unsigned int zResolution,
+                               unsigned int bandwidth,
+                               float mResolution,
+                               float mBandwidth,
+                               unsigned int blur,
+                               unsigned int layers,
+                               unsigned int seed,
+                               int priority = 0) {
+        NoiseParameters p;
+        p.xResolution = xResolution;
+        p.yResolution = yResolution;
+        p.zResolution = zResolution;
+        p.bandwidth = bandwidth;
+        p.mResolution = mResolution;
+        p.mBandwidth = mBandwidth;
+        p.blur = blur;
+        p.layers = layers;
+        p.seed = seed;
+        return Submit(p, priority);
+    }
+
+    // Number of requests waiting for a worker, cancelled requests
+    // still in the heap are not counted.
+    unsigned int GetQueueSize() {
+        boost::mutex::scoped_lock l(lock);
+        unsigned int n = 0;
+        for (unsigned int i=0; i<queue.size(); i++)
+            if (queue[i]->GetState() == NoiseRequest::QUEUED) n++;
+        return n;
+    }
+};
+
+} // NS Utils
+} // NS OpenEngine
+
+#endif // _ASYNC_VALUE_NOISE_
@@ -0,0 +1,434 @@
+// BC1, BC4 and BC5 block compression.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _TEX_BLOCK_COMPRESSOR_
+#define _TEX_BLOCK_COMPRESSOR_
+
+#include <Core/Exceptions.h>
+#include <Resources/Texture2D.h>
+#include <Utils/ParallelFor.h>
+#include <Utils/TexProfiler.h>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace OpenEngine {
+namespace Utils {
+
+/**
+ * Block compressed image data, ready for a compressed texture upload.
+ * Blocks cover 4x4 texels and are stored row by row.
+ */
+struct CompressedTexture {
+    enum Format { BC1, BC4, BC5 };
+    Format format;
+    unsigned int width, height;
+    std::vector<unsigned char> data;
+
+    unsigned int GetBlocksX() const { return (width + 3) / 4; }
+    unsigned int GetBlocksY() const { return (height + 3) / 4; }
+    unsigned int GetBlockBytes() const { return format == BC5 ? 16 : 8; }
+};
+
+/**
+ * CPU encoder for the BC1 (DXT1), BC4 and BC5 formats. BC4 suits
+ * luminance and noise, BC5 two channel data such as the output of
+ * Tex<Vector<2,float> >::ToTexture, and BC1 colour.
+ *
+ * Blocks are encoded in parallel over block rows. FAST uses the block
+ * bounds as endpoints, HIGH searches BC4 endpoints and fits BC1
+ * endpoints to the principal axis of the colours with a least squares
+ * refinement. Texels past the edge of sizes that are not a multiple
+ * of four repeat the last row or column. BC1 ignores alpha.
+ */
+class BlockCompressor {
+ public:
+    enum Quality { FAST, HIGH };
+
+ private:
+    // gathers a 4x4 block of one channel, clamped at the edges
+    static void Fetch(const unsigned char* data, unsigned int w, unsigned int h,
+                      unsigned int c, unsigned int ch, unsigned int bx,
+                      unsigned int by, unsigned char block[16]) {
+        for (unsigned int y=0; y<4; y++) {
+            unsigned int sy = by*4 + y < h ? by*4 + y : h - 1;
+            for (unsigned int x=0; x<4; x++) {
+                unsigned int sx = bx*4 + x < w ? bx*4 + x : w - 1;
+                block[x + y*4] = data[(sx + sy*w)*c + ch];
+            }
+        }
+    }
+
+    static void BC4Palette(unsigned int r0, unsigned int r1, int p[8]) {
+        p[0] = r0;
+        p[1] = r1;
+        if (r0 > r1) {
+            for (unsigned int i=1; i<7; i++)
+                p[i+1] = ((7-i)*r0 + i*r1) / 7;
+        } else {
+            for (unsigned int i=1; i<5; i++)
+                p[i+1] = ((5-i)*r0 + i*r1) / 5;
+            p[6] = 0;
+            p[7] = 255;
+        }
+    }
+
+    static void BC4Write(unsigned int r0, unsigned int r1,
+                         const unsigned char idx[16], unsigned char* out) {
+        out[0] = r0;
+        out[1] = r1;
+        unsigned long long bits = 0;
+        for (unsigned int i=0; i<16; i++)
+            bits |= (unsigned long long)idx[i] << (3*i);
+        for (unsigned int i=0; i<6; i++)
+            out[2+i] = (unsigned char)(bits >> (8*i));
+    }
+
+    // nearest palette entries, returns the squared error
+    static unsigned int BC4Encode(const unsigned char v[16], unsigned int r0,
+                                  unsigned int r1, unsigned char* out) {
+        int p[8];
+        BC4Palette(r0, r1, p);
+        unsigned char idx[16];
+        unsigned int error = 0;
+        for (unsigned int i=0; i<16; i++) {
+            unsigned int best = 0, bestErr = 0xffffffff;
+            for (unsigned int j=0; j<8; j++) {
+                int d = v[i] - p[j];
+                unsigned int e = d*d;
+                if (e < bestErr) { bestErr = e; best = j; }
+            }
+            idx[i] = best;
+            error += bestErr;
+        }
+        if (out) BC4Write(r0, r1, idx, out);
+        return error;
+    }
+
+    // bounds as endpoints in the eight value mode, indices by
+    // rounding instead of searching
+    static void BC4Fast(const unsigned char v[16], unsigned char* out) {
+        unsigned int lo = 255, hi = 0;
+        for (unsigned int i=0; i<16; i++) {
+            if (v[i] < lo) lo = v[i];
+            if (v[i] > hi) hi = v[i];
+        }
+        unsigned char idx[16];
+        if (hi == lo) {
+            for (unsigned int i=0; i<16; i++) idx[i] = 0;
+            BC4Write(hi, lo, idx, out);
+            return;
+        }
+        // position 0..7 from lo to hi, 7 is r0 = hi and 0 is r1 = lo
+        static const unsigned char remap[8] = { 1, 7, 6, 5, 4, 3, 2, 0 };
+        float scale = 7.0f / (hi - lo);
+#ifdef __SSE2__
+        __m128i zero = _mm_setzero_si128();
+        __m128i bytes = _mm_loadu_si128((const __m128i*)v);
+        __m128i lo16 = _mm_unpacklo_epi8(bytes, zero);
+        __m128i hi16 = _mm_unpackhi_epi8(bytes, zero);
+        __m128i q[4] = { _mm_unpacklo_epi16(lo16, zero), _mm_unpackhi_epi16(lo16, zero),
+                         _mm_unpacklo_epi16(hi16, zero), _mm_unpackhi_epi16(hi16, zero) };
+        __m128 vlo = _mm_set1_ps((float)lo), vscale = _mm_set1_ps(scale);
+        __m128 half = _mm_set1_ps(0.5f);
+        for (unsigned int k=0; k<4; k++) {
+            __m128 f = _mm_mul_ps(_mm_sub_ps(_mm_cvtepi32_ps(q[k]), vlo), vscale);
+            __m128i l = _mm_cvttps_epi32(_mm_add_ps(f, half));
+            int pos[4];
+            _mm_storeu_si128((__m128i*)pos, l);
+            for (unsigned int i=0; i<4; i++)
+                idx[k*4+i] = remap[pos[i]];
+        }
+#else
+        for (unsigned int i=0; i<16; i++)
+            idx[i] = remap[(int)((v[i] - lo) * scale + 0.5f)];
+#endif
+        BC4Write(hi, lo, idx, out);
+    }
+
+    // tries inset endpoints in both modes and keeps the best
+    static void BC4High(const unsigned char v[16], unsigned char* out) {
+        unsigned int lo = 255, hi = 0, lo6 = 255, hi6 = 0;
+        for (unsigned int i=0; i<16; i++) {
+            if (v[i] < lo) lo = v[i];
+            if (v[i] > hi) hi = v[i];
+            // the six value mode has 0 and 255 for free
+            if (v[i] != 0 && v[i] < lo6) lo6 = v[i];
+            if (v[i] != 255 && v[i] > hi6) hi6 = v[i];
+        }
+        if (hi == lo) {
+            BC4Encode(v, hi, lo, out);
+            return;
+        }
+        unsigned int bestErr = 0xffffffff, b0 = hi, b1 = lo;
+        int range = (hi - lo) / 8 + 1;
+        for (int a=0; a<range; a++)
+            for (int b=0; b<range; b++) {
+                unsigned int r0 = hi - a, r1 = lo + b;
+                if (r0 <= r1) continue;
+                unsigned int e = BC4Encode(v, r0, r1, NULL);
+                if (e < bestErr) { bestErr = e; b0 = r0; b1 = r1; }
+            }
+        if (lo6 <= hi6) {
+            unsigned int e = BC4Encode(v, lo6, hi6, NULL);
+            if (e < bestErr) { bestErr = e; b0 = lo6; b1 = hi6; }
+        }
+        BC4Encode(v, b0, b1, out);
+    }
+
+    static unsigned int Pack565(const float c[3]) {
+        int r = (int)(c[0] * 31.0f / 255.0f + 0.5f);
+        int g = (int)(c[1] * 63.0f / 255.0f + 0.5f);
+        int b = (int)(c[2] * 31.0f / 255.0f + 0.5f);
+        r = r < 0 ? 0 : (r > 31 ? 31 : r);
+        g = g < 0 ? 0 : (g > 63 ? 63 : g);
+        b = b < 0 ? 0 : (b > 31 ? 31 : b);
+        return (r << 11) | (g << 5) | b;
+    }
+
+    static void Unpack565(unsigned int c, int out[3]) {
+        int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+        out[0] = (r << 3) | (r >> 2);
+        out[1] = (g << 2) | (g >> 4);
+        out[2] = (b << 3) | (b >> 2);
+    }
+
+    // indices for the given endpoints with the larger one as c0,
+    // returns the squared error
+    static unsigned int BC1Encode(const unsigned char rgb[16][3], unsigned int c0,
+                                  unsigned int c1, unsigned char idx[16]) {
+        if (c0 < c1) { unsigned int t = c0; c0 = c1; c1 = t; }
+        int p[4][3];
+        Unpack565(c0, p[0]);
+        Unpack565(c1, p[1]);
+        for (unsigned int k=0; k<3; k++) {
+            p[2][k] = (2*p[0][k] + p[1][k]) / 3;
+            p[3][k] = (p[0][k] + 2*p[1][k]) / 3;
+        }
+        unsigned int error = 0;
+        for (unsigned int i=0; i<16; i++) {
+            unsigned int best = 0, bestErr = 0xffffffff;
+            for (unsigned int j=0; j<4; j++) {
+                int dr = rgb[i][0] - p[j][0];
+                int dg = rgb[i][1] - p[j][1];
+                int db = rgb[i][2] - p[j][2];
+                unsigned int e = dr*dr + dg*dg + db*db;
+                if (e < bestErr) { bestErr = e; best = j; }
+            }
+            // equal endpoints decode in three colour mode, index 0 only
+            idx[i] = c0 == c1 ? 0 : best;
+            error += bestErr;
+        }
+        return error;
+    }
+
+    // c0 must not be below c1, indices as from BC1Encode
+    static void BC1Write(unsigned int c0, unsigned int c1,
+                         const unsigned char idx[16], unsigned char* out) {
+        unsigned int bits = 0;
+        for (unsigned int i=0; i<16; i++)
+            bits |= (unsigned int)idx[i] << (2*i);
+        out[0] = c0 & 0xff; out[1] = c0 >> 8;
+        out[2] = c1 & 0xff; out[3] = c1 >> 8;
+        for (unsigned int i=0; i<4; i++)
+            out[4+i] = (unsigned char)(bits >> (8*i));
+    }
+
+    // bounding box endpoints, inset by a sixteenth of the range
+    static void BC1Bounds(const unsigned char rgb[16][3], float c0[3], float c1[3]) {
+        for (unsigned int k=0; k<3; k++) {
+            float lo = 255, hi = 0;
+            for (unsigned int i=0; i<16; i++) {
+                if (rgb[i][k] < lo) lo = rgb[i][k];
+                if (rgb[i][k] > hi) hi = rgb[i][k];
+            }
+            float inset = (hi - lo) / 16.0f;
+            c0[k] = hi - inset;
+            c1[k] = lo + inset;
+        }
+    }
+
+    // endpoints at the extremes along the principal axis
+    static void BC1Axis(const unsigned char rgb[16][3], float c0[3], float c1[3]) {
+        float mean[3] = { 0, 0, 0 };
+        for (unsigned int i=0; i<16; i++)
+            for (unsigned int k=0; k<3; k++)
+                mean[k] += rgb[i][k] / 16.0f;
+        float cov[6] = { 0, 0, 0, 0, 0, 0 };
+        for (unsigned int i=0; i<16; i++) {
+            float r = rgb[i][0] - mean[0], g = rgb[i][1] - mean[1];
+            float b = rgb[i][2] - mean[2];
+            cov[0] += r*r; cov[1] += r*g; cov[2] += r*b;
+            cov[3] += g*g; cov[4] += g*b; cov[5] += b*b;
+        }
+        // power iteration
+        float axis[3] = { 1, 1, 1 };
+        for (unsigned int it=0; it<8; it++) {
+            float a = cov[0]*axis[0] + cov[1]*axis[1] + cov[2]*axis[2];
+            float b = cov[1]*axis[0] + cov[3]*axis[1] + cov[4]*axis[2];
+            float c = cov[2]*axis[0] + cov[4]*axis[1] + cov[5]*axis[2];
+            float m = a > b ? a : b;
+            if (c > m) m = c;
+            if (-a > m) m = -a;
+            if (-b > m) m = -b;
+            if (-c > m) m = -c;
+            if (m == 0) break;
+            axis[0] = a / m; axis[1] = b / m; axis[2] = c / m;
+        }
+        float lo = 1e30f, hi = -1e30f;
+        for (unsigned int i=0; i<16; i++) {
+            float t = (rgb[i][0] - mean[0]) * axis[0] + (rgb[i][1] - mean[1]) * axis[1]
+                + (rgb[i][2] - mean[2]) * axis[2];
+            if (t < lo) lo = t;
+            if (t > hi) hi = t;
+        }
+        float len2 = axis[0]*axis[0] + axis[1]*axis[1] + axis[2]*axis[2];
+        if (len2 == 0) len2 = 1;
+        for (unsigned int k=0; k<3; k++) {
+            c0[k] = mean[k] + axis[k] * hi / len2;
+            c1[k] = mean[k] + axis[k] * lo / len2;
+        }
+    }
+
+    // least squares endpoints for fixed indices
+    static bool BC1Refine(const unsigned char rgb[16][3], const unsigned char idx[16],
+                          float c0[3], float c1[3]) {
+        static const float weight[4] = { 1.0f, 0.0f, 2.0f/3.0f, 1.0f/3.0f };
+        float aa = 0, bb = 0, ab = 0, ax[3] = { 0, 0, 0 }, bx[3] = { 0, 0, 0 };
+        for (unsigned int i=0; i<16; i++) {
+            float a = weight[idx[i]], b = 1 - a;
+            aa += a*a; bb += b*b; ab += a*b;
+            for (unsigned int k=0; k<3; k++) {
+                ax[k] += a * rgb[i][k];
+                bx[k] += b * rgb[i][k];
+            }
+        }
+        float det = aa*bb - ab*ab;
+        if (det == 0) return false;
+        for (unsigned int k=0; k<3; k++) {
+            c0[k] = (ax[k]*bb - bx[k]*ab) / det;
+            c1[k] = (bx[k]*aa - ax[k]*ab) / det;
+        }
+        return true;
+    }
+
+    static void BC1Block(const unsigned char rgb[16][3], Quality quality,
+                         unsigned char* out) {
+        float c0[3], c1[3];
+        unsigned char idx[16], bestIdx[16];
+        BC1Bounds(rgb, c0, c1);
+        unsigned int b0 = Pack565(c0), b1 = Pack565(c1);
+        unsigned int bestErr = BC1Encode(rgb, b0, b1, bestIdx);
+        if (quality == HIGH) {
+            BC1Axis(rgb, c0, c1);
+            for (unsigned int it=0; it<2; it++) {
+                unsigned int p0 = Pack565(c0), p1 = Pack565(c1);
+                unsigned int e = BC1Encode(rgb, p0, p1, idx);
+                if (e < bestErr) {
+                    bestErr = e; b0 = p0; b1 = p1;
+                    for (unsigned int i=0; i<16; i++) bestIdx[i] = idx[i];
+                }
+                // indices are relative to the larger endpoint first
+                if (p0 < p1) { float t[3] = { c0[0], c0[1], c0[2] };
+                    for (unsigned int k=0; k<3; k++) { c0[k] = c1[k]; c1[k] = t[k]; } }
+                if (!BC1Refine(rgb, idx, c0, c1)) break;
+            }
+        }
+        if (b0 < b1) { unsigned int t = b0; b0 = b1; b1 = t; }
+        BC1Write(b0, b1, bestIdx, out);
+    }
+
+    struct Job {
+        const unsigned char* data;
+        unsigned int w, h, c;
+        unsigned int ch0, ch1;
+        Quality quality;
+        CompressedTexture* out;
+        void Channel(unsigned int ch, unsigned int bx, unsigned int by,
+                     unsigned char* block) {
+            unsigned char v[16];
+            Fetch(data, w, h, c, ch, bx, by, v);
+            if (quality == HIGH) BC4High(v, block);
+            else BC4Fast(v, block);
+        }
+        void operator()(unsigned int from, unsigned int to) {
+            const unsigned int bw = out->GetBlocksX();
+            const unsigned int bytes = out->GetBlockBytes();
+            for (unsigned int by=from; by<to; by++)
+                for (unsigned int bx=0; bx<bw; bx++) {
+                    unsigned char* block = &out->data[(bx + by*bw) * bytes];
+                    switch (out->format) {
+                    case CompressedTexture::BC1: {
+                        unsigned char rgb[16][3], v[16];
+                        for (unsigned int k=0; k<3; k++) {
+                            Fetch(data, w, h, c, c < 3 ? 0 : k, bx, by, v);
+                            for (unsigned int i=0; i<16; i++) rgb[i][k] = v[i];
+                        }
+                        BC1Block(rgb, quality, block);
+                        break;
+                    }
+                    case CompressedTexture::BC4:
+                        Channel(ch0, bx, by, block);
+                        break;
+                    case CompressedTexture::BC5:
+                        Channel(ch0, bx, by, block);
+                        Channel(ch1, bx, by, block + 8);
+                        break;
+                    }
+                }
+        }
+    };
+
+    static CompressedTexture Run(UCharTexture2DPtr tex, CompressedTexture::Format format,
+                                 unsigned int ch0, unsigned int ch1,
+                                 Quality quality, unsigned int threads) {
+        if (ch0 >= tex->GetChannels() || ch1 >= tex->GetChannels())
+            throw Core::Exception("BlockCompressor: no such channel in texture");
+        CompressedTexture out;
+        out.format = format;
+        out.width = tex->GetWidth();
+        out.height = tex->GetHeight();
+        out.data.resize(out.GetBlocksX() * out.GetBlocksY() * out.GetBlockBytes());
+        TEXUTILS_PROFILE_SCOPE("BlockCompressor::Compress", out.width * out.height,
+                               out.data.size(), -1);
+        Job job = { tex->GetData(), out.width, out.height, tex->GetChannels(),
+                    ch0, ch1, quality, &out };
+        ParallelFor::Run(0, out.GetBlocksY(), job, threads, 4);
+        return out;
+    }
+
+ public:
+    /**
+     * BC1 of the first three channels, a one or two channel texture
+     * is treated as grey.
+     */
+    static CompressedTexture BC1(UCharTexture2DPtr tex, Quality quality = FAST,
+                                 unsigned int threads = 0) {
+        return Run(tex, CompressedTexture::BC1, 0, 0, quality, threads);
+    }
+
+    // BC4 of one channel, e.g. 3 for the output of ToRGBAinAlphaChannel.
+    static CompressedTexture BC4(UCharTexture2DPtr tex, unsigned int channel = 0,
+                                 Quality quality = FAST, unsigned int threads = 0) {
+        return Run(tex, CompressedTexture::BC4, channel, channel, quality, threads);
+    }
+
+    static CompressedTexture BC5(UCharTexture2DPtr tex, unsigned int first = 0,
+                                 unsigned int second = 1, Quality quality = FAST,
+                                 unsigned int threads = 0) {
+        return Run(tex, CompressedTexture::BC5, first, second, quality, threads);
+    }
+};
+
+} // NS Utils
+} // NS OpenEngine
+
+#endif // _TEX_BLOCK_COMPRESSOR_
@@ -0,0 +1,248 @@
+// Separable convolution of float textures.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _TEX_CONVOLUTION_
+#define _TEX_CONVOLUTION_
+
+#include <Core/Exceptions.h>
+#include <Resources/Texture2D.h>
+#include <Resources/Texture3D.h>
+#include <Utils/FFT.h>
+#include <Utils/ParallelFor.h>
+#include <Utils/TexProfiler.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+namespace OpenEngine {
+namespace Utils {
+
+/**
+ * Separable convolution with odd length 1D kernels. Addressing wraps
+ * around the borders like TexUtils::Blur, so convolving with
+ * BoxKernel(halfsize) gives the same result as one Blur iteration.
+ *
+ * The x pass runs over padded copies of each row. The y and z passes
+ * accumulate whole rows at a time over cache sized strips, so every
+ * pass reads memory contiguously and vectorizes with SSE when
+ * available. Kernels of FFT_TAPS taps or more are applied in the
+ * frequency domain instead.
+ */
+class Convolution {
+ private:
+    // strip width in floats for the y and z passes
+    static const unsigned int STRIP = 1024;
+
+ public:
+    // kernel length from which FFT::Convolve is used
+    static const unsigned int FFT_TAPS = 33;
+
+ private:
+
+    /**
+     * out[j] = sum_i k[i] * rows[i][j] for j in [0,n).
+     */
+    static void Accumulate(float* out, const float* const* rows,
+                           const float* k, unsigned int taps,
+                           unsigned int n) {
+        unsigned int j = 0;
+#ifdef __SSE__
+        for (; j+8 <= n; j+=8) {
+            __m128 a0 = _mm_setzero_ps();
+            __m128 a1 = _mm_setzero_ps();
+            for (unsigned int i=0; i<taps; i++) {
+                __m128 ki = _mm_set1_ps(k[i]);
+                a0 = _mm_add_ps(a0, _mm_mul_ps(ki, _mm_loadu_ps(rows[i]+j)));
+                a1 = _mm_add_ps(a1, _mm_mul_ps(ki, _mm_loadu_ps(rows[i]+j+4)));
+            }
+            _mm_storeu_ps(out+j, a0);
+            _mm_storeu_ps(out+j+4, a1);
+        }
+#endif
+        for (; j<n; j++) {
+            float sum = 0;
+            for (unsigned int i=0; i<taps; i++)
+                sum += k[i] * rows[i][j];
+            out[j] = sum;
+        }
+    }
+
+    static unsigned int Wrap(int i, unsigned int n) {
+        int r = i % (int)n;
+        return r < 0 ? r + n : r;
+    }
+
+    // x pass over the rows [from,to) of a row major array
+    struct RowPass {
+        const float* src;
+        float* dst;
+        unsigned int w, c;
+        const std::vector<float>* kernel;
+        void operator()(unsigned int from, unsigned int to) {
+            const unsigned int taps = kernel->size();
+            const int r = taps / 2;
+            std::vector<float> pad((w + taps - 1) * c);
+            std::vector<const float*> rows(taps);
+            for (unsigned int i=0; i<taps; i++)
+                rows[i] = &pad[i*c];
+            for (unsigned int y=from; y<to; y++) {
+                const float* in = src + y*w*c;
+                for (int x=-r; x<(int)w+r; x++)
+                    std::memcpy(&pad[(x+r)*c], in + Wrap(x,w)*c,
+                                sizeof(float)*c);
+                Accumulate(dst + y*w*c, &rows[0], &(*kernel)[0], taps, w*c);
+            }
+        }
+    };
+
+    // y or z pass: output row y of a slice is the weighted sum of the
+    // neighbouring rows, pitch floats apart, processed in strips
+    struct StridePass {
+        const float* src;
+        float* dst;
+        unsigned int n, count, pitch, slices, slicePitch;
+        const std::vector<float>* kernel;
+        void operator()(unsigned int from, unsigned int to) {
+            const unsigned int taps = kernel->size();
+            const int r = taps / 2;
+            std::vector<const float*> rows(taps);
+            for (unsigned int s=0; s<slices; s++) {
+                const float* in = src + s*slicePitch;
+                float* out = dst + s*slicePitch;
+                for (unsigned int j0=0; j0<n; j0+=STRIP) {
+                    unsigned int len = n - j0 < STRIP ? n - j0 : STRIP;
+                    for (unsigned int y=from; y<to; y++) {
+                        for (unsigned int i=0; i<taps; i++)
+                            rows[i] = in + Wrap((int)y+(int)i-r, count)*pitch + j0;
+                        Accumulate(out + y*pitch + j0, &rows[0],
+                                   &(*kernel)[0], taps, len);
+                    }
+                }
+            }
+        }
+    };
+
+ public:
+    /**
+     * Normalized Gaussian kernel. A negative halfsize picks
+     * ceil(3 sigma), which keeps more than 99.7% of the weight.
+     */
+    static std::vector<float> GaussianKernel(float sigma, int halfsize = -1) {
+        if (halfsize < 0) halfsize = (int)std::ceil(3 * sigma);
+        std::vector<float> k(2*halfsize+1);
+        double sum = 0;
+        for (int i=-halfsize; i<=halfsize; i++) {
+            double v = sigma > 0 ? std::exp(-(i*i) / (2.0*sigma*sigma))
+                                 : (i == 0 ? 1.0 : 0.0);
+            k[i+halfsize] = (float)v;
+            sum += v;
+        }
+        for (unsigned int i=0; i<k.size(); i++)
+            k[i] = (float)(k[i] / sum);
+        return k;
+    }
+
+    // The averaging kernel used by TexUtils::Blur.
+    static std::vector<float> BoxKernel(int halfsize) {
+        return std::vector<float>(2*halfsize+1, 1.0f / (2*halfsize+1));
+    }
+
+    static void Separable(FloatTexture2DPtr tex,
+                          const std::vector<float>& kx,
+                          const std::vector<float>& ky,
+                          unsigned int threads = 0) {
+        unsigned int w = tex->GetWidth();
+        unsigned int h = tex->GetHeight();
+        unsigned int c = tex->GetChannels();
+        TEXUTILS_PROFILE_SCOPE("Convolution::Separable", w * h,
+                               w * h * c * sizeof(float), -1);
+        if (kx.size() % 2 == 0 || ky.size() % 2 == 0)
+            throw Core::Exception("convolution kernel length must be odd");
+        // sizes with other prime factors take an O(n^2) transform per
+        // line in the FFT, there the direct path is faster
+        if (std::max(kx.size(), ky.size()) >= FFT_TAPS && FFT::IsFastSize(w, h)) {
+            FFT::Convolve(tex, kx, ky, 1, threads);
+            return;
+        }
+        float* data = tex->GetData();
+        std::vector<float> temp(w*h*c);
+
+        RowPass rows = { data, &temp[0], w, c, &kx };
+        ParallelFor::Run(0, h, rows, threads, 8);
+
+        StridePass cols = { &temp[0], data, w*c, h, w*c, 1, 0, &ky };
+        ParallelFor::Run(0, h, cols, threads, 8);
+    }
+
+    static void Separable(FloatTexture2DPtr tex,
+                          const std::vector<float>& kernel,
+                          unsigned int threads = 0) {
+        Separable(tex, kernel, kernel, threads);
+    }
+
+    static void Separable3D(FloatTexture3DPtr tex,
+                            const std::vector<float>& kx,
+                            const std::vector<float>& ky,
+                            const std::vector<float>& kz,
+                            unsigned int threads = 0) {
+        unsigned int w = tex->GetWidth();
+        unsigned int h = tex->GetHeight();
+        unsigned int d = tex->GetDepth();
+        unsigned int c = tex->GetChannels();
+        TEXUTILS_PROFILE_SCOPE("Convolution::Separable3D", w * h * d,
+                               w * h * d * c * sizeof(float), -1);
+        if (kx.size() % 2 == 0 || ky.size() % 2 == 0 || kz.size() % 2 == 0)
+            throw Core::Exception("convolution kernel length must be odd");
+        if (std::max(kx.size(), std::max(ky.size(), kz.size())) >= FFT_TAPS &&
+            FFT::IsFastSize(w, h, d)) {
+            FFT::Convolve3D(tex, kx, ky, kz, 1, threads);
+            return;
+        }
+        float* data = tex->GetData();
+        std::vector<float> temp(w*h*d*c);
+
+        RowPass rows = { data, &temp[0], w, c, &kx };
+        ParallelFor::Run(0, h*d, rows, threads, 8);
+
+        // y pass per slice, parallel over the rows of every slice
+        StridePass cols = { &temp[0], data, w*c, h, w*c, d, w*h*c, &ky };
+        ParallelFor::Run(0, h, cols, threads, 4);
+
+        // z pass treats each slice as one long row
+        StridePass depth = { data, &temp[0], w*h*c, d, w*h*c, 1, 0, &kz };
+        ParallelFor::Run(0, d, depth, threads, 4);
+        std::memcpy(data, &temp[0], sizeof(float)*w*h*d*c);
+    }
+
+    static void Separable3D(FloatTexture3DPtr tex,
+                            const std::vector<float>& kernel,
+                            unsigned int threads = 0) {
+        Separable3D(tex, kernel, kernel, kernel, threads);
+    }
+
+    static void Gaussian(FloatTexture2DPtr tex, float sigma,
+                         unsigned int threads = 0) {
+        Separable(tex, GaussianKernel(sigma), threads);
+    }
+
+    static void Gaussian3D(FloatTexture3DPtr tex, float sigma,
+                           unsigned int threads = 0) {
+        Separable3D(tex, GaussianKernel(sigma), threads);
+    }
+};
+
+} // NS Utils
+} // NS OpenEngine
+
+#endif // _TEX_CONVOLUTION_
@@ -0,0 +1,315 @@
+// Mixed radix fast Fourier transform for textures.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _TEX_FFT_
+#define _TEX_FFT_
+
+#include <Resources/Texture2D.h>
+#include <Resources/Texture3D.h>
+#include <Utils/ParallelFor.h>
+#include <Utils/TexProfiler.h>
+#include <cmath>
+#include <complex>
+#include <vector>
+
+namespace OpenEngine {
+namespace Utils {
+
+/**
+ * Complex FFT of any length. Lengths are factored into radix 4 and 2
+ * butterflies plus generic butterflies for the remaining prime
+ * factors, so sizes with only small prime factors are fast. The
+ * structure follows the recursive decimation in time of kissfft.
+ *
+ * The static helpers transform 2D and 3D arrays in place along every
+ * axis and use the wrap around of the discrete transform to implement
+ * large kernel convolution with the same addressing as
+ * TexUtils::Blur.
+ */
+class FFT {
+ public:
+    typedef std::complex<float> Complex;
+
+ private:
+    unsigned int n;
+    bool inverse;
+    // pairs of (radix, remaining length)
+    std::vector<unsigned int> factors;
+    std::vector<Complex> twiddles;
+
+    void Butterfly2(Complex* out, unsigned int fstride, unsigned int m) const {
+        const Complex* tw = &twiddles[0];
+        for (unsigned int k=0; k<m; k++) {
+            Complex t = out[m+k] * tw[k*fstride];
+            out[m+k] = out[k] - t;
+            out[k] += t;
+        }
+    }
+
+    void Butterfly4(Complex* out, unsigned int fstride, unsigned int m) const {
+        const Complex* tw = &twiddles[0];
+        for (unsigned int k=0; k<m; k++) {
+            Complex s0 = out[k+m] * tw[k*fstride];
+            Complex s1 = out[k+2*m] * tw[2*k*fstride];
+            Complex s2 = out[k+3*m] * tw[3*k*fstride];
+            Complex s5 = out[k] - s1;
+            out[k] += s1;
+            Complex s3 = s0 + s2;
+            Complex s4 = s0 - s2;
+            out[k+2*m] = out[k] - s3;
+            out[k] += s3;
+            if (inverse) {
+                out[k+m] = Complex(s5.real() - s4.imag(), s5.imag() + s4.real());
+                out[k+3*m] = Complex(s5.real() + s4.imag(), s5.imag() - s4.real());
+            } else {
+                out[k+m] = Complex(s5.real() + s4.imag(), s5.imag() - s4.real());
+                out[k+3*m] = Complex(s5.real() - s4.imag(), s5.imag() + s4.real());
+            }
+        }
+    }
+
+    void ButterflyGeneric(Complex* out, unsigned int fstride,
+                          unsigned int m, unsigned int p) const {
+        std::vector<Complex> scratch(p);
+        for (unsigned int u=0; u<m; u++) {
+            unsigned int k = u;
+            for (unsigned int q=0; q<p; q++, k+=m)
+                scratch[q] = out[k];
+            k = u;
+            for (unsigned int q1=0; q1<p; q1++, k+=m) {
+                unsigned int twidx = 0;
+                out[k] = scratch[0];
+                for (unsigned int q=1; q<p; q++) {
+                    twidx += fstride * k;
+                    twidx %= n;
+                    out[k] += scratch[q] * twiddles[twidx];
+                }
+            }
+        }
+    }
+
+    void Work(Complex* out, const Complex* in, unsigned int fstride,
+              unsigned int istride, const unsigned int* f) const {
+        const unsigned int p = f[0];
+        const unsigned int m = f[1];
+        Complex* begin = out;
+        Complex* end = out + p*m;
+        if (m == 1) {
+            for (; out != end; ++out, in += fstride*istride)
+                *out = *in;
+        } else {
+            for (; out != end; out += m, in += fstride*istride)
+                Work(out, in, fstride*p, istride, f+2);
+        }
+        out = begin;
+        switch (p) {
+        case 2: Butterfly2(out, fstride, m); break;
+        case 4: Butterfly4(out, fstride, m); break;
+        default: ButterflyGeneric(out, fstride, m, p); break;
+        }
+    }
+
+    // transforms lines of an array along one axis
+    struct AxisPass {
+        Complex* data;
+        const FFT* plan;
+        unsigned int stride;
+        void operator()(unsigned int from, unsigned int to) {
+            const unsigned int n = plan->n;
+            std::vector<Complex> in(n), out(n);
+            for (unsigned int l=from; l<to; l++) {
+                Complex* line = data + (l % stride) + (l / stride) * stride * n;
+                for (unsigned int i=0; i<n; i++)
+                    in[i] = line[i*stride];
+                plan->Transform(&in[0], &out[0]);
+                for (unsigned int i=0; i<n; i++)
+                    line[i*stride] = out[i];
+            }
+        }
+    };
+
+    static void Axis(Complex* data, unsigned int n, unsigned int stride,
+                     unsigned int lines, bool inverse, unsigned int threads) {
+        FFT plan(n, inverse);
+        AxisPass pass = { data, &plan, stride };
+        ParallelFor::Run(0, lines, pass, threads, 8);
+    }
+
+    static void Scale(std::vector<Complex>& data, float s) {
+        for (unsigned int i=0; i<data.size(); i++)
+            data[i] *= s;
+    }
+
+    // spectrum of a centered odd length kernel wrapped onto n samples
+    static std::vector<Complex> KernelSpectrum(const std::vector<float>& k,
+                                               unsigned int n) {
+        std::vector<Complex> in(n), out(n);
+        int r = k.size() / 2;
+        for (int i=0; i<(int)k.size(); i++) {
+            int j = (i - r) % (int)n;
+            in[j < 0 ? j + n : j] += k[i];
+        }
+        FFT(n).Transform(&in[0], &out[0]);
+        return out;
+    }
+
+ public:
+    FFT(unsigned int n, bool inverse = false) : n(n), inverse(inverse) {
+        const double pi = 3.14159265358979323846;
+        for (unsigned int i=0; i<n; i++) {
+            double phase = -2 * pi * i / n;
+            if (inverse) phase = -phase;
+            twiddles.push_back(Complex(std::cos(phase), std::sin(phase)));
+        }
+        // prefer radix 4, then 2, then odd factors
+        unsigned int p = 4, m = n;
+        double root = std::floor(std::sqrt((double)n));
+        do {
+            while (m % p) {
+                switch (p) {
+                case 4: p = 2; break;
+                case 2: p = 3; break;
+                default: p += 2; break;
+                }
+                if (p > root) p = m;
+            }
+            m /= p;
+            factors.push_back(p);
+            factors.push_back(m);
+        } while (m > 1);
+    }
+
+    unsigned int GetSize() const { return n; }
+
+    /**
+     * Unscaled transform of n contiguous samples, in and out must not
+     * overlap.
+     */
+    void Transform(const Complex* in, Complex* out) const {
+        if (n == 1) { out[0] = in[0]; return; }
+        Work(out, in, 1, 1, &factors[0]);
+    }
+
+    /**
+     * True if n has no prime factor above 7, which keeps the generic
+     * butterflies cheap.
+     */
+    static bool IsFastSize(unsigned int n) {
+        const unsigned int primes[] = { 2, 3, 5, 7 };
+        for (unsigned int i=0; i<4; i++)
+            while (n > 1 && n % primes[i] == 0) n /= primes[i];
+        return n == 1;
+    }
+
+    // Every dimension of a texture is a fast size.
+    static bool IsFastSize(unsigned int w, unsigned int h, unsigned int d = 1) {
+        return IsFastSize(w) && IsFastSize(h) && IsFastSize(d);
+    }
+
+    /**
+     * In place transform of a w x h array. The inverse is scaled by
+     * 1/(w*h), so a forward and inverse pair is the identity.
+     */
+    static void Transform2D(std::vector<Complex>& data,
+                            unsigned int w, unsigned int h,
+                            bool inverse = false, unsigned int threads = 0) {
+        Axis(&data[0], w, 1, h, inverse, threads);
+        Axis(&data[0], h, w, w, inverse, threads);
+        if (inverse) Scale(data, 1.0f / (w*h));
+    }
+
+    static void Transform3D(std::vector<Complex>& data, unsigned int w,
+                            unsigned int h, unsigned int d,
+                            bool inverse = false, unsigned int threads = 0) {
+        Axis(&data[0], w, 1, h*d, inverse, threads);
+        Axis(&data[0], h, w, w*d, inverse, threads);
+        Axis(&data[0], d, w*h, w*h, inverse, threads);
+        if (inverse) Scale(data, 1.0f / (w*h*d));
+    }
+
+    /**
+     * Separable convolution in the frequency domain, with the kernel
+     * applied itr times. Gives the same result as
+     * Convolution::Separable up to rounding, at a cost independent of
+     * the kernel length.
+     */
+    static void Convolve(FloatTexture2DPtr tex,
+                         const std::vector<float>& kx,
+                         const std::vector<float>& ky,
+                         unsigned int itr = 1, unsigned int threads = 0) {
+        const unsigned int w = tex->GetWidth();
+        const unsigned int h = tex->GetHeight();
+        const unsigned int c = tex->GetChannels();
+        TEXUTILS_PROFILE_SCOPE("FFT::Convolve", w * h,
+                               w * h * sizeof(Complex), -1);
+        std::vector<Complex> sx = KernelSpectrum(kx, w);
+        std::vector<Complex> sy = KernelSpectrum(ky, h);
+        float* tdata = tex->GetData();
+        std::vector<Complex> data(w*h);
+        for (unsigned int ch=0; ch<c; ch++) {
+            for (unsigned int i=0; i<w*h; i++)
+                data[i] = tdata[i*c+ch];
+            Transform2D(data, w, h, false, threads);
+            for (unsigned int y=0; y<h; y++)
+                for (unsigned int x=0; x<w; x++)
+                    data[x+y*w] *= std::pow(sx[x] * sy[y], (int)itr);
+            Transform2D(data, w, h, true, threads);
+            for (unsigned int i=0; i<w*h; i++)
+                tdata[i*c+ch] = data[i].real();
+        }
+    }
+
+    static void Convolve3D(FloatTexture3DPtr tex,
+                           const std::vector<float>& kx,
+                           const std::vector<float>& ky,
+                           const std::vector<float>& kz,
+                           unsigned int itr = 1, unsigned int threads = 0) {
+        const unsigned int w = tex->GetWidth();
+        const unsigned int h = tex->GetHeight();
+        const unsigned int d = tex->GetDepth();
+        const unsigned int c = tex->GetChannels();
+        TEXUTILS_PROFILE_SCOPE("FFT::Convolve3D", w * h * d,
+                               w * h * d * sizeof(Complex), -1);
+        std::vector<Complex> sx = KernelSpectrum(kx, w);
+        std::vector<Complex> sy = KernelSpectrum(ky, h);
+        std::vector<Complex> sz = KernelSpectrum(kz, d);
+        const unsigned int size = w*h*d;
+        float* tdata = tex->GetData();
+        std::vector<Complex> data(size);
+        for (unsigned int ch=0; ch<c; ch++) {
+            for (unsigned int i=0; i<size; i++)
+                data[i] = tdata[i*c+ch];
+            Transform3D(data, w, h, d, false, threads);
+            for (unsigned int z=0; z<d; z++)
+                for (unsigned int y=0; y<h; y++) {
+                    Complex syz = sy[y] * sz[z];
+                    for (unsigned int x=0; x<w; x++)
+                        data[x+(y+z*h)*w] *= std::pow(sx[x] * syz, (int)itr);
+                }
+            Transform3D(data, w, h, d, true, threads);
+            for (unsigned int i=0; i<size; i++)
+                tdata[i*c+ch] = data[i].real();
+        }
+    }
+
+    /**
+     * Same result as TexUtils::Blur3D, all iterations in one forward
+     * and inverse transform.
+     */
+    static void Blur3D(FloatTexture3DPtr tex, unsigned int itr,
+                       int halfsize = 1, unsigned int threads = 0) {
+        std::vector<float> box(2*halfsize+1, 1.0f / (2*halfsize+1));
+        Convolve3D(tex, box, box, box, itr, threads);
+    }
+};
+
+} // NS Utils
+} // NS OpenEngine
+
+#endif // _TEX_FFT_
@@ -0,0 +1,354 @@
+// Summed area tables for 2D and 3D float textures.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _INTEGRAL_IMAGE_
+#define _INTEGRAL_IMAGE_
+
+#include <Resources/Texture2D.h>
+#include <Resources/Texture3D.h>
+#include <Utils/ParallelFor.h>
+#include <Utils/TexProfiler.h>
+#include <cmath>
+#include <vector>
+
+namespace OpenEngine {
+namespace Utils {
+
+/**
+ * Summed area table of a 2D float texture. Sums are accumulated in
+ * double precision and queried in constant time.
+ *
+ * Queries use the same wrap addressing as TexUtils::Blur, so regions
+ * may extend past the texture borders and even span several periods.
+ */
+class IntegralImage {
+ private:
+    unsigned int w, h, c;
+    // (w+1)*(h+1)*c entries, row and column zero are zero
+    std::vector<double> table;
+
+    double* Row(unsigned int y) { return &table[y*(w+1)*c]; }
+
+    struct RowPass {
+        IntegralImage* img;
+        const float* src;
+        void operator()(unsigned int from, unsigned int to) {
+            const unsigned int w = img->w, c = img->c;
+            for (unsigned int y=from; y<to; y++) {
+                double* dst = img->Row(y+1);
+                const float* in = src + y*w*c;
+                for (unsigned int ch=0; ch<c; ch++) {
+                    double sum = 0;
+                    dst[ch] = 0;
+                    for (unsigned int x=0; x<w; x++) {
+                        sum += in[x*c+ch];
+                        dst[(x+1)*c+ch] = sum;
+                    }
+                }
+            }
+        }
+    };
+
+    // column prefix sums, each thread owns a band of columns
+    struct ColumnPass {
+        IntegralImage* img;
+        void operator()(unsigned int from, unsigned int to) {
+            const unsigned int c = img->c;
+            for (unsigned int y=1; y<=img->h; y++) {
+                double* above = img->Row(y-1);
+                double* row = img->Row(y);
+                for (unsigned int i=from*c; i<to*c; i++)
+                    row[i] += above[i];
+            }
+        }
+    };
+
+    static int FloorDiv(int a, int b) {
+        return a >= 0 ? a / b : -((-a + b - 1) / b);
+    }
+
+    double At(unsigned int x, unsigned int y, unsigned int ch) const {
+        return table[(y*(w+1)+x)*c+ch];
+    }
+
+    // sum over the periodic extension of [0,x) x [0,y)
+    double Prefix(int x, int y, unsigned int ch) const {
+        int qx = FloorDiv(x, w), qy = FloorDiv(y, h);
+        unsigned int rx = x - qx*(int)w, ry = y - qy*(int)h;
+        return (double)qx * qy * At(w,h,ch)
+            + (double)qx * At(w,ry,ch)
+            + (double)qy * At(rx,h,ch)
+            + At(rx,ry,ch);
+    }
+
+ public:
+    IntegralImage(FloatTexture2DPtr tex, unsigned int threads = 0)
+        : w(tex->GetWidth()), h(tex->GetHeight()), c(tex->GetChannels()),
+          table((w+1)*(h+1)*c, 0.0) {
+        TEXUTILS_PROFILE_SCOPE("IntegralImage", w * h,
+                               table.size() * sizeof(double), -1);
+        RowPass rows = { this, tex->GetData() };
+        ParallelFor::Run(0, h, rows, threads, 16);
+        ColumnPass cols = { this };
+        ParallelFor::Run(0, w+1, cols, threads, 64);
+    }
+
+    unsigned int GetWidth() const { return w; }
+    unsigned int GetHeight() const { return h; }
+    unsigned int GetChannels() const { return c; }
+
+    /**
+     * Sum of the texels in the half open box [x0,x1) x [y0,y1).
+     */
+    double Sum(int x0, int y0, int x1, int y1, unsigned int ch = 0) const {
+        return Prefix(x1,y1,ch) - Prefix(x0,y1,ch)
+            - Prefix(x1,y0,ch) + Prefix(x0,y0,ch);
+    }
+
+    // Mean of the box of the given halfsize centered on (x,y).
+    double Mean(int x, int y, int halfsize, unsigned int ch = 0) const {
+        int s = 2*halfsize+1;
+        return Sum(x-halfsize, y-halfsize, x+halfsize+1, y+halfsize+1, ch)
+            / ((double)s*s);
+    }
+
+    /**
+     * Box blur where the halfsize is read per texel from a single
+     * channel radius texture of the same size. Fractional radii blend
+     * the two nearest box sizes. Equals a single iteration of
+     * TexUtils::Blur for a constant integer radius, at a cost
+     * independent of the radius.
+     */
+    static void BoxBlur(FloatTexture2DPtr tex, FloatTexture2DPtr radius,
+                        unsigned int threads = 0) {
+        IntegralImage sat(tex, threads);
+        Blurrer b = { &sat, tex->GetData(), radius->GetData(), 0 };
+        ParallelFor::Run(0, sat.h, b, threads, 16);
+    }
+
+    static void BoxBlur(FloatTexture2DPtr tex, int halfsize,
+                        unsigned int threads = 0) {
+        IntegralImage sat(tex, threads);
+        Blurrer b = { &sat, tex->GetData(), NULL, (float)halfsize };
+        ParallelFor::Run(0, sat.h, b, threads, 16);
+    }
+
+ private:
+    struct Blurrer {
+        const IntegralImage* sat;
+        float* out;
+        const float* radius;
+        float constant;
+        void operator()(unsigned int from, unsigned int to) {
+            const unsigned int w = sat->w, c = sat->c;
+            for (unsigned int y=from; y<to; y++) {
+                for (unsigned int x=0; x<w; x++) {
+                    float r = radius ? radius[x+y*w] : constant;
+                    if (r < 0) r = 0;
+                    int r0 = (int)std::floor(r);
+                    float t = r - r0;
+                    for (unsigned int ch=0; ch<c; ch++) {
+                        double v = sat->Mean(x, y, r0, ch);
+                        if (t > 0)
+                            v += (sat->Mean(x, y, r0+1, ch) - v) * t;
+                        out[(x+y*w)*c+ch] = (float)v;
+                    }
+                }
+            }
+        }
+    };
+};
+
+/**
+ * Summed volume table of a 3D float texture, the 3D counterpart of
+ * IntegralImage.
+ */
+class IntegralVolume {
+ private:
+    unsigned int w, h, d, c;
+    // (w+1)*(h+1)*(d+1)*c entries, zero on the three low faces
+    std::vector<double> table;
+
+    double* Row(unsigned int y, unsigned int z) {
+        return &table[(z*(h+1)+y)*(w+1)*c];
+    }
+
+    struct RowPass {
+        IntegralVolume* vol;
+        const float* src;
+        void operator()(unsigned int from, unsigned int to) {
+            const unsigned int w = vol->w, h = vol->h, c = vol->c;
+            for (unsigned int z=from; z<to; z++) {
+                for (unsigned int y=0; y<h; y++) {
+                    double* dst = vol->Row(y+1,z+1);
+                    const float* in = src + (y+z*h)*w*c;
+                    for (unsigned int ch=0; ch<c; ch++) {
+                        double sum = 0;
+                        for (unsigned int x=0; x<w; x++) {
+                            sum += in[x*c+ch];
+                            dst[(x+1)*c+ch] = sum;
+                        }
+                    }
+                }
+            }
+        }
+    };
+
+    // column prefix within each slice, parallel over slices
+    struct ColumnPass {
+        IntegralVolume* vol;
+        void operator()(unsigned int from, unsigned int to) {
+            const unsigned int n = (vol->w+1)*vol->c;
+            for (unsigned int z=from; z<to; z++) {
+                for (unsigned int y=1; y<=vol->h; y++) {
+                    double* above = vol->Row(y-1,z+1);
+                    double* row = vol->Row(y,z+1);
+                    for (unsigned int i=0; i<n; i++)
+                        row[i] += above[i];
+                }
+            }
+        }
+    };
+
+    // depth prefix, parallel over rows so every thread walks whole rows
+    struct DepthPass {
+        IntegralVolume* vol;
+        void operator()(unsigned int from, unsigned int to) {
+            const unsigned int n = (vol->w+1)*vol->c;
+            for (unsigned int z=1; z<=vol->d; z++) {
+                for (unsigned int y=from; y<to; y++) {
+                    double* front = vol->Row(y,z-1);
+                    double* row = vol->Row(y,z);
+                    for (unsigned int i=0; i<n; i++)
+                        row[i] += front[i];
+                }
+            }
+        }
+    };
+
+    static int FloorDiv(int a, int b) {
+        return a >= 0 ? a / b : -((-a + b - 1) / b);
+    }
+
+    double At(unsigned int x, unsigned int y, unsigned int z,
+              unsigned int ch) const {
+        return table[((z*(h+1)+y)*(w+1)+x)*c+ch];
+    }
+
+    // sum over the periodic extension of [0,x) x [0,y) x [0,z)
+    double Prefix(int x, int y, int z, unsigned int ch) const {
+        int q[3] = { FloorDiv(x, w), FloorDiv(y, h), FloorDiv(z, d) };
+        unsigned int r[3] = { x - q[0]*w, y - q[1]*h, z - q[2]*d };
+        unsigned int full[3] = { w, h, d };
+        double sum = 0;
+        // each axis contributes q full periods plus a remainder
+        for (unsigned int i=0; i<8; i++) {
+            double coef = 1;
+            unsigned int idx[3];
+            for (unsigned int a=0; a<3; a++) {
+                if (i & (1<<a)) {
+                    coef *= q[a];
+                    idx[a] = full[a];
+                } else
+                    idx[a] = r[a];
+            }
+            if (coef != 0)
+                sum += coef * At(idx[0], idx[1], idx[2], ch);
+        }
+        return sum;
+    }
+
+ public:
+    IntegralVolume(FloatTexture3DPtr tex, unsigned int threads = 0)
+        : w(tex->GetWidth()), h(tex->GetHeight()), d(tex->GetDepth()),
+          c(tex->GetChannels()), table((w+1)*(h+1)*(d+1)*c, 0.0) {
+        TEXUTILS_PROFILE_SCOPE("IntegralVolume", w * h * d,
+                               table.size() * sizeof(double), -1);
+        RowPass rows = { this, tex->GetData() };
+        ParallelFor::Run(0, d, rows, threads);
+        ColumnPass cols = { this };
+        ParallelFor::Run(0, d, cols, threads);
+        DepthPass depth = { this };
+        ParallelFor::Run(0, h+1, depth, threads, 4);
+    }
+
+    unsigned int GetWidth() const { return w; }
+    unsigned int GetHeight() const { return h; }
+    unsigned int GetDepth() const { return d; }
+    unsigned int GetChannels() const { return c; }
+
+    /**
+     * Sum of the voxels in the half open box
+     * [x0,x1) x [y0,y1) x [z0,z1).
+     */
+    double Sum(int x0, int y0, int z0, int x1, int y1, int z1,
+               unsigned int ch = 0) const {
+        return Prefix(x1,y1,z1,ch)
+            - Prefix(x0,y1,z1,ch) - Prefix(x1,y0,z1,ch) - Prefix(x1,y1,z0,ch)
+            + Prefix(x0,y0,z1,ch) + Prefix(x0,y1,z0,ch) + Prefix(x1,y0,z0,ch)
+            - Prefix(x0,y0,z0,ch);
+    }
+
+    double Mean(int x, int y, int z, int halfsize, unsigned int ch = 0) const {
+        int s = 2*halfsize+1;
+        return Sum(x-halfsize, y-halfsize, z-halfsize,
+                   x+halfsize+1, y+halfsize+1, z+halfsize+1, ch)
+            / ((double)s*s*s);
+    }
+
+    /**
+     * Box blur with per voxel halfsize, see IntegralImage::BoxBlur.
+     */
+    static void BoxBlur(FloatTexture3DPtr tex, FloatTexture3DPtr radius,
+                        unsigned int threads = 0) {
+        IntegralVolume sat(tex, threads);
+        Blurrer b = { &sat, tex->GetData(), radius->GetData(), 0 };
+        ParallelFor::Run(0, sat.d, b, threads);
+    }
+
+    static void BoxBlur(FloatTexture3DPtr tex, int halfsize,
+                        unsigned int threads = 0) {
+        IntegralVolume sat(tex, threads);
+        Blurrer b = { &sat, tex->GetData(), NULL, (float)halfsize };
+        ParallelFor::Run(0, sat.d, b, threads);
+    }
+
+ private:
+    struct Blurrer {
+        const IntegralVolume* sat;
+        float* out;
+        const float* radius;
+        float constant;
+        void operator()(unsigned int from, unsigned int to) {
+            const unsigned int w = sat->w, h = sat->h, c = sat->c;
+            for (unsigned int z=from; z<to; z++) {
+                for (unsigned int y=0; y<h; y++) {
+                    for (unsigned int x=0; x<w; x++) {
+                        unsigned int i = x+y*w+z*w*h;
+                        float r = radius ? radius[i] : constant;
+                        if (r < 0) r = 0;
+                        int r0 = (int)std::floor(r);
+                        float t = r - r0;
+                        for (unsigned int ch=0; ch<c; ch++) {
+                            double v = sat->Mean(x, y, z, r0, ch);
+                            if (t > 0)
+                                v += (sat->Mean(x, y, z, r0+1, ch) - v) * t;
+                            out[i*c+ch] = (float)v;
+                        }
+                    }
+                }
+            }
+        }
+    };
+};
+
+} // NS Utils
+} // NS OpenEngine
+
+#endif // _INTEGRAL_IMAGE_
@@ -0,0 +1,344 @@
+// Value noise result cache.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _VALUE_NOISE_CACHE_
+#define _VALUE_NOISE_CACHE_
+
+#include <Utils/ValueNoise.h>
+#include <Utils/TexProfiler.h>
+
+#include <boost/thread/mutex.hpp>
+#include <cstdio>
+#include <cstring>
+#include <list>
+#include <map>
+#include <string>
+
+namespace OpenEngine {
+namespace Utils {
+
+/**
+ * Caches ValueNoise results keyed on the full parameter tuple.
+ *
+ * The memory cache is least recently used with a byte budget. If a
+ * directory is given results are also stored on disk, one file per
+ * parameter tuple named after a hash of the parameters, and the disk
+ * is checked before generating. Files are written in native byte
+ * order.
+ *
+ * Textures are copied in and out of the cache, so callers may modify
+ * the returned texture in place.
+ */
+class NoiseCache {
+ private:
+    struct Entry {
+        NoiseParameters params;
+        FloatTexture2DPtr tex;
+        FloatTexture3DPtr tex3d;
+        unsigned long bytes;
+    };
+
+    typedef std::list<Entry> EntryList;
+    typedef std::map<NoiseParameters, EntryList::iterator> EntryMap;
+
+    static const unsigned int MAGIC = 0x5A4E454F; // "OENZ"
+    static const unsigned int VERSION = 1;
+
+    // file header, followed by w*h*d*channels floats
+    struct FileHeader {
+        unsigned int magic, version;
+        unsigned int xResolution, yResolution, zResolution, bandwidth;
+        float mResolution, mBandwidth;
+        unsigned int blur, layers, seed;
+        unsigned int width, height, depth, channels;
+    };
+
+    EntryList entries; // most recently used first
+    EntryMap index;
+    unsigned long budget, size;
+    std::string directory;
+    unsigned int hits, diskHits, misses;
+    boost::mutex lock;
+
+    static FloatTexture2DPtr Copy(FloatTexture2DPtr tex) {
+        unsigned int w = tex->GetWidth();
+        unsigned int h = tex->GetHeight();
+        unsigned int c = tex->GetChannels();
+        FloatTexture2DPtr out(new FloatTexture2D(w,h,c));
+        std::memcpy(out->GetData(), tex->GetData(), sizeof(float)*w*h*c);
+        return out;
+    }
+
+    static FloatTexture3DPtr Copy(FloatTexture3DPtr tex) {
+        unsigned int w = tex->GetWidth();
+        unsigned int h = tex->GetHeight();
+        unsigned int d = tex->GetDepth();
+        unsigned int c = tex->GetChannels();
+        FloatTexture3DPtr out(new FloatTexture3D(w,h,d,c));
+        std::memcpy(out->GetData(), tex->GetData(), sizeof(float)*w*h*d*c);
+        return out;
+    }
+
+    static void FillHeader(FileHeader& hd, const NoiseParameters& p) {
+        std::memset(&hd, 0, sizeof(FileHeader));
+        hd.magic = MAGIC;
+        hd.version = VERSION;
+        hd.xResolution = p.xResolution;
+        hd.yResolution = p.yResolution;
+        hd.zResolution = p.zResolution;
+        hd.bandwidth = p.bandwidth;
+        hd.mResolution = p.mResolution;
+        hd.mBandwidth = p.mBandwidth;
+        hd.blur = p.blur;
+        hd.layers = p.layers;
+        hd.seed = p.seed;
+    }
+
+    std::string FileName(const NoiseParameters& p) const {
+        FileHeader hd;
+        FillHeader(hd, p);
+        // 64 bit FNV-1a over the parameter part of the header
+        unsigned long long hash = 14695981039346656037ULL;
+        const unsigned char* b = (const unsigned char*)&hd;
+        for (unsigned int i=0; i<sizeof(FileHeader); i++) {
+            hash ^= b[i];
+            hash *= 1099511628211ULL;
+        }
+        char name[32];
+        std::sprintf(name, "%016llx.noise", hash);
+        return directory + "/" + name;
+    }
+
+    bool Load(Entry& e) {
+        if (directory.empty()) return false;
+        FILE* f = std::fopen(FileName(e.params).c_str(), "rb");
+        if (!f) return false;
+
+        FileHeader expected, hd;
+        FillHeader(expected, e.params);
+        bool ok = std::fread(&hd, sizeof(FileHeader), 1, f) == 1;
+        // the parameters are stored to guard against hash collisions
+        ok = ok && std::memcmp(&expected, &hd,
+                               (char*)&expected.width - (char*)&expected) == 0;
+        if (ok) {
+            unsigned long count =
+                (unsigned long)hd.width * hd.height * hd.depth * hd.channels;
+            float* data;
+            if (e.params.Is3D()) {
+                e.tex3d = FloatTexture3DPtr
+                    (new FloatTexture3D(hd.width, hd.height, hd.depth,
+                                        hd.channels));
+                data = e.tex3d->GetData();
+            } else {
+                e.tex = FloatTexture2DPtr
+                    (new FloatTexture2D(hd.width, hd.height, hd.channels));
+                data = e.tex->GetData();
+            }
+            ok = std::fread(data, sizeof(float), count, f) == count;
+            e.bytes = count * sizeof(float);
+        }
+        std::fclose(f);
+        if (!ok) {
+            e.tex.reset();
+            e.tex3d.reset();
+        }
+        return ok;
+    }
+
+    void Store(const Entry& e) {
+        if (directory.empty()) return;
+        FileHeader hd;
+        FillHeader(hd, e.params);
+        float* data;
+        if (e.params.Is3D()) {
+            hd.width = e.tex3d->GetWidth();
+            hd.height = e.tex3d->GetHeight();
+            hd.depth = e.tex3d->GetDepth();
+            hd.channels = e.tex3d->GetChannels();
+            data = e.tex3d->GetData();
+        } else {
+            hd.width = e.tex->GetWidth();
+            hd.height = e.tex->GetHeight();
+            hd.depth = 1;
+            hd.channels = e.tex->GetChannels();
+            data = e.tex->GetData();
+        }
+        // write to a temporary name so readers never see partial files
+        std::string name = FileName(e.params);
+        std::string tmp = name + ".tmp";
+        FILE* f = std::fopen(tmp.c_str(), "wb");
+        if (!f) {
+            logger.warning << "NoiseCache: could not write " << tmp
+                           << logger.end;
+            return;
+        }
+        unsigned long count =
+            (unsigned long)hd.width * hd.height * hd.depth * hd.channels;
+        bool ok = std::fwrite(&hd, sizeof(FileHeader), 1, f) == 1 &&
+            std::fwrite(data, sizeof(float), count, f) == count;
+        ok = (std::fclose(f) == 0) && ok;
+        if (ok) ok = std::rename(tmp.c_str(), name.c_str()) == 0;
+        if (!ok) std::remove(tmp.c_str());
+    }
+
+    // Concurrent loads of the same parameters may both get here, the
+    // first insert wins so the index and the list stay one to one.
+    void Insert(const Entry& e) {
+        if (e.bytes > budget || index.find(e.params) != index.end()) return;
+        entries.push_front(e);
+        index[e.params] = entries.begin();
+        size += e.bytes;
+        while (size > budget) {
+            Entry& last = entries.back();
+            size -= last.bytes;
+            index.erase(last.params);
+            entries.pop_back();
+        }
+    }
+
+    // Look up or generate an entry. The returned entry is shared with
+    // the cache and must be copied before it leaves the class.
+    Entry Fetch(NoiseParameters p) {
+        TEXUTILS_PROFILE_SCOPE("NoiseCache::Fetch", 0, 0, -1);
+        p.normalize = false;
+        {
+            boost::mutex::scoped_lock l(lock);
+            EntryMap::iterator itr = index.find(p);
+            if (itr != index.end()) {
+                // move to front
+                entries.splice(entries.begin(), entries, itr->second);
+                hits++;
+                return entries.front();
+            }
+        }
+
+        Entry e;
+        e.params = p;
+        if (Load(e)) {
+            boost::mutex::scoped_lock l(lock);
+            diskHits++;
+            Insert(e);
+            return e;
+        }
+
+        // generate outside the lock, concurrent misses on the same
+        // parameters may generate twice but give identical results
+        if (p.Is3D()) {
+            e.tex3d = ValueNoise::Generate3D(p);
+            e.bytes = sizeof(float) * e.tex3d->GetWidth() *
+                e.tex3d->GetHeight() * e.tex3d->GetDepth() *
+                e.tex3d->GetChannels();
+        } else {
+            e.tex = ValueNoise::Generate(p);
+            e.bytes = sizeof(float) * e.tex->GetWidth() *
+                e.tex->GetHeight() * e.tex->GetChannels();
+        }
+        Store(e);
+
+        boost::mutex::scoped_lock l(lock);
+        misses++;
+        Insert(e);
+        return e;
+    }
+
+ public:
+    /**
+     * @param budget maximum number of bytes kept in memory
+     * @param directory on-disk cache directory, empty to disable
+     */
+    NoiseCache(unsigned long budget = 64*1024*1024,
+               std::string directory = "")
+        : budget(budget), size(0), directory(directory),
+          hits(0), diskHits(0), misses(0) {}
+
+    FloatTexture2DPtr Generate(const NoiseParameters& p) {
+        return Copy(Fetch(p).tex);
+    }
+
+    FloatTexture3DPtr Generate3D(const NoiseParameters& p) {
+        return Copy(Fetch(p).tex3d);
+    }
+
+    FloatTexture2DPtr Generate(unsigned int xResolution,
+                               unsigned int yResolution,
+                               unsigned int bandwidth,
+                               float mResolution,
+                               float mBandwidth,
+                               unsigned int blur,
+                               unsigned int layers,
+                               unsigned int seed) {
+        NoiseParameters p;
+        p.xResolution = xResolution;
+        p.yResolution = yResolution;
+        p.bandwidth = bandwidth;
+        p.mResolution = mResolution;
+        p.mBandwidth = mBandwidth;
+        p.blur = blur;
+        p.layers = layers;
+        p.seed = seed;
+        return Generate(p);
+    }
+
+    FloatTexture3DPtr Generate3D(unsigned int xResolution,
+                                 unsigned int yResolution,
+                                 unsigned int zResolution,
+                                 unsigned int bandwidth,
+                                 float mResolution,
+                                 float mBandwidth,
+                                 unsigned int blur,
+                                 unsigned int layers,
+                                 unsigned int seed) {
+        NoiseParameters p;
+        p.xResolution = xResolution;
+        p.yResolution = yResolution;
+        p.zResolution = zResolution;
+        p.bandwidth = bandwidth;
+        p.mResolution = mResolution;
+        p.mBandwidth = mBandwidth;
+        p.blur = blur;
+        p.layers = layers;
+        p.seed = seed;
+        return Generate3D(p);
+    }
+
+    // Drop all in-memory entries, files on disk are kept.
+    void Clear() {
+        boost::mutex::scoped_lock l(lock);
+        entries.clear();
+        index.clear();
+        size = 0;
+    }
+
+    unsigned long GetSize() {
+        boost::mutex::scoped_lock l(lock);
+        return size;
+    }
+
+    unsigned long GetBudget() { return budget; }
+
+    unsigned int GetHits() {
+        boost::mutex::scoped_lock l(lock);
+        return hits;
+    }
+
+    unsigned int GetDiskHits() {
+        boost::mutex::scoped_lock l(lock);
+        return diskHits;
+    }
+
+    unsigned int GetMisses() {
+        boost::mutex::scoped_lock l(lock);
+        return misses;
+    }
+};
+
+} // NS Utils
+} // NS OpenEngine
+
+#endif // _VALUE_NOISE_CACHE_
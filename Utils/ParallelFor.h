@@ -0,0 +1,76 @@
+// Parallel for loop over index ranges.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _TEX_PARALLEL_FOR_
+#define _TEX_PARALLEL_FOR_
+
+#include <boost/thread/thread.hpp>
+
+namespace OpenEngine {
+namespace Utils {
+
+/**
+ * Splits an index range into contiguous chunks and runs a functor on
+ * each chunk in its own thread. The functor is called as
+ * f(from, to) with a half open range and must be safe to call
+ * concurrently on disjoint ranges.
+ */
+class ParallelFor {
+ private:
+    template <class F> struct Chunk {
+        F* f;
+        unsigned int from, to;
+        void operator()() { (*f)(from, to); }
+    };
+
+ public:
+    static unsigned int Threads(unsigned int threads = 0) {
+        if (threads) return threads;
+        unsigned int hw = boost::thread::hardware_concurrency();
+        return hw ? hw : 1;
+    }
+
+    /**
+     * @param grain smallest range worth a thread of its own
+     */
+    template <class F> static void Run(unsigned int begin, unsigned int end,
+                                       F& f, unsigned int threads = 0,
+                                       unsigned int grain = 1) {
+        if (end <= begin) return;
+        unsigned int n = end - begin;
+        threads = Threads(threads);
+        if (grain == 0) grain = 1;
+        if (threads > n / grain) threads = n / grain;
+        if (threads <= 1) {
+            f(begin, end);
+            return;
+        }
+
+        boost::thread_group group;
+        unsigned int from = begin;
+        for (unsigned int i=0; i<threads; i++) {
+            unsigned int to = begin + (unsigned int)
+                ((unsigned long long)n * (i+1) / threads);
+            Chunk<F> c;
+            c.f = &f;
+            c.from = from;
+            c.to = to;
+            // run the last chunk on the calling thread
+            if (i == threads-1) c();
+            else group.create_thread(c);
+            from = to;
+        }
+        group.join_all();
+    }
+};
+
+} // NS Utils
+} // NS OpenEngine
+
+#endif // _TEX_PARALLEL_FOR_
@@ -0,0 +1,350 @@
+// Point evaluation of value noise.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _POINT_NOISE_
+#define _POINT_NOISE_
+
+#include <Utils/ValueNoise.h>
+#include <cmath>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
+
+namespace OpenEngine {
+namespace Utils {
+
+/**
+ * Evaluates value noise at arbitrary points without building any
+ * textures. The octave structure follows ValueNoise::Generate and
+ * Generate3D: every octave shrinks the lattice by mResolution and the
+ * amplitude by mBandwidth, lattice values are uniform in
+ * [0;2*bandwidth] and are interpolated linearly with wrap around, and
+ * the 3D octaves alternate sign the same way.
+ *
+ * Lattice values come from an integer hash instead of the random
+ * generator, so the noise matches the textures statistically but not
+ * value for value. The per layer blur is accounted for by variance
+ * only: the deviation of each octave from its mean is scaled by the
+ * standard deviation the ValueNoise upsampling and blur chain leaves
+ * it with, computed per axis at construction. The smoothing itself is
+ * not applied, so the octaves keep their linear interpolation kinks
+ * and look slightly rougher than the textures at the same variance.
+ *
+ * Coordinates are normalized like texture coordinates, [0;1) covers
+ * one period. The batch methods evaluate 8 points per step with SSE2,
+ * using the SSE4.1 multiply and floor when available.
+ */
+class PointNoise {
+ private:
+    struct Octave {
+        float res[3];
+        float amplitude;
+        unsigned int seed;
+    };
+    std::vector<Octave> octaves;
+    // mean the blur keeps of the scaled down octave deviations
+    float offset;
+    bool is3D;
+
+    static unsigned int Hash(unsigned int x, unsigned int y, unsigned int z,
+                             unsigned int seed) {
+        unsigned int h = (x * 0x8da6b343u) ^ (y * 0xd8163841u)
+            ^ (z * 0xcb1ab31fu) ^ seed;
+        h ^= h >> 16;
+        h *= 0x7feb352du;
+        h ^= h >> 15;
+        h *= 0x846ca68bu;
+        h ^= h >> 16;
+        return h;
+    }
+
+    // lattice value in [0;1)
+    static float Value(unsigned int x, unsigned int y, unsigned int z,
+                       unsigned int seed) {
+        return (Hash(x,y,z,seed) >> 8) * (1.0f / 16777216.0f);
+    }
+
+    static void Lattice(float f, float res, unsigned int& i0,
+                        unsigned int& i1, float& t) {
+        float u = f * res;
+        float fl = std::floor(u);
+        t = u - fl;
+        float w = fl - res * std::floor(fl / res);
+        i0 = (unsigned int)w;
+        i1 = (i0 + 1 == (unsigned int)res) ? 0 : i0 + 1;
+    }
+
+    // linear upsampling from in.size() to m texels as TexUtils::Combine
+    static std::vector<double> Upsample(const std::vector<double>& in,
+                                        unsigned int m) {
+        std::vector<double> out(m);
+        const unsigned int n = in.size();
+        for (unsigned int x=0; x<m; x++) {
+            double u = (double)x * n / m;
+            unsigned int i0 = (unsigned int)u;
+            double t = u - i0;
+            i0 %= n;
+            out[x] = in[i0] + (in[(i0 + 1) % n] - in[i0]) * t;
+        }
+        return out;
+    }
+
+    // wrapped three tap box as TexUtils::Blur with halfsize 1
+    static std::vector<double> Box(const std::vector<double>& in) {
+        const unsigned int n = in.size();
+        std::vector<double> out(n);
+        for (unsigned int x=0; x<n; x++)
+            out[x] = (in[(x + n - 1) % n] + in[x] + in[(x + 1) % n]) / 3;
+        return out;
+    }
+
+    /**
+     * Variance ratio along one axis of octave l after the ValueNoise
+     * chain, upsampling level by level to res[0] with passes box
+     * blurs at every level below layers, against the same chain
+     * without the blurs. Summed over a unit impulse per lattice
+     * value, so the interpolation weights are averaged over the
+     * finest texels.
+     */
+    static double BlurVariance(const std::vector<unsigned int>& res,
+                               unsigned int l, unsigned int layers,
+                               unsigned int passes) {
+        double blurred = 0, plain = 0;
+        for (unsigned int i=0; i<res[l]; i++) {
+            std::vector<double> b(res[l], 0.0), p;
+            b[i] = 1;
+            p = b;
+            for (int j=l; j>=0; j--) {
+                if (j < (int)l) {
+                    b = Upsample(b, res[j]);
+                    p = Upsample(p, res[j]);
+                }
+                if (j < (int)layers)
+                    for (unsigned int k=0; k<passes; k++)
+                        b = Box(b);
+            }
+            for (unsigned int x=0; x<res[0]; x++) {
+                blurred += b[x] * b[x];
+                plain += p[x] * p[x];
+            }
+        }
+        return blurred / plain;
+    }
+
+#ifdef __SSE2__
+    static __m128i Mul4(__m128i a, __m128i b) {
+#ifdef __SSE4_1__
+        return _mm_mullo_epi32(a, b);
+#else
+        // low halves of the even and odd lane products
+        __m128i even = _mm_mul_epu32(a, b);
+        __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+        return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0,0,2,0)),
+                                  _mm_shuffle_epi32(odd, _MM_SHUFFLE(0,0,2,0)));
+#endif
+    }
+
+    static __m128 Floor4(__m128 f) {
+#ifdef __SSE4_1__
+        return _mm_floor_ps(f);
+#else
+        __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(f));
+        return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, f), _mm_set1_ps(1.0f)));
+#endif
+    }
+
+    static __m128i Hash4(__m128i x, __m128i y, __m128i z, __m128i seed) {
+        __m128i h = _mm_xor_si128
+            (_mm_xor_si128(Mul4(x, _mm_set1_epi32(0x8da6b343u)),
+                           Mul4(y, _mm_set1_epi32(0xd8163841u))),
+             _mm_xor_si128(Mul4(z, _mm_set1_epi32(0xcb1ab31fu)),
+                           seed));
+        h = _mm_xor_si128(h, _mm_srli_epi32(h, 16));
+        h = Mul4(h, _mm_set1_epi32(0x7feb352du));
+        h = _mm_xor_si128(h, _mm_srli_epi32(h, 15));
+        h = Mul4(h, _mm_set1_epi32(0x846ca68bu));
+        h = _mm_xor_si128(h, _mm_srli_epi32(h, 16));
+        return h;
+    }
+
+    static __m128 Value4(__m128i x, __m128i y, __m128i z, __m128i seed) {
+        return _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(Hash4(x,y,z,seed), 8)),
+                          _mm_set1_ps(1.0f / 16777216.0f));
+    }
+
+    static void Lattice4(__m128 f, __m128 res, __m128i& i0, __m128i& i1,
+                         __m128& t) {
+        __m128 u = _mm_mul_ps(f, res);
+        __m128 fl = Floor4(u);
+        t = _mm_sub_ps(u, fl);
+        __m128 w = _mm_sub_ps(fl, _mm_mul_ps(res, Floor4(_mm_div_ps(fl, res))));
+        i0 = _mm_cvttps_epi32(w);
+        i1 = _mm_add_epi32(i0, _mm_set1_epi32(1));
+        __m128i wrap = _mm_cmpeq_epi32(i1, _mm_cvttps_epi32(res));
+        i1 = _mm_andnot_si128(wrap, i1);
+    }
+
+    static __m128 Lerp4(__m128 a, __m128 b, __m128 t) {
+        return _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), t));
+    }
+
+    // four points, z may be NULL for 2D noise
+    void Evaluate4(const float* x, const float* y, const float* z,
+                   float* out) const {
+        __m128 fx = _mm_loadu_ps(x), fy = _mm_loadu_ps(y);
+        __m128 fz = z ? _mm_loadu_ps(z) : _mm_setzero_ps();
+        __m128 sum = _mm_set1_ps(offset);
+        for (unsigned int o=0; o<octaves.size(); o++) {
+            const Octave& oct = octaves[o];
+            __m128i seed = _mm_set1_epi32(oct.seed);
+            __m128i x0, x1, y0, y1, z0, z1;
+            __m128 tx, ty, tz;
+            Lattice4(fx, _mm_set1_ps(oct.res[0]), x0, x1, tx);
+            Lattice4(fy, _mm_set1_ps(oct.res[1]), y0, y1, ty);
+            Lattice4(fz, _mm_set1_ps(oct.res[2]), z0, z1, tz);
+            __m128 v = Lerp4(Lerp4(Value4(x0,y0,z0,seed), Value4(x1,y0,z0,seed), tx),
+                             Lerp4(Value4(x0,y1,z0,seed), Value4(x1,y1,z0,seed), tx),
+                             ty);
+            if (z) {
+                __m128 v1 =
+                    Lerp4(Lerp4(Value4(x0,y0,z1,seed), Value4(x1,y0,z1,seed), tx),
+                          Lerp4(Value4(x0,y1,z1,seed), Value4(x1,y1,z1,seed), tx),
+                          ty);
+                v = Lerp4(v, v1, tz);
+            }
+            sum = _mm_add_ps(sum, _mm_mul_ps(v, _mm_set1_ps(oct.amplitude)));
+        }
+        _mm_storeu_ps(out, sum);
+    }
+#endif
+
+    static float Lerp(float a, float b, float t) { return a + (b - a) * t; }
+
+    float EvaluateOne(float x, float y, const float* z) const {
+        float sum = offset;
+        for (unsigned int o=0; o<octaves.size(); o++) {
+            const Octave& oct = octaves[o];
+            unsigned int x0, x1, y0, y1, z0, z1;
+            float tx, ty, tz;
+            Lattice(x, oct.res[0], x0, x1, tx);
+            Lattice(y, oct.res[1], y0, y1, ty);
+            Lattice(z ? *z : 0.0f, oct.res[2], z0, z1, tz);
+            float v = Lerp(Lerp(Value(x0,y0,z0,oct.seed), Value(x1,y0,z0,oct.seed), tx),
+                           Lerp(Value(x0,y1,z0,oct.seed), Value(x1,y1,z0,oct.seed), tx),
+                           ty);
+            if (z) {
+                float v1 = Lerp(Lerp(Value(x0,y0,z1,oct.seed), Value(x1,y0,z1,oct.seed), tx),
+                                Lerp(Value(x0,y1,z1,oct.seed), Value(x1,y1,z1,oct.seed), tx),
+                                ty);
+                v = Lerp(v, v1, tz);
+            }
+            sum += v * oct.amplitude;
+        }
+        return sum;
+    }
+
+    void EvaluateBatch(const float* x, const float* y, const float* z,
+                       float* out, unsigned int n) const {
+        unsigned int i = 0;
+#ifdef __SSE2__
+        for (; i+8 <= n; i+=8) {
+            Evaluate4(x+i, y+i, z ? z+i : NULL, out+i);
+            Evaluate4(x+i+4, y+i+4, z ? z+i+4 : NULL, out+i+4);
+        }
+#endif
+        for (; i<n; i++)
+            out[i] = EvaluateOne(x[i], y[i], z ? z+i : NULL);
+    }
+
+ public:
+    /**
+     * Parameters as for ValueNoise::Generate3D, a zResolution of zero
+     * gives 2D noise as ValueNoise::Generate.
+     */
+    PointNoise(unsigned int xResolution, unsigned int yResolution,
+               unsigned int zResolution, unsigned int bandwidth,
+               float mResolution, float mBandwidth, unsigned int blur,
+               unsigned int layers, unsigned int seed)
+        : offset(0), is3D(zResolution != 0) {
+        unsigned int res[3] = { xResolution, yResolution,
+                                is3D ? zResolution : 1 };
+        std::vector<unsigned int> levels[3];
+        for (unsigned int l=0; l<=layers; l++) {
+            Octave o;
+            for (unsigned int a=0; a<3; a++) {
+                o.res[a] = (float)(res[a] ? res[a] : 1);
+                levels[a].push_back((unsigned int)o.res[a]);
+            }
+            o.amplitude = 2.0f * bandwidth;
+            // level layers-l, the 3D generator negates even levels
+            // above the coarsest
+            unsigned int level = layers - l;
+            if (is3D && level != 0 && level % 2 == 0)
+                o.amplitude = -o.amplitude;
+            o.seed = Hash(seed, l, 0x9e3779b9u, 0);
+            octaves.push_back(o);
+
+            for (unsigned int a=0; a<(is3D ? 3u : 2u); a++)
+                res[a] = (unsigned int)(res[a] * mResolution);
+            bandwidth = (unsigned int)(bandwidth * mBandwidth);
+        }
+
+        // Generate3D blurs blur times per level, Generate once
+        const unsigned int passes = is3D ? blur : 1;
+        for (unsigned int l=0; l<=layers; l++) {
+            double ratio = 1;
+            for (unsigned int a=0; a<(is3D ? 3u : 2u); a++)
+                ratio *= BlurVariance(levels[a], l, layers, passes);
+            float s = (float)std::sqrt(ratio);
+            // values are uniform in [0;1), the blur keeps the mean 0.5
+            offset += 0.5f * octaves[l].amplitude * (1 - s);
+            octaves[l].amplitude *= s;
+        }
+    }
+
+    PointNoise(const NoiseParameters& p)
+        : offset(0), is3D(p.Is3D()) {
+        *this = PointNoise(p.xResolution, p.yResolution, p.zResolution,
+                           p.bandwidth, p.mResolution, p.mBandwidth,
+                           p.blur, p.layers, p.seed);
+    }
+
+    bool Is3D() const { return is3D; }
+
+    float Evaluate(float x, float y) const {
+        return EvaluateOne(x, y, NULL);
+    }
+
+    float Evaluate(float x, float y, float z) const {
+        return EvaluateOne(x, y, &z);
+    }
+
+    // Evaluate n 2D points given as separate coordinate arrays.
+    void Evaluate(const float* x, const float* y, float* out,
+                  unsigned int n) const {
+        TEXUTILS_PROFILE_SCOPE("PointNoise::Evaluate", n, 0, -1);
+        EvaluateBatch(x, y, NULL, out, n);
+    }
+
+    void Evaluate(const float* x, const float* y, const float* z,
+                  float* out, unsigned int n) const {
+        TEXUTILS_PROFILE_SCOPE("PointNoise::Evaluate3D", n, 0, -1);
+        EvaluateBatch(x, y, z, out, n);
+    }
+};
+
+} // NS Utils
+} // NS OpenEngine
+
+#endif // _POINT_NOISE_
@@ -0,0 +1,259 @@
+// Batched texture sampling.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _TEX_SAMPLER_
+#define _TEX_SAMPLER_
+
+#include <Math/Vector.h>
+#include <Resources/Texture2D.h>
+#include <Resources/Texture3D.h>
+#include <Resources/Tex.h>
+#include <Utils/ParallelFor.h>
+#include <Utils/TexProfiler.h>
+#include <cmath>
+#include <cstddef>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace OpenEngine {
+namespace Utils {
+
+// float channels of the Tex element types the sampler reads
+template <class T> struct SamplerElement;
+template <> struct SamplerElement<float> {
+    static const unsigned int channels = 1;
+};
+template <unsigned int N> struct SamplerElement<Math::Vector<N,float> > {
+    static const unsigned int channels = N;
+};
+
+/**
+ * Bilinear and trilinear sampling of many points per call. Sample
+ * positions are given as separate coordinate arrays and results are
+ * written to an output array with the channels of each sample
+ * interleaved.
+ *
+ * Coordinates are normalized as for InterpolatedPixel, texel i sits
+ * at i/width. WRAP repeats the texture like GetPixel, CLAMP repeats
+ * the edge texels. Index and weight computation runs four samples at
+ * a time with SSE2, the texel loads are gathered per lane.
+ */
+class Sampler {
+ public:
+    enum Address { WRAP, CLAMP };
+
+ private:
+    // float texels with strides in floats, depth 1 for 2D data
+    struct View {
+        const float* data;
+        unsigned int width, height, depth, channels;
+        std::size_t rowStride, sliceStride;
+    };
+
+    struct Job {
+        View v;
+        const float *x, *y, *z;
+        float* out;
+        Address address;
+
+        // lattice indices and weight along one axis
+        static void Axis(float f, unsigned int n, Address a,
+                         int& i0, int& i1, float& t) {
+            float u = f * n;
+            float fl = std::floor(u);
+            t = u - fl;
+            if (a == WRAP) {
+                float w = fl - n * std::floor(fl / n);
+                i0 = (int)w;
+                i1 = i0 + 1 == (int)n ? 0 : i0 + 1;
+            } else {
+                i0 = fl < 0 ? 0 : (fl > n - 1 ? n - 1 : (int)fl);
+                i1 = fl + 1 < 0 ? 0 : (fl + 1 > n - 1 ? n - 1 : (int)fl + 1);
+            }
+        }
+
+        void One(unsigned int i) {
+            int x0, x1, y0, y1, z0 = 0, z1 = 0;
+            float tx, ty, tz = 0;
+            Axis(x[i], v.width, address, x0, x1, tx);
+            Axis(y[i], v.height, address, y0, y1, ty);
+            if (z) Axis(z[i], v.depth, address, z0, z1, tz);
+            const float* s0 = v.data + z0 * v.sliceStride;
+            const float* s1 = v.data + z1 * v.sliceStride;
+            const unsigned int c = v.channels;
+            for (unsigned int ch=0; ch<c; ch++) {
+                float r = Bilinear(s0, x0, x1, y0, y1, tx, ty, ch);
+                if (z) {
+                    float r1 = Bilinear(s1, x0, x1, y0, y1, tx, ty, ch);
+                    r += (r1 - r) * tz;
+                }
+                out[i*c + ch] = r;
+            }
+        }
+
+        float Bilinear(const float* s, int x0, int x1, int y0, int y1,
+                       float tx, float ty, unsigned int ch) const {
+            const unsigned int c = v.channels;
+            const float* r0 = s + y0 * v.rowStride;
+            const float* r1 = s + y1 * v.rowStride;
+            float a = r0[x0*c+ch] + (r0[x1*c+ch] - r0[x0*c+ch]) * tx;
+            float b = r1[x0*c+ch] + (r1[x1*c+ch] - r1[x0*c+ch]) * tx;
+            return a + (b - a) * ty;
+        }
+
+#ifdef __SSE2__
+        static __m128 Floor4(__m128 f) {
+            __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(f));
+            return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, f), _mm_set1_ps(1.0f)));
+        }
+
+        // element offsets of the two lattice planes along one axis,
+        // pointer sized since slice offsets of large volumes pass 2^31
+        static void Axis4(const float* f, unsigned int n, std::size_t stride,
+                          Address a, std::ptrdiff_t o0[4], std::ptrdiff_t o1[4], __m128& t) {
+            __m128 vn = _mm_set1_ps((float)n);
+            __m128 u = _mm_mul_ps(_mm_loadu_ps(f), vn);
+            __m128 fl = Floor4(u);
+            t = _mm_sub_ps(u, fl);
+            __m128 i0, i1;
+            __m128 one = _mm_set1_ps(1.0f);
+            if (a == WRAP) {
+                i0 = _mm_sub_ps(fl, _mm_mul_ps(vn, Floor4(_mm_div_ps(fl, vn))));
+                i1 = _mm_add_ps(i0, one);
+                i1 = _mm_andnot_ps(_mm_cmpeq_ps(i1, vn), i1);
+            } else {
+                __m128 zero = _mm_setzero_ps(), top = _mm_set1_ps((float)n - 1);
+                i0 = _mm_min_ps(_mm_max_ps(fl, zero), top);
+                i1 = _mm_min_ps(_mm_max_ps(_mm_add_ps(fl, one), zero), top);
+            }
+            int j0[4], j1[4];
+            _mm_storeu_si128((__m128i*)j0, _mm_cvttps_epi32(i0));
+            _mm_storeu_si128((__m128i*)j1, _mm_cvttps_epi32(i1));
+            for (unsigned int l=0; l<4; l++) {
+                o0[l] = j0[l] * (std::ptrdiff_t)stride;
+                o1[l] = j1[l] * (std::ptrdiff_t)stride;
+            }
+        }
+
+        static __m128 Gather(const float* s, const std::ptrdiff_t a[4], const std::ptrdiff_t b[4]) {
+            return _mm_setr_ps(s[a[0]+b[0]], s[a[1]+b[1]], s[a[2]+b[2]], s[a[3]+b[3]]);
+        }
+
+        static __m128 Lerp(__m128 a, __m128 b, __m128 t) {
+            return _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), t));
+        }
+
+        void Four(unsigned int i) {
+            const unsigned int c = v.channels;
+            std::ptrdiff_t x0[4], x1[4], y0[4], y1[4], z0[4] = { 0, 0, 0, 0 }, z1[4] = { 0, 0, 0, 0 };
+            __m128 tx, ty, tz = _mm_setzero_ps();
+            Axis4(x + i, v.width, c, address, x0, x1, tx);
+            Axis4(y + i, v.height, v.rowStride, address, y0, y1, ty);
+            if (z) Axis4(z + i, v.depth, v.sliceStride, address, z0, z1, tz);
+            std::ptrdiff_t r00[4], r01[4], r10[4], r11[4];
+            for (unsigned int l=0; l<4; l++) {
+                r00[l] = y0[l] + z0[l]; r01[l] = y1[l] + z0[l];
+                r10[l] = y0[l] + z1[l]; r11[l] = y1[l] + z1[l];
+            }
+            for (unsigned int ch=0; ch<c; ch++) {
+                const float* s = v.data + ch;
+                __m128 r = Lerp(Lerp(Gather(s, r00, x0), Gather(s, r00, x1), tx),
+                                Lerp(Gather(s, r01, x0), Gather(s, r01, x1), tx), ty);
+                if (z) {
+                    __m128 r1 = Lerp(Lerp(Gather(s, r10, x0), Gather(s, r10, x1), tx),
+                                     Lerp(Gather(s, r11, x0), Gather(s, r11, x1), tx), ty);
+                    r = Lerp(r, r1, tz);
+                }
+                if (c == 1) {
+                    _mm_storeu_ps(out + i, r);
+                } else {
+                    float tmp[4];
+                    _mm_storeu_ps(tmp, r);
+                    for (unsigned int l=0; l<4; l++)
+                        out[(i+l)*c + ch] = tmp[l];
+                }
+            }
+        }
+#endif
+
+        void operator()(unsigned int from, unsigned int to) {
+            unsigned int i = from;
+#ifdef __SSE2__
+            for (; i+4 <= to; i+=4)
+                Four(i);
+#endif
+            for (; i<to; i++)
+                One(i);
+        }
+    };
+
+    static void Run(const View& v, const float* x, const float* y, const float* z,
+                    float* out, unsigned int n, Address address,
+                    unsigned int threads) {
+        TEXUTILS_PROFILE_SCOPE(z ? "Sampler::Sample3D" : "Sampler::Sample", n,
+                               (unsigned long)n * v.channels * sizeof(float), -1);
+        Job job = { v, x, y, z, out, address };
+        ParallelFor::Run(0, n, job, threads, 1 << 14);
+    }
+
+    static View Make(const float* data, unsigned int w, unsigned int h,
+                     unsigned int d, unsigned int c, std::size_t rowStride) {
+        View v = { data, w, h, d, c, rowStride, rowStride * h };
+        return v;
+    }
+
+ public:
+    static void Sample(FloatTexture2DPtr tex, const float* x, const float* y,
+                       float* out, unsigned int n, Address address = WRAP,
+                       unsigned int threads = 0) {
+        unsigned int w = tex->GetWidth(), c = tex->GetChannels();
+        Run(Make(tex->GetData(), w, tex->GetHeight(), 1, c, w * c),
+            x, y, NULL, out, n, address, threads);
+    }
+
+    static void Sample3D(FloatTexture3DPtr tex, const float* x, const float* y,
+                         const float* z, float* out, unsigned int n,
+                         Address address = WRAP, unsigned int threads = 0) {
+        unsigned int w = tex->GetWidth(), c = tex->GetChannels();
+        Run(Make(tex->GetData(), w, tex->GetHeight(), tex->GetDepth(), c, w * c),
+            x, y, z, out, n, address, threads);
+    }
+
+    /**
+     * Tex grids of float or Vector<N,float>, the padded pitch is
+     * honoured.
+     */
+    template <class T> static void Sample(Tex<T,2>& tex, const float* x,
+                                          const float* y, float* out,
+                                          unsigned int n, Address address = WRAP,
+                                          unsigned int threads = 0) {
+        const unsigned int c = SamplerElement<T>::channels;
+        Run(Make((const float*)tex.GetData(), tex.GetWidth(), tex.GetHeight(), 1,
+                 c, tex.GetPitch() * c),
+            x, y, NULL, out, n, address, threads);
+    }
+
+    template <class T> static void Sample3D(Tex<T,3>& tex, const float* x,
+                                            const float* y, const float* z,
+                                            float* out, unsigned int n,
+                                            Address address = WRAP,
+                                            unsigned int threads = 0) {
+        const unsigned int c = SamplerElement<T>::channels;
+        Run(Make((const float*)tex.GetData(), tex.GetWidth(), tex.GetHeight(),
+                 tex.GetDepth(), c, tex.GetPitch() * c),
+            x, y, z, out, n, address, threads);
+    }
+};
+
+} // NS Utils
+} // NS OpenEngine
+
+#endif // _TEX_SAMPLER_
@@ -0,0 +1,129 @@
+// Spectral noise synthesis.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _SPECTRAL_NOISE_
+#define _SPECTRAL_NOISE_
+
+#include <Math/RandomGenerator.h>
+#include <Utils/FFT.h>
+#include <Utils/TexProfiler.h>
+#include <cmath>
+
+namespace OpenEngine {
+namespace Utils {
+
+/**
+ * Noise with a power law spectrum, made by shaping white noise in the
+ * frequency domain. One forward and one inverse transform replace
+ * the per layer noise, combine and blur passes of ValueNoise, and
+ * the result always tiles.
+ *
+ * The amplitude at spatial frequency f is proportional to
+ * f^-exponent between lowCut and highCut (in cycles per texture,
+ * zero disables a limit). The result has zero mean, use
+ * TexUtils::Normalize to map it to a range.
+ */
+class SpectralNoise {
+ private:
+    static float Frequency(unsigned int i, unsigned int n) {
+        return (float)(i <= n/2 ? i : n - i);
+    }
+
+    static float Gain(float f, float exponent, float lowCut, float highCut) {
+        if (f == 0) return 0;
+        if (lowCut > 0 && f < lowCut) return 0;
+        if (highCut > 0 && f > highCut) return 0;
+        return std::pow(f, -exponent);
+    }
+
+ public:
+    /**
+     * Exponent that approximates the octave falloff of ValueNoise,
+     * where each octave scales frequency by 1/mResolution and
+     * amplitude by mBandwidth.
+     */
+    static float ExponentFor(float mResolution, float mBandwidth) {
+        return (float)(-std::log(mBandwidth) / std::log(mResolution));
+    }
+
+    static FloatTexture2DPtr Generate(unsigned int xResolution,
+                                      unsigned int yResolution,
+                                      float exponent,
+                                      unsigned int seed,
+                                      float lowCut = 0, float highCut = 0,
+                                      unsigned int threads = 0) {
+        const unsigned int w = xResolution, h = yResolution;
+        TEXUTILS_PROFILE_SCOPE("SpectralNoise::Generate", w * h,
+                               w * h * sizeof(FFT::Complex), -1);
+        RandomGenerator r;
+        r.Seed(seed);
+        std::vector<FFT::Complex> data(w*h);
+        for (unsigned int i=0; i<w*h; i++)
+            data[i] = r.UniformFloat(-1,1);
+
+        FFT::Transform2D(data, w, h, false, threads);
+        for (unsigned int y=0; y<h; y++) {
+            float fy = Frequency(y,h);
+            for (unsigned int x=0; x<w; x++) {
+                float fx = Frequency(x,w);
+                float f = std::sqrt(fx*fx + fy*fy);
+                data[x+y*w] *= Gain(f, exponent, lowCut, highCut);
+            }
+        }
+        FFT::Transform2D(data, w, h, true, threads);
+
+        FloatTexture2DPtr output(new FloatTexture2D(w,h,1));
+        float* dout = output->GetData();
+        for (unsigned int i=0; i<w*h; i++)
+            dout[i] = data[i].real();
+        return output;
+    }
+
+    static FloatTexture3DPtr Generate3D(unsigned int xResolution,
+                                        unsigned int yResolution,
+                                        unsigned int zResolution,
+                                        float exponent,
+                                        unsigned int seed,
+                                        float lowCut = 0, float highCut = 0,
+                                        unsigned int threads = 0) {
+        const unsigned int w = xResolution, h = yResolution, d = zResolution;
+        TEXUTILS_PROFILE_SCOPE("SpectralNoise::Generate3D", w * h * d,
+                               w * h * d * sizeof(FFT::Complex), -1);
+        RandomGenerator r;
+        r.Seed(seed);
+        std::vector<FFT::Complex> data(w*h*d);
+        for (unsigned int i=0; i<w*h*d; i++)
+            data[i] = r.UniformFloat(-1,1);
+
+        FFT::Transform3D(data, w, h, d, false, threads);
+        for (unsigned int z=0; z<d; z++) {
+            float fz = Frequency(z,d);
+            for (unsigned int y=0; y<h; y++) {
+                float fy = Frequency(y,h);
+                for (unsigned int x=0; x<w; x++) {
+                    float fx = Frequency(x,w);
+                    float f = std::sqrt(fx*fx + fy*fy + fz*fz);
+                    data[x+(y+z*h)*w] *= Gain(f, exponent, lowCut, highCut);
+                }
+            }
+        }
+        FFT::Transform3D(data, w, h, d, true, threads);
+
+        FloatTexture3DPtr output(new FloatTexture3D(w,h,d,1));
+        float* dout = output->GetData();
+        for (unsigned int i=0; i<w*h*d; i++)
+            dout[i] = data[i].real();
+        return output;
+    }
+};
+
+} // NS Utils
+} // NS OpenEngine
+
+#endif // _SPECTRAL_NOISE_
@@ -0,0 +1,566 @@
+// Raw binary texture files.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _TEX_FILE_
+#define _TEX_FILE_
+
+#include <Core/Exceptions.h>
+#include <Math/Vector.h>
+#include <Resources/Texture2D.h>
+#include <Resources/Texture3D.h>
+#include <Resources/Tex.h>
+#include <Utils/TexProfiler.h>
+#include <boost/shared_ptr.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace OpenEngine {
+namespace Utils {
+
+/**
+ * Header of a texture file. Texel data follows the 64 byte header,
+ * either as one uncompressed block or, with compression, as a
+ * sequence of chunks each prefixed by its raw and stored size.
+ *
+ * Elements are stored in host byte order, channels interleaved and x
+ * fastest, then y, then z.
+ */
+struct TexFileHeader {
+    enum Type { UBYTE = 1, FLOAT = 2, DOUBLE = 3 };
+    enum Layout { LINEAR = 0 };
+    enum Compression { NONE = 0, LZ = 1 };
+
+    static const unsigned int MAGIC = 0x58544F45; // "OETX"
+    static const unsigned int VERSION = 1;
+
+    unsigned int magic, version;
+    unsigned int type, elementSize, channels;
+    unsigned int width, height, depth;
+    unsigned int layout, compression, chunkSize;
+    unsigned int reserved[5];
+
+    unsigned long long GetDataSize() const {
+        return (unsigned long long)width * height * depth * channels * elementSize;
+    }
+};
+
+// element type and channels of the texel types that can be stored
+template <class T> struct TexFileType;
+template <> struct TexFileType<unsigned char> {
+    static const unsigned int type = TexFileHeader::UBYTE, channels = 1;
+};
+template <> struct TexFileType<float> {
+    static const unsigned int type = TexFileHeader::FLOAT, channels = 1;
+};
+template <> struct TexFileType<double> {
+    static const unsigned int type = TexFileHeader::DOUBLE, channels = 1;
+};
+template <unsigned int N, class T> struct TexFileType<Math::Vector<N,T> > {
+    static const unsigned int type = TexFileType<T>::type, channels = N;
+};
+
+/**
+ * Byte oriented LZ77 codec in the LZ4 block format, with a byte
+ * shuffle that groups the n-th byte of every element so float fields
+ * compress.
+ */
+class TexFileCodec {
+ private:
+    static unsigned int Read32(const unsigned char* p) {
+        unsigned int v;
+        std::memcpy(&v, p, 4);
+        return v;
+    }
+
+    static void PutLength(std::vector<unsigned char>& out, unsigned int len) {
+        while (len >= 255) {
+            out.push_back(255);
+            len -= 255;
+        }
+        out.push_back(len);
+    }
+
+    static void Sequence(std::vector<unsigned char>& out, const unsigned char* lit,
+                         unsigned int litLen, unsigned int offset,
+                         unsigned int matchLen) {
+        unsigned int m = matchLen ? matchLen - 4 : 0;
+        out.push_back(((litLen < 15 ? litLen : 15) << 4) | (m < 15 ? m : 15));
+        if (litLen >= 15) PutLength(out, litLen - 15);
+        out.insert(out.end(), lit, lit + litLen);
+        if (!matchLen) return;
+        out.push_back(offset & 0xff);
+        out.push_back(offset >> 8);
+        if (m >= 15) PutLength(out, m - 15);
+    }
+
+ public:
+    static void Compress(const unsigned char* in, unsigned int n,
+                         std::vector<unsigned char>& out) {
+        const unsigned int HASH_BITS = 14;
+        std::vector<int> table(1 << HASH_BITS, -1);
+        out.clear();
+        unsigned int anchor = 0, i = 0;
+        // the format ends with at least five literals
+        while (n >= 13 && i < n - 12) {
+            unsigned int seq = Read32(in + i);
+            unsigned int h = (seq * 2654435761u) >> (32 - HASH_BITS);
+            int ref = table[h];
+            table[h] = i;
+            if (ref < 0 || i - ref > 65535 || Read32(in + ref) != seq) {
+                i++;
+                continue;
+            }
+            unsigned int len = 4;
+            while (i + len < n - 5 && in[ref + len] == in[i + len]) len++;
+            Sequence(out, in + anchor, i - anchor, i - ref, len);
+            i += len;
+            anchor = i;
+        }
+        Sequence(out, in + anchor, n - anchor, 0, 0);
+    }
+
+    // false on corrupt input
+    static bool Decompress(const unsigned char* in, unsigned int n,
+                           unsigned char* out, unsigned int size) {
+        const unsigned char* end = in + n;
+        unsigned int o = 0;
+        while (in < end) {
+            unsigned int token = *in++;
+            unsigned int lit = token >> 4;
+            if (lit == 15) {
+                unsigned int b;
+                do {
+                    if (in >= end) return false;
+                    b = *in++;
+                    lit += b;
+                } while (b == 255);
+            }
+            if (lit > (unsigned int)(end - in) || lit > size - o) return false;
+            std::memcpy(out + o, in, lit);
+            in += lit;
+            o += lit;
+            if (in >= end) break;
+            if (end - in < 2) return false;
+            unsigned int offset = in[0] | (in[1] << 8);
+            in += 2;
+            unsigned int len = (token & 15);
+            if (len == 15) {
+                unsigned int b;
+                do {
+                    if (in >= end) return false;
+                    b = *in++;
+                    len += b;
+                } while (b == 255);
+            }
+            len += 4;
+            if (offset == 0 || offset > o || len > size - o) return false;
+            // byte by byte, matches may overlap their own output
+            for (unsigned int k=0; k<len; k++, o++)
+                out[o] = out[o - offset];
+        }
+        return o == size;
+    }
+
+    static void Shuffle(const unsigned char* in, unsigned int n,
+                        unsigned int elementSize, unsigned char* out) {
+        unsigned int count = n / elementSize;
+        for (unsigned int b=0; b<elementSize; b++)
+            for (unsigned int i=0; i<count; i++)
+                out[b*count + i] = in[i*elementSize + b];
+    }
+
+    static void Unshuffle(const unsigned char* in, unsigned int n,
+                          unsigned int elementSize, unsigned char* out) {
+        unsigned int count = n / elementSize;
+        for (unsigned int b=0; b<elementSize; b++)
+            for (unsigned int i=0; i<count; i++)
+                out[i*elementSize + b] = in[b*count + i];
+    }
+};
+
+/**
+ * Streaming writer, texel data can be written in any number of pieces
+ * as it is produced. The file is written under a temporary name and
+ * renamed on Close, so a partial file is never seen under the real
+ * name.
+ */
+class TexFileWriter {
+ private:
+    std::string name, tmp;
+    FILE* file;
+    TexFileHeader header;
+    unsigned long long written;
+    std::vector<unsigned char> chunk, shuffled, packed;
+
+    // owns the open file
+    TexFileWriter(const TexFileWriter&);
+    TexFileWriter& operator=(const TexFileWriter&);
+
+    void Fail(const std::string& msg) {
+        if (file) std::fclose(file);
+        file = NULL;
+        std::remove(tmp.c_str());
+        throw Core::Exception("TexFileWriter: " + msg + " " + name);
+    }
+
+    // fwrite in pieces, a single call may not take more than size_t
+    void Put(const void* data, unsigned long long bytes) {
+        const unsigned char* p = (const unsigned char*)data;
+        while (bytes) {
+            size_t n = bytes < (1ULL << 30) ? (size_t)bytes : (size_t)1 << 30;
+            if (std::fwrite(p, 1, n, file) != n) Fail("write failed");
+            p += n;
+            bytes -= n;
+        }
+    }
+
+    void FlushChunk() {
+        if (chunk.empty()) return;
+        unsigned int raw = chunk.size();
+        const unsigned char* src = &chunk[0];
+        if (header.elementSize > 1) {
+            shuffled.resize(raw);
+            TexFileCodec::Shuffle(src, raw, header.elementSize, &shuffled[0]);
+            src = &shuffled[0];
+        }
+        TexFileCodec::Compress(src, raw, packed);
+        // incompressible chunks are stored as is
+        unsigned int stored = packed.size() < raw ? packed.size() : raw;
+        unsigned int sizes[2] = { raw, stored };
+        Put(sizes, sizeof(sizes));
+        Put(stored < raw ? &packed[0] : &chunk[0], stored);
+        chunk.clear();
+    }
+
+ public:
+    /**
+     * @param type one of TexFileHeader::Type
+     * @param chunkSize bytes per compressed chunk, rounded down to
+     * whole elements
+     */
+    TexFileWriter(const std::string& name, unsigned int type,
+                  unsigned int elementSize, unsigned int channels,
+                  unsigned int width, unsigned int height, unsigned int depth = 1,
+                  bool compress = false, unsigned int chunkSize = 1 << 20)
+        : name(name), tmp(name + ".tmp"), file(NULL), written(0) {
+        std::memset(&header, 0, sizeof(TexFileHeader));
+        header.magic = TexFileHeader::MAGIC;
+        header.version = TexFileHeader::VERSION;
+        header.type = type;
+        header.elementSize = elementSize;
+        header.channels = channels;
+        header.width = width;
+        header.height = height;
+        header.depth = depth;
+        header.layout = TexFileHeader::LINEAR;
+        header.compression = compress ? TexFileHeader::LZ : TexFileHeader::NONE;
+        header.chunkSize = chunkSize - chunkSize % elementSize;
+        if (header.chunkSize == 0) header.chunkSize = elementSize;
+        file = std::fopen(tmp.c_str(), "wb");
+        if (!file) Fail("could not open");
+        Put(&header, sizeof(TexFileHeader));
+    }
+
+    ~TexFileWriter() {
+        // not closed, drop the partial file
+        if (file) {
+            std::fclose(file);
+            std::remove(tmp.c_str());
+        }
+    }
+
+    void Write(const void* data, unsigned long long bytes) {
+        if (!file) throw Core::Exception("TexFileWriter: closed " + name);
+        if (written + bytes > header.GetDataSize()) Fail("too much data for");
+        written += bytes;
+        if (header.compression == TexFileHeader::NONE) {
+            Put(data, bytes);
+            return;
+        }
+        const unsigned char* p = (const unsigned char*)data;
+        while (bytes) {
+            unsigned int n = header.chunkSize - chunk.size();
+            if (n > bytes) n = bytes;
+            chunk.insert(chunk.end(), p, p + n);
+            p += n;
+            bytes -= n;
+            if (chunk.size() == header.chunkSize) FlushChunk();
+        }
+    }
+
+    void Close() {
+        if (!file) return;
+        if (written != header.GetDataSize()) Fail("missing data for");
+        FlushChunk();
+        if (std::fclose(file) != 0) {
+            file = NULL;
+            Fail("close failed");
+        }
+        file = NULL;
+        if (std::rename(tmp.c_str(), name.c_str()) != 0) Fail("rename failed");
+    }
+};
+
+/**
+ * Read only view of a texture file. Uncompressed files are memory
+ * mapped where available so the texels are read straight from the
+ * page cache, compressed files are decoded chunk by chunk into memory.
+ */
+class TexFileMapping {
+ private:
+    std::string name;
+    TexFileHeader header;
+    const unsigned char* base;
+    unsigned long long size;
+    std::vector<unsigned char> buffer;
+    const unsigned char* data;
+
+    // owns the mapping, a copy would unmap it twice
+    TexFileMapping(const TexFileMapping&);
+    TexFileMapping& operator=(const TexFileMapping&);
+
+    void Fail(const std::string& msg) {
+        Unmap();
+        throw Core::Exception("TexFileMapping: " + msg + " " + name);
+    }
+
+    void Unmap() {
+#ifndef _WIN32
+        if (base) munmap((void*)base, size);
+#endif
+        base = NULL;
+    }
+
+    void Map() {
+#ifndef _WIN32
+        int fd = open(name.c_str(), O_RDONLY);
+        if (fd < 0) Fail("could not open");
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(TexFileHeader)) {
+            close(fd);
+            Fail("not a texture file");
+        }
+        size = st.st_size;
+        void* p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) Fail("could not map");
+        base = (const unsigned char*)p;
+#else
+        FILE* f = std::fopen(name.c_str(), "rb");
+        if (!f) Fail("could not open");
+        std::fseek(f, 0, SEEK_END);
+        size = std::ftell(f);
+        std::fseek(f, 0, SEEK_SET);
+        buffer.resize(size);
+        bool ok = size && std::fread(&buffer[0], 1, size, f) == size;
+        std::fclose(f);
+        if (!ok || size < sizeof(TexFileHeader)) Fail("not a texture file");
+        data = &buffer[0];
+#endif
+    }
+
+    const unsigned char* Begin() const {
+        return base ? base : data;
+    }
+
+    void Decode(const unsigned char* p, const unsigned char* end) {
+        const unsigned long long total = header.GetDataSize();
+        std::vector<unsigned char> decoded(total);
+        std::vector<unsigned char> tmp;
+        unsigned long long o = 0;
+        while (o < total) {
+            unsigned int sizes[2];
+            if (end - p < (long)sizeof(sizes)) Fail("truncated");
+            std::memcpy(sizes, p, sizeof(sizes));
+            p += sizeof(sizes);
+            unsigned int raw = sizes[0], stored = sizes[1];
+            // an empty chunk makes no progress and would loop forever
+            if (raw == 0 || raw > total - o || stored > raw ||
+                (unsigned long long)(end - p) < stored)
+                Fail("corrupt chunk in");
+            if (stored == raw) {
+                std::memcpy(&decoded[o], p, raw);
+            } else {
+                unsigned char* dst = &decoded[o];
+                if (header.elementSize > 1) {
+                    tmp.resize(raw);
+                    dst = &tmp[0];
+                }
+                if (!TexFileCodec::Decompress(p, stored, dst, raw))
+                    Fail("corrupt chunk in");
+                if (header.elementSize > 1)
+                    TexFileCodec::Unshuffle(dst, raw, header.elementSize, &decoded[o]);
+            }
+            p += stored;
+            o += raw;
+        }
+        buffer.swap(decoded);
+    }
+
+ public:
+    TexFileMapping(const std::string& name)
+        : name(name), base(NULL), size(0), data(NULL) {
+        TEXUTILS_PROFILE_SCOPE("TexFileMapping::Open", 0, 0, -1);
+        Map();
+        const unsigned char* p = Begin();
+        std::memcpy(&header, p, sizeof(TexFileHeader));
+        if (header.magic != TexFileHeader::MAGIC ||
+            header.version != TexFileHeader::VERSION)
+            Fail("not a texture file");
+        if (header.layout != TexFileHeader::LINEAR)
+            Fail("unknown layout in");
+        if (header.compression != TexFileHeader::NONE &&
+            header.compression != TexFileHeader::LZ)
+            Fail("unknown compression in");
+        p += sizeof(TexFileHeader);
+        const unsigned char* end = Begin() + size;
+        if (header.compression == TexFileHeader::NONE) {
+            if ((unsigned long long)(end - p) < header.GetDataSize())
+                Fail("truncated");
+            data = p;
+        } else {
+            Decode(p, end);
+            Unmap();
+            data = buffer.empty() ? NULL : &buffer[0];
+        }
+    }
+
+    ~TexFileMapping() { Unmap(); }
+
+    const TexFileHeader& GetHeader() const { return header; }
+
+    // Texel data, valid for the lifetime of the mapping.
+    const void* GetData() const { return data; }
+
+    bool IsMapped() const { return base != NULL; }
+
+    void Check(unsigned int type, unsigned int channels,
+               bool volume = false) {
+        if (header.type != type || header.channels != channels)
+            Fail("type or channels differ in");
+        if (!volume && header.depth != 1) Fail("not a 2D texture");
+    }
+};
+
+/**
+ * Save and load whole textures in the texture file format, without
+ * the quantization of an image format.
+ */
+class TexFile {
+ private:
+    TexFile() {}
+
+ public:
+    static void Save(FloatTexture2DPtr tex, const std::string& name,
+                     bool compress = false) {
+        unsigned int w = tex->GetWidth(), h = tex->GetHeight();
+        unsigned int c = tex->GetChannels();
+        TEXUTILS_PROFILE_SCOPE("TexFile::Save", w * h, w * h * c * sizeof(float), -1);
+        TexFileWriter out(name, TexFileHeader::FLOAT, sizeof(float), c, w, h, 1, compress);
+        out.Write(tex->GetData(), (unsigned long long)w * h * c * sizeof(float));
+        out.Close();
+    }
+
+    static void Save(FloatTexture3DPtr tex, const std::string& name,
+                     bool compress = false) {
+        unsigned int w = tex->GetWidth(), h = tex->GetHeight();
+        unsigned int d = tex->GetDepth(), c = tex->GetChannels();
+        TEXUTILS_PROFILE_SCOPE("TexFile::Save3D", w * h * d,
+                               w * h * d * c * sizeof(float), -1);
+        TexFileWriter out(name, TexFileHeader::FLOAT, sizeof(float), c, w, h, d, compress);
+        // a slice at a time keeps the chunk buffer small
+        for (unsigned int z=0; z<d; z++)
+            out.Write(tex->GetData() + (unsigned long long)z * w * h * c,
+                      (unsigned long long)w * h * c * sizeof(float));
+        out.Close();
+    }
+
+    /**
+     * Tex grids of up to three dimensions, rows are written without
+     * their padding.
+     */
+    template <class T, unsigned int D> static void Save(Tex<T,D>& tex,
+                                                        const std::string& name,
+                                                        bool compress = false) {
+        unsigned int w = tex.GetWidth(), h = tex.GetHeight(), d = tex.GetDepth();
+        const unsigned int c = TexFileType<T>::channels;
+        TEXUTILS_PROFILE_SCOPE("TexFile::SaveTex", w * h * d, w * h * d * sizeof(T), -1);
+        TexFileWriter out(name, TexFileType<T>::type, sizeof(T) / c, c, w, h, d, compress);
+        for (unsigned int r=0; r<tex.GetRows(); r++)
+            out.Write(tex[r], (unsigned long long)w * sizeof(T));
+        out.Close();
+    }
+
+    static FloatTexture2DPtr LoadFloat2D(const std::string& name) {
+        TexFileMapping in(name);
+        const TexFileHeader& hd = in.GetHeader();
+        in.Check(TexFileHeader::FLOAT, hd.channels);
+        TEXUTILS_PROFILE_SCOPE("TexFile::Load", hd.width * hd.height, hd.GetDataSize(), -1);
+        FloatTexture2DPtr tex(new FloatTexture2D(hd.width, hd.height, hd.channels));
+        std::memcpy(tex->GetData(), in.GetData(), hd.GetDataSize());
+        return tex;
+    }
+
+    static FloatTexture3DPtr LoadFloat3D(const std::string& name) {
+        TexFileMapping in(name);
+        const TexFileHeader& hd = in.GetHeader();
+        in.Check(TexFileHeader::FLOAT, hd.channels, true);
+        TEXUTILS_PROFILE_SCOPE("TexFile::Load3D", hd.width * hd.height * hd.depth,
+                               hd.GetDataSize(), -1);
+        FloatTexture3DPtr tex(new FloatTexture3D(hd.width, hd.height, hd.depth,
+                                                 hd.channels));
+        std::memcpy(tex->GetData(), in.GetData(), hd.GetDataSize());
+        return tex;
+    }
+
+    template <class T> static boost::shared_ptr<Tex<T> > LoadTex(const std::string& name) {
+        TexFileMapping in(name);
+        const TexFileHeader& hd = in.GetHeader();
+        in.Check(TexFileType<T>::type, TexFileType<T>::channels);
+        boost::shared_ptr<Tex<T> > tex(new Tex<T>(hd.width, hd.height));
+        CopyRows(in, *tex);
+        return tex;
+    }
+
+    template <class T> static boost::shared_ptr<Tex<T,3> > LoadTex3D(const std::string& name) {
+        TexFileMapping in(name);
+        const TexFileHeader& hd = in.GetHeader();
+        in.Check(TexFileType<T>::type, TexFileType<T>::channels, true);
+        boost::shared_ptr<Tex<T,3> > tex(new Tex<T,3>(hd.width, hd.height, hd.depth));
+        CopyRows(in, *tex);
+        return tex;
+    }
+
+ private:
+    template <class T, unsigned int D>
+    static void CopyRows(const TexFileMapping& in, Tex<T,D>& tex) {
+        const TexFileHeader& hd = in.GetHeader();
+        TEXUTILS_PROFILE_SCOPE("TexFile::LoadTex", hd.width * hd.height * hd.depth,
+                               hd.GetDataSize(), -1);
+        const T* src = (const T*)in.GetData();
+        for (unsigned int r=0; r<tex.GetRows(); r++)
+            std::copy(src + (unsigned long)r * hd.width,
+                      src + (unsigned long)(r + 1) * hd.width, tex[r]);
+    }
+};
+
+} // NS Utils
+} // NS OpenEngine
+
+#endif // _TEX_FILE_
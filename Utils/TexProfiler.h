@@ -0,0 +1,196 @@
+// Texture Utils profiler.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _TEX_PROFILER_
+#define _TEX_PROFILER_
+
+// Compile with TEXUTILS_PROFILE defined to record a trace event for
+// every TexUtils function and every ValueNoise layer. Without it the
+// TEXUTILS_PROFILE_* macros expand to nothing.
+
+#ifdef TEXUTILS_PROFILE
+
+#include <Logging/Logger.h>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace OpenEngine {
+    namespace Utils {
+
+        /**
+         * A single timed call. Times are in microseconds relative to
+         * the first profiler use, octave is -1 for calls that are
+         * not part of a noise layer.
+         */
+        struct TexProfileEvent {
+            const char* name;
+            double start, duration;
+            unsigned long texels, bytes;
+            int octave;
+            unsigned long thread;
+        };
+
+        class TexProfiler {
+        private:
+            struct State {
+                boost::mutex lock;
+                std::vector<TexProfileEvent> events;
+                boost::posix_time::ptime epoch;
+                boost::thread_specific_ptr<unsigned long> thread;
+                unsigned long threads;
+                State() : epoch(boost::posix_time::microsec_clock::universal_time()),
+                          threads(0) {}
+            };
+
+            static State& GetState() {
+                static State state;
+                return state;
+            }
+
+        public:
+            /**
+             * Small stable number identifying the calling thread,
+             * handed out in order of each thread's first event.
+             */
+            static unsigned long ThreadIndex() {
+                State& s = GetState();
+                unsigned long* index = s.thread.get();
+                if (!index) {
+                    boost::mutex::scoped_lock l(s.lock);
+                    index = new unsigned long(s.threads++);
+                    s.thread.reset(index);
+                }
+                return *index;
+            }
+
+            static double Now() {
+                return (boost::posix_time::microsec_clock::universal_time()
+                        - GetState().epoch).total_microseconds();
+            }
+
+            static void Record(const TexProfileEvent& e) {
+                State& s = GetState();
+                boost::mutex::scoped_lock l(s.lock);
+                s.events.push_back(e);
+            }
+
+            static std::vector<TexProfileEvent> GetEvents() {
+                State& s = GetState();
+                boost::mutex::scoped_lock l(s.lock);
+                return s.events;
+            }
+
+            static void Clear() {
+                State& s = GetState();
+                boost::mutex::scoped_lock l(s.lock);
+                s.events.clear();
+            }
+
+            /**
+             * Write all recorded events as Chrome trace JSON, loadable
+             * in chrome://tracing.
+             */
+            static void WriteChromeTrace(std::ostream& out) {
+                std::vector<TexProfileEvent> events = GetEvents();
+                out << "{\"traceEvents\":[";
+                for (unsigned int i=0; i<events.size(); i++) {
+                    const TexProfileEvent& e = events[i];
+                    if (i) out << ",";
+                    out << "\n{\"name\":\"" << e.name << "\""
+                        << ",\"cat\":\"TexUtils\",\"ph\":\"X\",\"pid\":0"
+                        << ",\"tid\":" << e.thread
+                        << ",\"ts\":" << e.start
+                        << ",\"dur\":" << e.duration
+                        << ",\"args\":{\"texels\":" << e.texels
+                        << ",\"bytes\":" << e.bytes
+                        << ",\"octave\":" << e.octave << "}}";
+                }
+                out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+            }
+
+            static void WriteChromeTrace(const std::string& filename) {
+                std::ofstream out(filename.c_str());
+                WriteChromeTrace(out);
+            }
+
+            /**
+             * Log calls, total time and throughput for each stage.
+             */
+            static void LogSummary() {
+                std::vector<TexProfileEvent> events = GetEvents();
+                std::map<std::string, TexProfileEvent> stages;
+                std::map<std::string, unsigned int> calls;
+                for (unsigned int i=0; i<events.size(); i++) {
+                    const TexProfileEvent& e = events[i];
+                    if (!calls[e.name]) {
+                        TexProfileEvent zero = {e.name, 0, 0, 0, 0, -1, 0};
+                        stages[e.name] = zero;
+                    }
+                    TexProfileEvent& s = stages[e.name];
+                    s.duration += e.duration;
+                    s.texels += e.texels;
+                    s.bytes += e.bytes;
+                    calls[e.name]++;
+                }
+                std::map<std::string, TexProfileEvent>::iterator itr;
+                for (itr = stages.begin(); itr != stages.end(); ++itr) {
+                    const TexProfileEvent& s = itr->second;
+                    logger.info << itr->first
+                                << ": calls " << calls[itr->first]
+                                << ", " << s.duration / 1000.0 << " ms"
+                                << ", texels " << s.texels
+                                << ", bytes " << s.bytes << logger.end;
+                }
+            }
+        };
+
+        /**
+         * Records the lifetime of the enclosing scope as one event.
+         */
+        class TexProfileScope {
+        private:
+            TexProfileEvent e;
+        public:
+            TexProfileScope(const char* name, unsigned long texels,
+                            unsigned long bytes, int octave) {
+                e.name = name;
+                e.texels = texels;
+                e.bytes = bytes;
+                e.octave = octave;
+                e.start = TexProfiler::Now();
+            }
+            ~TexProfileScope() {
+                e.duration = TexProfiler::Now() - e.start;
+                e.thread = TexProfiler::ThreadIndex();
+                TexProfiler::Record(e);
+            }
+        };
+
+    } // NS Utils
+} // NS OpenEngine
+
+#define TEXUTILS_PROFILE_CONCAT_(a,b) a##b
+#define TEXUTILS_PROFILE_CONCAT(a,b) TEXUTILS_PROFILE_CONCAT_(a,b)
+#define TEXUTILS_PROFILE_SCOPE(name, texels, bytes, octave)             \
+    OpenEngine::Utils::TexProfileScope                                  \
+    TEXUTILS_PROFILE_CONCAT(_texProfileScope, __LINE__)                 \
+    (name, (unsigned long)(texels), (unsigned long)(bytes), octave)
+
+#else
+
+#define TEXUTILS_PROFILE_SCOPE(name, texels, bytes, octave)
+
+#endif // TEXUTILS_PROFILE
+
+#endif // _TEX_PROFILER_
@@ -0,0 +1,431 @@
+// Histogram statistics and percentile normalization.
+// -------------------------------------------------------------------
+// Copyright (C) 2010 OpenEngine.dk (See AUTHORS)
+//
+// This program is free software; It is covered by the GNU General
+// Public License version 2 or any later version.
+// See the GNU General Public License for more details (see LICENSE).
+//--------------------------------------------------------------------
+
+#ifndef _TEX_STATS_
+#define _TEX_STATS_
+
+#include <Resources/Texture2D.h>
+#include <Resources/Texture3D.h>
+#include <Resources/Tex.h>
+#include <Utils/ParallelFor.h>
+#include <Utils/TexProfiler.h>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+namespace OpenEngine {
+namespace Utils {
+
+/**
+ * Statistics of one channel of a float texture.
+ *
+ * The coarse histogram is keyed by the upper 16 bits of the order
+ * preserving integer form of each float, so it needs no value range
+ * up front and is filled in the same sweep as the moments. A coarse
+ * bin spans 1/128 of the magnitude of its values, so on its own a
+ * field in [290;310] would land in about ten bins two units wide.
+ *
+ * A second sweep therefore refines the range between the 0.1 and 99.9
+ * percentiles of the coarse histogram into BINS equal
+ * bins, placed by the data's spread instead of its magnitude while
+ * outliers beyond that range cannot stretch them. Percentiles falling
+ * in the refined range are taken from it, the rest from the coarse
+ * bins.
+ */
+struct TexStatistics {
+    static const unsigned int BINS = 1 << 16;
+
+    unsigned long count;
+    float min, max;
+    double mean, variance;
+    std::vector<unsigned long> histogram;
+    // equal bins over [refinedLo;refinedHi], refinedBelow texels are
+    // below, empty when the range is a single value
+    float refinedLo, refinedHi;
+    unsigned long refinedBelow;
+    std::vector<unsigned long> refined;
+
+    static unsigned int Key(float v) {
+        unsigned int u;
+        std::memcpy(&u, &v, sizeof(u));
+        u = (u & 0x80000000u) ? ~u : (u | 0x80000000u);
+        return u >> 16;
+    }
+
+    // smallest float of bin k
+    static float Edge(unsigned int k) {
+        unsigned int u = k << 16;
+        u = (u & 0x80000000u) ? (u & 0x7FFFFFFFu) : ~u;
+        float v;
+        std::memcpy(&v, &u, sizeof(v));
+        return v;
+    }
+
+    // value range of coarse bin k, clipped to the data
+    void Bounds(unsigned int k, float& lo, float& hi) const {
+        lo = Edge(k);
+        hi = k+1 < BINS ? Edge(k+1) : max;
+        if (lo > hi) std::swap(lo, hi);
+        if (lo < min) lo = min;
+        if (hi > max) hi = max;
+    }
+
+    // coarse bin holding the given rank
+    unsigned int CoarseBin(double rank, unsigned long& below) const {
+        below = 0;
+        for (unsigned int k=0; k<BINS; k++) {
+            unsigned long n = histogram[k];
+            if (n != 0 && below + n > rank) return k;
+            below += n;
+        }
+        return BINS - 1;
+    }
+
+    // spread a bin's n texels evenly over [lo;hi] at mid ranks
+    static float Place(float lo, float hi, double rank, unsigned long below,
+                       unsigned long n) {
+        // clamped since the half rank overshoots small bins
+        double f = (rank - below + 0.5) / n;
+        f = f < 0 ? 0 : (f > 1 ? 1 : f);
+        return lo + (hi - lo) * (float)f;
+    }
+
+    /**
+     * Value below which the fraction p of the texels lie, p in [0;1].
+     */
+    float Percentile(float p) const {
+        if (count == 0) return 0;
+        if (p <= 0) return min;
+        if (p >= 1) return max;
+        double rank = p * (count - 1);
+        if (!refined.empty() && rank >= refinedBelow) {
+            const float width = (refinedHi - refinedLo) / BINS;
+            unsigned long below = refinedBelow;
+            for (unsigned int k=0; k<BINS; k++) {
+                unsigned long n = refined[k];
+                if (n != 0 && below + n > rank)
+                    return Place(refinedLo + k * width,
+                                 k+1 < BINS ? refinedLo + (k+1) * width : refinedHi,
+                                 rank, below, n);
+                below += n;
+            }
+        }
+        unsigned long below;
+        unsigned int k = CoarseBin(rank, below);
+        float lo, hi;
+        Bounds(k, lo, hi);
+        return Place(lo, hi, rank, below, histogram[k]);
+    }
+};
+
+
+/**
+ * Tone curve on [0;1] sampled into a table once, so applying it costs
+ * a lookup and a lerp per texel regardless of the curve.
+ */
+class ToneCurve {
+ private:
+    std::vector<float> table;
+
+ public:
+    ToneCurve(float (*curve)(float), unsigned int size = 1024)
+        : table(size + 1) {
+        for (unsigned int i=0; i<=size; i++)
+            table[i] = curve((float)i / size);
+    }
+
+    float operator()(float t) const {
+        const unsigned int last = table.size() - 1;
+        float u = t * last;
+        if (u <= 0) return table[0];
+        unsigned int i = (unsigned int)u;
+        if (i >= last) return table[last];
+        return table[i] + (table[i+1] - table[i]) * (u - i);
+    }
+};
+
+/**
+ * Statistics and percentile clipped normalization of float textures.
+ *
+ * Compute makes two parallel sweeps, the first for the moments and
+ * the coarse histogram, the second for the refined histogram. Each
+ * thread fills its own partial result and they are merged afterwards.
+ * Normalize adds one parallel remap sweep.
+ *
+ * Like TexUtils::Normalize only the given channel is read and
+ * written. Tex grids are handled with their padded pitch, normalizing
+ * one to [0;1] before Tex::CopyToTexture replaces the min/max scaling
+ * of Tex::ToTexture.
+ */
+class TexStats {
+ private:
+    // rows of width texels, rowStride floats apart
+    struct View {
+        float* data;
+        unsigned int width, rows, channels;
+        unsigned long rowStride;
+    };
+
+    struct Partial {
+        unsigned long count;
+        float min, max;
+        double sum, sumSq;
+        std::vector<unsigned long> histogram;
+    };
+
+    struct Sweep {
+        View v;
+        unsigned int parts;
+        float shift;
+        Partial* partials;
+        void operator()(unsigned int from, unsigned int to) {
+            for (unsigned int p=from; p<to; p++) {
+                Partial& r = partials[p];
+                r.count = 0;
+                r.min = std::numeric_limits<float>::max();
+                r.max = -std::numeric_limits<float>::max();
+                r.sum = r.sumSq = 0;
+                r.histogram.assign(TexStatistics::BINS, 0);
+                unsigned long* hist = &r.histogram[0];
+                unsigned int y0 = (unsigned long)v.rows * p / parts;
+                unsigned int y1 = (unsigned long)v.rows * (p+1) / parts;
+                for (unsigned int y=y0; y<y1; y++) {
+                    const float* row = v.data + y * v.rowStride;
+                    for (unsigned int x=0; x<v.width; x++) {
+                        float f = row[x * v.channels];
+                        if (f < r.min) r.min = f;
+                        if (f > r.max) r.max = f;
+                        // shifted by a texel value against cancellation
+                        double d = f - shift;
+                        r.sum += d;
+                        r.sumSq += d * d;
+                        hist[TexStatistics::Key(f)]++;
+                    }
+                }
+                r.count = (unsigned long)(y1 - y0) * v.width;
+            }
+        }
+    };
+
+    struct Refine {
+        View v;
+        unsigned int parts;
+        float lo, hi, scale;
+        Partial* partials;
+        void operator()(unsigned int from, unsigned int to) {
+            for (unsigned int p=from; p<to; p++) {
+                Partial& r = partials[p];
+                r.count = 0;
+                r.histogram.assign(TexStatistics::BINS, 0);
+                unsigned long* hist = &r.histogram[0];
+                unsigned int y0 = (unsigned long)v.rows * p / parts;
+                unsigned int y1 = (unsigned long)v.rows * (p+1) / parts;
+                for (unsigned int y=y0; y<y1; y++) {
+                    const float* row = v.data + y * v.rowStride;
+                    for (unsigned int x=0; x<v.width; x++) {
+                        float f = row[x * v.channels];
+                        if (f < lo) r.count++;
+                        else if (f <= hi) {
+                            unsigned int k = (unsigned int)((f - lo) * scale);
+                            hist[k < TexStatistics::BINS ? k : TexStatistics::BINS - 1]++;
+                        }
+                    }
+                }
+            }
+        }
+    };
+
+    struct Remap {
+        View v;
+        float lo, scale, bLimit, range;
+        const ToneCurve* curve;
+        void operator()(unsigned int from, unsigned int to) {
+            for (unsigned int y=from; y<to; y++) {
+                float* row = v.data + y * v.rowStride;
+                for (unsigned int x=0; x<v.width; x++) {
+                    float& f = row[x * v.channels];
+                    float t = (f - lo) * scale;
+                    t = t < 0 ? 0 : (t > 1 ? 1 : t);
+                    if (curve) t = (*curve)(t);
+                    f = bLimit + t * range;
+                }
+            }
+        }
+    };
+
+    static View Make(float* data, unsigned int w, unsigned int rows,
+                     unsigned int c, unsigned long rowStride,
+                     unsigned int channel) {
+        View v = { data + channel, w, rows, c, rowStride };
+        return v;
+    }
+
+    static TexStatistics Run(const View& v, unsigned int threads) {
+        TEXUTILS_PROFILE_SCOPE("TexStats::Compute", v.width * v.rows,
+                               v.width * v.rows * sizeof(float), -1);
+        TexStatistics s;
+        s.count = 0;
+        s.min = s.max = 0;
+        s.mean = s.variance = 0;
+        s.histogram.assign(TexStatistics::BINS, 0);
+        s.refinedLo = s.refinedHi = 0;
+        s.refinedBelow = 0;
+        if (v.width == 0 || v.rows == 0) return s;
+
+        unsigned int parts = ParallelFor::Threads(threads);
+        if (parts > v.rows) parts = v.rows;
+        std::vector<Partial> partials(parts);
+        Sweep sweep = { v, parts, v.data[0], &partials[0] };
+        ParallelFor::Run(0, parts, sweep, parts);
+
+        double sum = 0, sumSq = 0;
+        s.min = std::numeric_limits<float>::max();
+        s.max = -std::numeric_limits<float>::max();
+        for (unsigned int p=0; p<parts; p++) {
+            const Partial& r = partials[p];
+            s.count += r.count;
+            sum += r.sum;
+            sumSq += r.sumSq;
+            if (r.min < s.min) s.min = r.min;
+            if (r.max > s.max) s.max = r.max;
+            for (unsigned int k=0; k<TexStatistics::BINS; k++)
+                s.histogram[k] += r.histogram[k];
+        }
+        double m = sum / s.count;
+        s.mean = sweep.shift + m;
+        s.variance = sumSq / s.count - m * m;
+        if (s.variance < 0) s.variance = 0;
+
+        // refine the coarse bins around the bulk of the data, the
+        // default Normalize percentiles are well inside
+        unsigned long below;
+        float lo, hi, unused;
+        s.Bounds(s.CoarseBin(0.001 * (s.count - 1), below), lo, unused);
+        s.Bounds(s.CoarseBin(0.999 * (s.count - 1), below), unused, hi);
+        if (!(hi > lo)) return s;
+        Refine refine = { v, parts, lo, hi, TexStatistics::BINS / (hi - lo), &partials[0] };
+        ParallelFor::Run(0, parts, refine, parts);
+        s.refinedLo = lo;
+        s.refinedHi = hi;
+        s.refined.assign(TexStatistics::BINS, 0);
+        for (unsigned int p=0; p<parts; p++) {
+            const Partial& r = partials[p];
+            s.refinedBelow += r.count;
+            for (unsigned int k=0; k<TexStatistics::BINS; k++)
+                s.refined[k] += r.histogram[k];
+        }
+        return s;
+    }
+
+    static void NormalizeView(const View& v, float bLimit, float uLimit,
+                          float low, float high, const ToneCurve* curve,
+                          unsigned int threads) {
+        TexStatistics s = Run(v, threads);
+        Apply(v, s.Percentile(low), s.Percentile(high), bLimit, uLimit,
+              curve, threads);
+    }
+
+    static void Apply(const View& v, float lo, float hi, float bLimit,
+                      float uLimit, const ToneCurve* curve,
+                      unsigned int threads) {
+        TEXUTILS_PROFILE_SCOPE("TexStats::Normalize", v.width * v.rows,
+                               v.width * v.rows * sizeof(float), -1);
+        Remap remap = { v, lo, hi > lo ? 1 / (hi - lo) : 0, bLimit,
+                        uLimit - bLimit, curve };
+        ParallelFor::Run(0, v.rows, remap, threads, 16);
+    }
+
+ public:
+    static TexStatistics Compute(FloatTexture2DPtr tex, unsigned int channel = 0,
+                                 unsigned int threads = 0) {
+        unsigned int w = tex->GetWidth(), c = tex->GetChannels();
+        return Run(Make(tex->GetData(), w, tex->GetHeight(), c, w * c, channel),
+                   threads);
+    }
+
+    static TexStatistics Compute3D(FloatTexture3DPtr tex, unsigned int channel = 0,
+                                   unsigned int threads = 0) {
+        unsigned int w = tex->GetWidth(), c = tex->GetChannels();
+        return Run(Make(tex->GetData(), w, tex->GetHeight() * tex->GetDepth(),
+                        c, w * c, channel), threads);
+    }
+
+    template <unsigned int D>
+    static TexStatistics Compute(Tex<float,D>& tex, unsigned int threads = 0) {
+        return Run(Make(tex.GetData(), tex.GetWidth(), tex.GetRows(), 1,
+                        tex.GetPitch(), 0), threads);
+    }
+
+    /**
+     * Scale the channel so the low and high percentiles map to
+     * bLimit and uLimit, values outside are clipped. An optional tone
+     * curve is applied to the clipped [0;1] value in the same sweep.
+     */
+    static void Normalize(FloatTexture2DPtr tex, float bLimit, float uLimit,
+                          float low = 0.01, float high = 0.99,
+                          const ToneCurve* curve = NULL,
+                          unsigned int channel = 0, unsigned int threads = 0) {
+        unsigned int w = tex->GetWidth(), c = tex->GetChannels();
+        NormalizeView(Make(tex->GetData(), w, tex->GetHeight(), c, w * c, channel),
+                  bLimit, uLimit, low, high, curve, threads);
+    }
+
+    static void Normalize3D(FloatTexture3DPtr tex, float bLimit, float uLimit,
+                            float low = 0.01, float high = 0.99,
+                            const ToneCurve* curve = NULL,
+                            unsigned int channel = 0, unsigned int threads = 0) {
+        unsigned int w = tex->GetWidth(), c = tex->GetChannels();
+        NormalizeView(Make(tex->GetData(), w, tex->GetHeight() * tex->GetDepth(),
+                       c, w * c, channel),
+                  bLimit, uLimit, low, high, curve, threads);
+    }
+
+    template <unsigned int D>
+    static void Normalize(Tex<float,D>& tex, float bLimit, float uLimit,
+                          float low = 0.01, float high = 0.99,
+                          const ToneCurve* curve = NULL,
+                          unsigned int threads = 0) {
+        NormalizeView(Make(tex.GetData(), tex.GetWidth(), tex.GetRows(), 1,
+                       tex.GetPitch(), 0),
+                  bLimit, uLimit, low, high, curve, threads);
+    }
+
+    /**
+     * Remap with statistics computed earlier, e.g. to normalize a
+     * sequence of frames by the range of the first.
+     */
+    static void Normalize(FloatTexture2DPtr tex, const TexStatistics& stats,
+                          float bLimit, float uLimit,
+                          float low = 0.01, float high = 0.99,
+                          const ToneCurve* curve = NULL,
+                          unsigned int channel = 0, unsigned int threads = 0) {
+        unsigned int w = tex->GetWidth(), c = tex->GetChannels();
+        Apply(Make(tex->GetData(), w, tex->GetHeight(), c, w * c, channel),
+              stats.Percentile(low), stats.Percentile(high),
+              bLimit, uLimit, curve, threads);
+    }
+
+    static void Normalize3D(FloatTexture3DPtr tex, const TexStatistics& stats,
+                            float bLimit, float uLimit,
+                            float low = 0.01, float high = 0.99,
+                            const ToneCurve* curve = NULL,
+                            unsigned int channel = 0, unsigned int threads = 0) {
+        unsigned int w = tex->GetWidth(), c = tex->GetChannels();
+        Apply(Make(tex->GetData(), w, tex->GetHeight() * tex->GetDepth(),
+                   c, w * c, channel),
+              stats.Percentile(low), stats.Percentile(high),
+              bLimit, uLimit, curve, threads);
+    }
+};
+
+} // NS Utils
+} // NS OpenEngine
+
+#endif // _TEX_STATS_
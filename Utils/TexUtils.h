@@ -10,10 +10,23 @@
 #ifndef _TEX_UTILS_
 #define _TEX_UTILS_
 
+#include <Core/Exceptions.h>
 #include <Logging/Logger.h>
 #include <Resources/Texture2D.h>
 #include <Resources/Texture3D.h>
+#include <Resources/BrickTexture3D.h>
+#include <Resources/MortonTexture3D.h>
+#include <Resources/TextureArena.h>
+#include <Utils/FFT.h>
+#include <Utils/ParallelFor.h>
+#include <Utils/TexProfiler.h>
+#include <cstring>
 #include <limits>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 typedef float REAL;
 
@@ -22,9 +35,14 @@ namespace OpenEngine {
 
         class TexUtils {
         public:
+            // halfsize from which Blur3D runs through FFT::Blur3D
+            static const int FFT_BLUR_HALFSIZE = 16;
+
             template <class T> static Texture2DPtr(T) Scale(Texture2DPtr(T) src, 
                                                             unsigned int width, 
                                                             unsigned int height) {
+                TEXUTILS_PROFILE_SCOPE("TexUtils::Scale", width * height,
+                                       width * height * src->GetChannels() * sizeof(T), -1);
                 src->Load();
 
                 Texture2D<T>* dst = new Texture2D<T>(width, height, src->GetColorFormat());
@@ -33,18 +51,11 @@ namespace OpenEngine {
                 dst->SetFiltering(src->GetFiltering());
                 dst->SetCompression(src->UseCompression());
                 dst->Load();
-                
-                for (unsigned int u = 0; u < width; ++u){
-                    for (unsigned int v = 0; v < height; ++v){
-                        float x = float(u) / float(width);
-                        float y = float(v) / float(height);
-                        T* pixel = dst->GetPixel(u,v);
-                        Vector<4, T> color = src->InterpolatedPixel(x,y);
-                        for (unsigned int c = 0; c < dst->GetChannels(); ++c){
-                            pixel[c] = color.Get(c);
-                        }
-                    }
-                }
+
+                unsigned int c = dst->GetChannels();
+                ScaleImage(src->GetData(), src->GetWidth(), src->GetHeight(),
+                           src->GetChannels(), dst->GetData(), width, height, c,
+                           width * c);
 
                 return Texture2DPtr(T)(dst);
             }
@@ -53,34 +64,10 @@ namespace OpenEngine {
                 unsigned int w = tex->GetWidth();
                 unsigned int h = tex->GetHeight();
                 unsigned int c = tex->GetChannels();
+                TEXUTILS_PROFILE_SCOPE("TexUtils::ToUCharTexture", w * h, w * h * c, -1);
                 UCharTexture2DPtr output(new UCharTexture2D(w,h,c));
-            
-                for (unsigned int ch=0; ch<c; ch++) {
-                    /*
-                      REAL min = numeric_limits<REAL>::max();
-                      REAL max = numeric_limits<REAL>::min();
-                      for (unsigned int x=0; x<w; x++) {
-                      for (unsigned int y=0; y<h; y++) {
-                      REAL v = *(tex->GetPixel(x,y) + ch);
-                      if (v<min) min = v;
-                      if (v>max) max = v;
-                      }
-                      }
-                      logger.info << "max: " << max << logger.end;
-                      logger.info << "min: " << min << logger.end;
-                    */
-                    for (unsigned int x=0; x<w; x++) {
-                        for (unsigned int y=0; y<h; y++) {
-                            /*
-                             *(output->GetPixel(x,y) + ch) =
-                             ((*(tex->GetPixel(x,y) + ch)-min)/max) * 255;
-                            */
-                            *(output->GetPixel(x,y) + ch) =
-			      (unsigned char)
-			      (*(tex->GetPixel(x,y) + ch) * 255);
-                        }
-                    }
-                }
+
+                ToUCharImage(tex->GetData(), w, h, c, output->GetData(), w * c);
                 return output;
             }
         
@@ -88,6 +75,8 @@ namespace OpenEngine {
                 unsigned int w = tex->GetWidth();
                 unsigned int h = tex->GetHeight();
                 unsigned int c = tex->GetChannels();
+                TEXUTILS_PROFILE_SCOPE("TexUtils::ToFloatTexture", w * h,
+                                       w * h * c * sizeof(T), -1);
                 Texture2DPtr(T) output(new Texture2D<T>(w,h,c));
             
                 for (unsigned int ch=0; ch<c; ch++) {
@@ -104,6 +93,7 @@ namespace OpenEngine {
             static void Threshold(FloatTexture2DPtr tex, REAL threshold) {
                 unsigned int w = tex->GetWidth();
                 unsigned int h = tex->GetHeight();
+                TEXUTILS_PROFILE_SCOPE("TexUtils::Threshold", w * h, 0, -1);
                 for (unsigned int x=0; x<w; x++) {
                     for (unsigned int y=0; y<h; y++) {
                         if(*(tex->GetPixel(x,y)) < threshold)
@@ -120,6 +110,7 @@ namespace OpenEngine {
 
                 unsigned int w = tex->GetWidth();
                 unsigned int h = tex->GetHeight();
+                TEXUTILS_PROFILE_SCOPE("TexUtils::CloudExpCurve", w * h, 0, -1);
                 for (unsigned int x=0; x<w; x++) {
                     for (unsigned int y=0; y<h; y++) {
                         /*
@@ -146,6 +137,7 @@ namespace OpenEngine {
                 unsigned int w = tex->GetWidth();
                 unsigned int h = tex->GetHeight();
                 unsigned int d = tex->GetDepth();
+                TEXUTILS_PROFILE_SCOPE("TexUtils::CloudExpCurve3D", w * h * d, 0, -1);
                 for (unsigned int x=0; x<w; x++) {
                     for (unsigned int y=0; y<h; y++) {
                         for (unsigned int z=0; z<d; z++) {
@@ -168,6 +160,8 @@ namespace OpenEngine {
             static FloatTexture2DPtr ToRGBAinAlphaChannel(FloatTexture2DPtr tex) {
                 unsigned int w = tex->GetWidth();
                 unsigned int h = tex->GetHeight();
+                TEXUTILS_PROFILE_SCOPE("TexUtils::ToRGBAinAlphaChannel", w * h,
+                                       w * h * 4 * sizeof(float), -1);
                 FloatTexture2DPtr output(new FloatTexture2D(w,h,4));
                 float* din = tex->GetData();
                 float* dout = output->GetData();
@@ -185,18 +179,10 @@ namespace OpenEngine {
             template <class T> static Texture2DPtr(T) ToRGBAfromLuminance(Texture2DPtr(T) tex) {
                 unsigned int w = tex->GetWidth();
                 unsigned int h = tex->GetHeight();
+                TEXUTILS_PROFILE_SCOPE("TexUtils::ToRGBAfromLuminance", w * h,
+                                       w * h * 4 * sizeof(T), -1);
                 Texture2DPtr(T) output(new Texture2D<T>(w,h,4));
-                T* din = tex->GetData();
-                T* dout = output->GetData();
-                T max = (typeid(T)==typeid(unsigned char)) ? 255 : 1;
-                for (unsigned int y=0; y<h; y++) {
-                    for (unsigned int x=0; x<w; x++) {
-                        dout[(x+y*w)*4+0] = din[(x+y*w)];
-                        dout[(x+y*w)*4+1] = din[(x+y*w)];
-                        dout[(x+y*w)*4+2] = din[(x+y*w)];
-                        dout[(x+y*w)*4+3] = max;
-                    }
-                }
+                LuminanceToRGBA(tex->GetData(), w, h, output->GetData(), w * 4);
                 return output;
             }
 
@@ -204,6 +190,8 @@ namespace OpenEngine {
                 unsigned int w = tex->GetWidth();
                 unsigned int h = tex->GetHeight();
                 unsigned int d = tex->GetDepth();
+                TEXUTILS_PROFILE_SCOPE("TexUtils::ToRGBAinAlphaChannel3D", w * h * d,
+                                       w * h * d * 4 * sizeof(float), -1);
                 FloatTexture3DPtr output(new FloatTexture3D(w,h,d,4));
                 float* din = tex->GetData();
                 float* dout = output->GetData();
@@ -224,32 +212,15 @@ namespace OpenEngine {
                 unsigned int w = tex->GetWidth();
                 unsigned int h = tex->GetHeight();
                 unsigned int channels = tex->GetChannels();
-                FloatTexture2DPtr tempXdir(new FloatTexture2D(w,h,channels));
-
-                for (unsigned int x = 0; x < w; ++x) {
-                    for (unsigned int y = 0; y < h; ++y) {
-                        float* pixel = tempXdir->GetPixel(x, y);
-                        for (unsigned char c = 0; c < channels; ++c) {
-                            pixel[c] = 0;
-                            for (int X = -halfsize; X <= halfsize; ++X) {
-                                pixel[c] += tex->GetPixel(x + X, y)[c];
-                            }
-                            pixel[c] /= (halfsize * 2 + 1);
-                        }
-                    }
-                }
-
-                for (unsigned int x = 0; x < w; ++x) {
-                    for (unsigned int y = 0; y < h; ++y) {
-                        float* pixel = tex->GetPixel(x, y);
-                        for (unsigned char c = 0; c < channels; ++c){
-                            pixel[c] = 0;
-                            for (int Y = -halfsize; Y <= halfsize; ++Y){
-                                pixel[c] += tempXdir->GetPixel(x, y + Y)[c];
-                            }
-                            pixel[c] /= (halfsize * 2 + 1);
-                        }
-                    }
+                TEXUTILS_PROFILE_SCOPE("TexUtils::Blur", w * h,
+                                       w * h * channels * sizeof(float), -1);
+                float* data = tex->GetData();
+                switch (channels) {
+                case 1: BlurChannels<1>(data, w, h, channels, halfsize); break;
+                case 2: BlurChannels<2>(data, w, h, channels, halfsize); break;
+                case 3: BlurChannels<3>(data, w, h, channels, halfsize); break;
+                case 4: BlurChannels<4>(data, w, h, channels, halfsize); break;
+                default: BlurChannels<0>(data, w, h, channels, halfsize); break;
                 }
 
                 /*        unsigned int w = tex->GetWidth();
@@ -282,56 +253,22 @@ namespace OpenEngine {
                 unsigned int h = tex->GetHeight();
                 unsigned int d = tex->GetDepth();
                 unsigned int channels = tex->GetChannels();
-                FloatTexture3DPtr tempXdir(new FloatTexture3D(w,h,d,channels));
-                FloatTexture3DPtr tempYdir(new FloatTexture3D(w,h,d,channels));
-
-                for (unsigned int i = 0; i < itr; ++i) {
-
-                    for (unsigned int x = 0; x < w; ++x) {
-                        for (unsigned int y = 0; y < h; ++y) {
-                            for (unsigned int z = 0; z < d; ++z) {
-                        
-                                float* pixel = tempXdir->GetVoxel(x, y, z);
-                                for (unsigned char c = 0; c < channels; ++c) {
-                                    pixel[c] = 0;
-                                    for (int X = -halfsize; X <= halfsize; ++X) {
-                                        pixel[c] += tex->GetVoxel(x + X, y, z)[c];
-                                    }
-                                    pixel[c] /= (halfsize * 2 + 1);
-                                }
-                            }
-                        }
-                    }
-            
-                    for (unsigned int x = 0; x < w; ++x) {
-                        for (unsigned int y = 0; y < h; ++y) {
-                            for (unsigned int z = 0; z < d; ++z) {
-                                float* pixel = tempYdir->GetVoxel(x, y, z);
-                                for (unsigned char c = 0; c < channels; ++c){
-                                    pixel[c] = 0;
-                                    for (int Y = -halfsize; Y <= halfsize; ++Y){
-                                        pixel[c] += tempXdir->GetVoxel(x, y + Y, z)[c];
-                                    }
-                                    pixel[c] /= (halfsize * 2 + 1);
-                                }
-                            }
-                        }
-                    }
-            
-                    for (unsigned int x = 0; x < w; ++x) {
-                        for (unsigned int y = 0; y < h; ++y) {
-                            for (unsigned int z = 0; z < d; ++z) {
-                                float* pixel = tex->GetVoxel(x, y, z);
-                                for (unsigned char c = 0; c < channels; ++c){
-                                    pixel[c] = 0;
-                                    for (int Z = -halfsize; Z <= halfsize; ++Z){
-                                        pixel[c] += tempYdir->GetVoxel(x, y, z+Z)[c];
-                                    }
-                                    pixel[c] /= (halfsize * 2 + 1);
-                                }
-                            }
-                        }
-                    }
+                TEXUTILS_PROFILE_SCOPE("TexUtils::Blur3D", w * h * d * itr,
+                                       2 * w * h * d * channels * sizeof(float), -1);
+                // large kernels are cheaper in the frequency domain,
+                // unless a size has a prime factor the FFT is slow at
+                if (halfsize >= FFT_BLUR_HALFSIZE && itr > 0 &&
+                    FFT::IsFastSize(w, h, d)) {
+                    FFT::Blur3D(tex, itr, halfsize);
+                    return;
+                }
+                float* data = tex->GetData();
+                switch (channels) {
+                case 1: Blur3DChannels<1>(data, w, h, d, channels, itr, halfsize); break;
+                case 2: Blur3DChannels<2>(data, w, h, d, channels, itr, halfsize); break;
+                case 3: Blur3DChannels<3>(data, w, h, d, channels, itr, halfsize); break;
+                case 4: Blur3DChannels<4>(data, w, h, d, channels, itr, halfsize); break;
+                default: Blur3DChannels<0>(data, w, h, d, channels, itr, halfsize); break;
                 }
                 /*
                   unsigned int w = tex->GetWidth();
@@ -388,6 +325,7 @@ namespace OpenEngine {
             static void Normalize(FloatTexture2DPtr tex, REAL bLimit, REAL uLimit) {
                 unsigned int w = tex->GetWidth();
                 unsigned int h = tex->GetHeight();
+                TEXUTILS_PROFILE_SCOPE("TexUtils::Normalize", w * h, 0, -1);
 
                 // find min and max value in tex
                 REAL min = std::numeric_limits<REAL>::max();
@@ -415,6 +353,7 @@ namespace OpenEngine {
                 const unsigned int w = tex->GetWidth();
                 const unsigned int h = tex->GetHeight();
                 const unsigned int d = tex->GetDepth();
+                TEXUTILS_PROFILE_SCOPE("TexUtils::Normalize3D", w * h * d, 0, -1);
 
                 // find min and max value in tex
                 REAL min = numeric_limits<REAL>::max();
@@ -454,6 +393,8 @@ namespace OpenEngine {
                 unsigned int h = tex->GetHeight();
                 unsigned int d = tex->GetDepth();
                 unsigned int c = tex->GetChannels();
+                TEXUTILS_PROFILE_SCOPE("TexUtils::GetNormalize3D", w * h * d,
+                                       w * h * d * c * sizeof(float), -1);
                 FloatTexture3DPtr output(new FloatTexture3D(w,h,d,c));
                 const float* din = tex->GetData();
                 float* dout = output->GetData();
@@ -476,6 +417,8 @@ namespace OpenEngine {
 
                 unsigned int w = max(l->GetWidth(),r->GetWidth());
                 unsigned int h = max(l->GetHeight(),r->GetHeight());
+                TEXUTILS_PROFILE_SCOPE("TexUtils::Combine", w * h,
+                                       w * h * sizeof(float), -1);
                 FloatTexture2DPtr output(new FloatTexture2D(w,h,1));
 
                 for (unsigned int x=0; x<w; x++) {
@@ -503,6 +446,8 @@ namespace OpenEngine {
                 unsigned int w = max(l->GetWidth(),r->GetWidth());
                 unsigned int h = max(l->GetHeight(),r->GetHeight());
                 unsigned int d = max(l->GetDepth(),r->GetDepth());
+                TEXUTILS_PROFILE_SCOPE("TexUtils::Combine3D", w * h * d,
+                                       w * h * d * sizeof(float), -1);
                 FloatTexture3DPtr output(new FloatTexture3D(w,h,d,1));
 
                 for (unsigned int x=0; x<w; x++) {
@@ -526,6 +471,1213 @@ namespace OpenEngine {
                 return output;
             }
 
+
+            /**
+             * Combine with wrap around bilinear interpolation. Each
+             * input is stretched over the whole output, so periodic
+             * inputs give a periodic output without seams.
+             */
+            static FloatTexture2DPtr CombinePeriodic(FloatTexture2DPtr l,
+                                                     FloatTexture2DPtr r,
+                                                     int multiplier = 1) {
+                unsigned int w = max(l->GetWidth(),r->GetWidth());
+                unsigned int h = max(l->GetHeight(),r->GetHeight());
+                TEXUTILS_PROFILE_SCOPE("TexUtils::CombinePeriodic", w * h,
+                                       w * h * sizeof(float), -1);
+                FloatTexture2DPtr output(new FloatTexture2D(w,h,1));
+                float* dout = output->GetData();
+                for (unsigned int y=0; y<h; y++) {
+                    for (unsigned int x=0; x<w; x++) {
+                        REAL lValue = PeriodicSample(l, x, y, w, h);
+                        REAL rValue = multiplier * PeriodicSample(r, x, y, w, h);
+                        dout[x+y*w] = lValue + rValue;
+                    }
+                }
+                return output;
+            }
+
+            static FloatTexture3DPtr CombinePeriodic3D(FloatTexture3DPtr l,
+                                                       FloatTexture3DPtr r,
+                                                       int multiplier = 1) {
+                unsigned int w = max(l->GetWidth(),r->GetWidth());
+                unsigned int h = max(l->GetHeight(),r->GetHeight());
+                unsigned int d = max(l->GetDepth(),r->GetDepth());
+                TEXUTILS_PROFILE_SCOPE("TexUtils::CombinePeriodic3D", w * h * d,
+                                       w * h * d * sizeof(float), -1);
+                FloatTexture3DPtr output(new FloatTexture3D(w,h,d,1));
+                float* dout = output->GetData();
+                for (unsigned int z=0; z<d; z++) {
+                    for (unsigned int y=0; y<h; y++) {
+                        for (unsigned int x=0; x<w; x++) {
+                            REAL lValue = PeriodicSample(l, x, y, z, w, h, d);
+                            REAL rValue = multiplier *
+                                PeriodicSample(r, x, y, z, w, h, d);
+                            dout[x+(y+z*h)*w] = lValue + rValue;
+                        }
+                    }
+                }
+                return output;
+            }
+
+            // Batched variants for many small textures. Each call
+            // runs the whole batch as one parallel job over the
+            // textures. Results are appended to an arena, or written
+            // into the given rectangles of an atlas texture with the
+            // same number of channels.
+
+            template <class T> static void Scale(const std::vector<Texture2DPtr(T)>& src,
+                                                 unsigned int width, unsigned int height,
+                                                 TextureArena<T>& out,
+                                                 unsigned int threads = 0) {
+                if (src.empty()) return;
+                std::vector<BatchJob<T,T> > jobs = BatchSources(src);
+                unsigned long size = 0;
+                for (unsigned int i=0; i<jobs.size(); i++)
+                    size += (unsigned long)width * height * jobs[i].sc;
+                TEXUTILS_PROFILE_SCOPE("TexUtils::ScaleBatch",
+                                       width * height * jobs.size(), size * sizeof(T), -1);
+                unsigned int first = ArenaTargets(jobs, out, size, width, height, false);
+                for (unsigned int i=0; i<jobs.size(); i++)
+                    jobs[i].dst = out.GetData(first + i);
+                ScaleBatch<T> batch = { &jobs[0] };
+                ParallelFor::Run(0, jobs.size(), batch, threads, BATCH_GRAIN);
+            }
+
+            /**
+             * Scale every texture to the size of its rectangle in the
+             * atlas.
+             */
+            template <class T> static void Scale(const std::vector<Texture2DPtr(T)>& src,
+                                                 Texture2DPtr(T) atlas,
+                                                 const std::vector<TextureRect>& rects,
+                                                 unsigned int threads = 0) {
+                if (src.empty()) return;
+                std::vector<BatchJob<T,T> > jobs = BatchSources(src);
+                AtlasTargets(jobs, atlas, rects, false, true);
+                TEXUTILS_PROFILE_SCOPE("TexUtils::ScaleBatch", BatchTexels(jobs),
+                                       BatchTexels(jobs) * atlas->GetChannels() * sizeof(T), -1);
+                ScaleBatch<T> batch = { &jobs[0] };
+                ParallelFor::Run(0, jobs.size(), batch, threads, BATCH_GRAIN);
+            }
+
+            template <class T> static void ToUCharTexture(const std::vector<Texture2DPtr(T)>& src,
+                                                          UCharTextureArena& out,
+                                                          unsigned int threads = 0) {
+                if (src.empty()) return;
+                std::vector<BatchJob<T,unsigned char> > jobs = BatchSources<T,unsigned char>(src);
+                unsigned long size = 0;
+                for (unsigned int i=0; i<jobs.size(); i++)
+                    size += (unsigned long)jobs[i].sw * jobs[i].sh * jobs[i].sc;
+                TEXUTILS_PROFILE_SCOPE("TexUtils::ToUCharTextureBatch", BatchTexels(jobs),
+                                       size, -1);
+                unsigned int first = ArenaTargets(jobs, out, size, 0, 0, false);
+                for (unsigned int i=0; i<jobs.size(); i++)
+                    jobs[i].dst = out.GetData(first + i);
+                ToUCharBatch<T> batch = { &jobs[0] };
+                ParallelFor::Run(0, jobs.size(), batch, threads, BATCH_GRAIN);
+            }
+
+            template <class T> static void ToUCharTexture(const std::vector<Texture2DPtr(T)>& src,
+                                                          UCharTexture2DPtr atlas,
+                                                          const std::vector<TextureRect>& rects,
+                                                          unsigned int threads = 0) {
+                if (src.empty()) return;
+                std::vector<BatchJob<T,unsigned char> > jobs = BatchSources<T,unsigned char>(src);
+                AtlasTargets(jobs, atlas, rects, false, false);
+                TEXUTILS_PROFILE_SCOPE("TexUtils::ToUCharTextureBatch", BatchTexels(jobs),
+                                       BatchTexels(jobs) * atlas->GetChannels(), -1);
+                ToUCharBatch<T> batch = { &jobs[0] };
+                ParallelFor::Run(0, jobs.size(), batch, threads, BATCH_GRAIN);
+            }
+
+            template <class T> static void ToRGBAfromLuminance(const std::vector<Texture2DPtr(T)>& src,
+                                                               TextureArena<T>& out,
+                                                               unsigned int threads = 0) {
+                if (src.empty()) return;
+                std::vector<BatchJob<T,T> > jobs = BatchSources(src);
+                unsigned long size = BatchTexels(jobs) * 4;
+                TEXUTILS_PROFILE_SCOPE("TexUtils::ToRGBAfromLuminanceBatch",
+                                       BatchTexels(jobs), size * sizeof(T), -1);
+                unsigned int first = ArenaTargets(jobs, out, size, 0, 0, true);
+                for (unsigned int i=0; i<jobs.size(); i++)
+                    jobs[i].dst = out.GetData(first + i);
+                LuminanceBatch<T> batch = { &jobs[0] };
+                ParallelFor::Run(0, jobs.size(), batch, threads, BATCH_GRAIN);
+            }
+
+            template <class T> static void ToRGBAfromLuminance(const std::vector<Texture2DPtr(T)>& src,
+                                                               Texture2DPtr(T) atlas,
+                                                               const std::vector<TextureRect>& rects,
+                                                               unsigned int threads = 0) {
+                if (src.empty()) return;
+                if (atlas->GetChannels() != 4)
+                    throw Core::Exception("ToRGBAfromLuminance: atlas is not RGBA");
+                std::vector<BatchJob<T,T> > jobs = BatchSources(src);
+                AtlasTargets(jobs, atlas, rects, true, false);
+                TEXUTILS_PROFILE_SCOPE("TexUtils::ToRGBAfromLuminanceBatch",
+                                       BatchTexels(jobs), BatchTexels(jobs) * 4 * sizeof(T), -1);
+                LuminanceBatch<T> batch = { &jobs[0] };
+                ParallelFor::Run(0, jobs.size(), batch, threads, BATCH_GRAIN);
+            }
+
+            // 8-bit variants working on the bytes directly, without
+            // the ToFloatTexture and ToUCharTexture round trip. Sums
+            // are exact in integer accumulators and truncated like
+            // ToUCharTexture truncates, so results match the float
+            // versions except where float rounding puts a blurred
+            // value just below an integer.
+
+            // one pass like the float Blur, which ignores the count too
+            static void Blur(UCharTexture2DPtr tex, unsigned int /*itr*/, int halfsize = 1) {
+                unsigned int w = tex->GetWidth();
+                unsigned int h = tex->GetHeight();
+                unsigned int channels = tex->GetChannels();
+                TEXUTILS_PROFILE_SCOPE("TexUtils::Blur", w * h, w * h * channels, -1);
+                const unsigned int taps = halfsize * 2 + 1;
+                // 16 bit sums hold up to 255 * taps * taps
+                if (taps * taps * 255 <= 0xFFFF)
+                    BlurBytes<unsigned short>(tex->GetData(), w, h, channels, halfsize);
+                else
+                    BlurBytes<unsigned int>(tex->GetData(), w, h, channels, halfsize);
+            }
+
+            static void Threshold(UCharTexture2DPtr tex, REAL threshold) {
+                unsigned int w = tex->GetWidth();
+                unsigned int h = tex->GetHeight();
+                TEXUTILS_PROFILE_SCOPE("TexUtils::Threshold", w * h, 0, -1);
+                // smallest byte the float path keeps
+                unsigned int cut = 0;
+                while (cut < 256 && (float)(cut / 255.0) < threshold)
+                    cut++;
+                ThresholdBytes(tex->GetData(), w * h, tex->GetChannels(), cut);
+            }
+
+            /**
+             * Map every channel through a curve on [0;1], evaluated
+             * once per byte value.
+             */
+            static void Curve(UCharTexture2DPtr tex, REAL (*curve)(REAL)) {
+                unsigned int w = tex->GetWidth();
+                unsigned int h = tex->GetHeight();
+                unsigned int c = tex->GetChannels();
+                TEXUTILS_PROFILE_SCOPE("TexUtils::Curve", w * h, 0, -1);
+                unsigned char lut[256];
+                CurveTable(curve, lut);
+                MapBytes(tex->GetData(), w * h * c, 1, lut);
+            }
+
+            static void CloudExpCurve(UCharTexture2DPtr tex) {
+                unsigned int w = tex->GetWidth();
+                unsigned int h = tex->GetHeight();
+                TEXUTILS_PROFILE_SCOPE("TexUtils::CloudExpCurve", w * h, 0, -1);
+                unsigned char lut[256];
+                CurveTable(CloudExp, lut);
+                MapBytes(tex->GetData(), w * h, tex->GetChannels(), lut);
+            }
+
+            /**
+             * Sum of the first channels, saturated to [0;255]. Inputs
+             * of another size are stretched over the output with wrap
+             * around bilinear interpolation.
+             */
+            static UCharTexture2DPtr Combine(UCharTexture2DPtr l,
+                                             UCharTexture2DPtr r,
+                                             int multiplier = 1) {
+                unsigned int w = max(l->GetWidth(),r->GetWidth());
+                unsigned int h = max(l->GetHeight(),r->GetHeight());
+                TEXUTILS_PROFILE_SCOPE("TexUtils::Combine", w * h, w * h, -1);
+                UCharTexture2DPtr output(new UCharTexture2D(w,h,1));
+                std::vector<unsigned char> lt, rt;
+                const unsigned char* ld = FirstChannel(l, w, h, lt);
+                const unsigned char* rd = FirstChannel(r, w, h, rt);
+                CombineBytes(ld, rd, multiplier, output->GetData(), w * h);
+                return output;
+            }
+
+            // Sparse brick volume variants. Only occupied bricks and
+            // bricks next to them are processed, empty bricks are
+            // represented by the background value.
+
+            /**
+             * CloudExpCurve3D producing a brick volume directly, only
+             * bricks with a non zero density are allocated.
+             */
+            static FloatBrickTexture3DPtr SparseCloudExpCurve3D(FloatTexture3DPtr tex) {
+                const unsigned int B = FloatBrickTexture3D::BRICK;
+                unsigned int w = tex->GetWidth();
+                unsigned int h = tex->GetHeight();
+                unsigned int d = tex->GetDepth();
+                TEXUTILS_PROFILE_SCOPE("TexUtils::SparseCloudExpCurve3D", w * h * d, 0, -1);
+                FloatBrickTexture3DPtr out(new FloatBrickTexture3D(w,h,d,1));
+                std::vector<float> brick(FloatBrickTexture3D::BRICK_VOXELS);
+                for (unsigned int bz=0; bz<out->GetBricksZ(); bz++)
+                    for (unsigned int by=0; by<out->GetBricksY(); by++)
+                        for (unsigned int bx=0; bx<out->GetBricksX(); bx++) {
+                            bool empty = true;
+                            std::fill(brick.begin(), brick.end(), 0.0f);
+                            for (unsigned int z=bz*B; z<std::min(d,(bz+1)*B); z++)
+                                for (unsigned int y=by*B; y<std::min(h,(by+1)*B); y++)
+                                    for (unsigned int x=bx*B; x<std::min(w,(bx+1)*B); x++) {
+                                        REAL v = CloudExp(*(tex->GetVoxel(x,y,z)));
+                                        brick[(x%B)+((y%B)+(z%B)*B)*B] = v;
+                                        if (v != 0) empty = false;
+                                    }
+                            if (!empty)
+                                std::copy(brick.begin(), brick.end(),
+                                          out->Allocate(bx,by,bz));
+                        }
+                return out;
+            }
+
+            static void CloudExpCurve3D(FloatBrickTexture3DPtr tex) {
+                TEXUTILS_PROFILE_SCOPE("TexUtils::CloudExpCurve3D(bricks)",
+                                       tex->GetOccupiedBricks()
+                                       * FloatBrickTexture3D::BRICK_VOXELS, 0, -1);
+                MapBricks(tex, &CloudExp);
+                tex->Compact();
+            }
+
+            static void Normalize3D(FloatBrickTexture3DPtr tex, REAL bLimit, REAL uLimit) {
+                TEXUTILS_PROFILE_SCOPE("TexUtils::Normalize3D(bricks)",
+                                       tex->GetOccupiedBricks()
+                                       * FloatBrickTexture3D::BRICK_VOXELS, 0, -1);
+                const unsigned int B = FloatBrickTexture3D::BRICK;
+                const unsigned int c = tex->GetChannels();
+
+                // find min and max value, the background counts if any
+                // brick is empty
+                REAL min = numeric_limits<REAL>::max();
+                REAL max = numeric_limits<REAL>::min();
+                unsigned int bricks = tex->GetBricksX() * tex->GetBricksY() * tex->GetBricksZ();
+                if (tex->GetOccupiedBricks() < bricks) {
+                    min = max = tex->GetBackground()[0];
+                }
+                for (unsigned int bz=0; bz<tex->GetBricksZ(); bz++)
+                    for (unsigned int by=0; by<tex->GetBricksY(); by++)
+                        for (unsigned int bx=0; bx<tex->GetBricksX(); bx++) {
+                            const float* brick = tex->GetBrick(bx,by,bz);
+                            if (!brick) continue;
+                            unsigned int nx = std::min(B, tex->GetWidth()-bx*B);
+                            unsigned int ny = std::min(B, tex->GetHeight()-by*B);
+                            unsigned int nz = std::min(B, tex->GetDepth()-bz*B);
+                            for (unsigned int z=0; z<nz; z++)
+                                for (unsigned int y=0; y<ny; y++)
+                                    for (unsigned int x=0; x<nx; x++) {
+                                        REAL v = brick[(x+(y+z*B)*B)*c];
+                                        if (v<min) min = v;
+                                        if (v>max) max = v;
+                                    }
+                        }
+
+                // normalize each voxel and the background
+                for (unsigned int i=0; i<bricks; i++) {
+                    float* brick = tex->GetBrick(i % tex->GetBricksX(),
+                                                 (i / tex->GetBricksX()) % tex->GetBricksY(),
+                                                 i / (tex->GetBricksX() * tex->GetBricksY()));
+                    if (!brick) continue;
+                    for (unsigned int v=0; v<FloatBrickTexture3D::BRICK_VOXELS; v++) {
+                        REAL value = (brick[v*c]-min)/max;
+                        brick[v*c] = (value * (uLimit-bLimit)) + bLimit;
+                    }
+                }
+                REAL value = (tex->GetBackground()[0]-min)/max;
+                tex->SetBackground(0, (value * (uLimit-bLimit)) + bLimit);
+            }
+
+            /**
+             * Box blur of a brick volume in place. Bricks the kernel
+             * reaches from an occupied brick are allocated, bricks
+             * left at the background afterwards are freed again.
+             */
+            static void Blur3D(FloatBrickTexture3DPtr tex,
+                               unsigned int itr, int halfsize = 1) {
+                TEXUTILS_PROFILE_SCOPE("TexUtils::Blur3D(bricks)",
+                                       tex->GetOccupiedBricks()
+                                       * FloatBrickTexture3D::BRICK_VOXELS * itr,
+                                       0, -1);
+                for (unsigned int i = 0; i < itr; ++i) {
+                    for (unsigned int axis = 0; axis < 3; ++axis) {
+                        BlurBricks(tex, axis, halfsize);
+                    }
+                }
+                tex->Compact();
+            }
+
+            /**
+             * ToRGBAinAlphaChannel3D on a brick volume, only occupied
+             * bricks are expanded.
+             */
+            static FloatBrickTexture3DPtr ToRGBAinAlphaChannel3D(FloatBrickTexture3DPtr tex) {
+                TEXUTILS_PROFILE_SCOPE("TexUtils::ToRGBAinAlphaChannel3D(bricks)",
+                                       tex->GetOccupiedBricks()
+                                       * FloatBrickTexture3D::BRICK_VOXELS,
+                                       tex->GetOccupiedBricks()
+                                       * FloatBrickTexture3D::BRICK_VOXELS * 4 * sizeof(float),
+                                       -1);
+                FloatBrickTexture3DPtr output
+                    (new FloatBrickTexture3D(tex->GetWidth(), tex->GetHeight(),
+                                             tex->GetDepth(), 4, 1.0f));
+                output->SetBackground(3, tex->GetBackground()[0]);
+                for (unsigned int bz=0; bz<tex->GetBricksZ(); bz++)
+                    for (unsigned int by=0; by<tex->GetBricksY(); by++)
+                        for (unsigned int bx=0; bx<tex->GetBricksX(); bx++) {
+                            const float* din = tex->GetBrick(bx,by,bz);
+                            if (!din) continue;
+                            float* dout = output->Allocate(bx,by,bz);
+                            for (unsigned int v=0; v<FloatBrickTexture3D::BRICK_VOXELS; v++)
+                                dout[v*4+3] = din[v*tex->GetChannels()];
+                        }
+                return output;
+            }
+
+            // Tiled Morton order variants. Each tile is processed with
+            // its halo gathered into a small local buffer, so the z
+            // neighbours are in cache instead of a slice away.
+
+            static void CloudExpCurve3D(FloatMortonTexture3DPtr tex) {
+                TEXUTILS_PROFILE_SCOPE("TexUtils::CloudExpCurve3D(morton)",
+                                       tex->GetSize(), 0, -1);
+                // padding voxels are never read, so the order is irrelevant
+                float* data = tex->GetData();
+                for (unsigned int i=0; i<tex->GetSize(); i++)
+                    data[i] = CloudExp(data[i]);
+            }
+
+            static void Normalize3D(FloatMortonTexture3DPtr tex, REAL bLimit, REAL uLimit) {
+                const unsigned int w = tex->GetWidth();
+                const unsigned int h = tex->GetHeight();
+                const unsigned int d = tex->GetDepth();
+                const unsigned int c = tex->GetChannels();
+                TEXUTILS_PROFILE_SCOPE("TexUtils::Normalize3D(morton)", w * h * d, 0, -1);
+                float* data = tex->GetData();
+
+                // find min and max value in tex, in storage order
+                REAL min = numeric_limits<REAL>::max();
+                REAL max = numeric_limits<REAL>::min();
+                for (unsigned int z=0; z<d; z++) {
+                    for (unsigned int y=0; y<h; y++) {
+                        for (unsigned int x=0; x<w; x++) {
+                            REAL v = data[tex->Index(x,y,z)*c];
+                            if (v<min) min = v;
+                            if (v>max) max = v;
+                        }
+                    }
+                }
+
+                // normalize each voxel, padding included
+                for (unsigned int i=0; i<tex->GetSize(); i+=c) {
+                    REAL value = (data[i]-min)/max;
+                    data[i] = (value * (uLimit-bLimit)) + bLimit;
+                }
+            }
+
+            /**
+             * Box blur of a Morton volume, one running sum pass per
+             * axis. Each line of tiles along the axis is copied out
+             * whole, a tile is contiguous, and the result is written
+             * back in place. Large kernels on fast transform sizes go
+             * through FFT::Blur3D on a linear copy.
+             */
+            static void Blur3D(FloatMortonTexture3DPtr tex,
+                               unsigned int itr, int halfsize = 1) {
+                const unsigned int w = tex->GetWidth();
+                const unsigned int h = tex->GetHeight();
+                const unsigned int d = tex->GetDepth();
+                TEXUTILS_PROFILE_SCOPE("TexUtils::Blur3D(morton)", w * h * d * itr,
+                                       2 * tex->GetSize() * itr * 3 * sizeof(float), -1);
+                if (halfsize >= FFT_BLUR_HALFSIZE && itr > 0 &&
+                    FFT::IsFastSize(w, h, d)) {
+                    FloatTexture3DPtr linear = tex->ToLinear();
+                    FFT::Blur3D(linear, itr, halfsize);
+                    FloatMortonTexture3DPtr tiled = FloatMortonTexture3D::FromLinear(linear);
+                    std::copy(tiled->GetData(), tiled->GetData() + tiled->GetSize(),
+                              tex->GetData());
+                    return;
+                }
+                for (unsigned int i = 0; i < itr; ++i)
+                    for (unsigned int axis = 0; axis < 3; ++axis)
+                        BlurTiles(tex, axis, halfsize);
+            }
+
+            static FloatMortonTexture3DPtr Combine3D(FloatMortonTexture3DPtr l,
+                                                     FloatMortonTexture3DPtr r,
+                                                     int multiplier = 1) {
+                const unsigned int T = FloatMortonTexture3D::TILE;
+                unsigned int w = max(l->GetWidth(),r->GetWidth());
+                unsigned int h = max(l->GetHeight(),r->GetHeight());
+                unsigned int d = max(l->GetDepth(),r->GetDepth());
+                TEXUTILS_PROFILE_SCOPE("TexUtils::Combine3D(morton)", w * h * d,
+                                       ((w+T-1)/T) * ((h+T-1)/T) * ((d+T-1)/T)
+                                       * FloatMortonTexture3D::TILE_VOXELS * sizeof(float), -1);
+                FloatMortonTexture3DPtr output(new FloatMortonTexture3D(w,h,d,1));
+
+                // walk the output tile by tile so the lookups into both
+                // inputs stay local
+                for (unsigned int k=0; k<output->GetTilesZ(); k++)
+                for (unsigned int j=0; j<output->GetTilesY(); j++)
+                for (unsigned int t=0; t<output->GetTilesX(); t++)
+                for (unsigned int z=k*T; z<std::min(d,(k+1)*T); z++) {
+                    for (unsigned int y=j*T; y<std::min(h,(j+1)*T); y++) {
+                        for (unsigned int x=t*T; x<std::min(w,(t+1)*T); x++) {
+                            REAL xCoord = (REAL)x / (REAL)w;
+                            REAL yCoord = (REAL)y / (REAL)h;
+                            REAL zCoord = (REAL)z / (REAL)d;
+
+                            REAL lValue =
+                                l->InterpolatedVoxel(xCoord,yCoord,zCoord)[0];
+
+                            REAL rValue = multiplier *
+                                r->InterpolatedVoxel(xCoord,yCoord,zCoord)[0];
+
+                            *(output->GetVoxel(x,y,z)) = lValue + rValue;
+                        }
+                    }
+                }
+                return output;
+            }
+
+        private:
+            // smallest number of textures handed to a batch thread
+            static const unsigned int BATCH_GRAIN = 16;
+
+            // one texture of a batch, dst rows are pitch elements apart
+            template <class S, class D> struct BatchJob {
+                const S* src;
+                unsigned int sw, sh, sc;
+                D* dst;
+                unsigned int w, h, dc, pitch;
+            };
+
+            template <class T> struct ScaleBatch {
+                const BatchJob<T,T>* jobs;
+                void operator()(unsigned int from, unsigned int to) {
+                    for (unsigned int i=from; i<to; i++) {
+                        const BatchJob<T,T>& j = jobs[i];
+                        ScaleImage(j.src, j.sw, j.sh, j.sc, j.dst, j.w, j.h, j.dc, j.pitch);
+                    }
+                }
+            };
+
+            template <class T> struct ToUCharBatch {
+                const BatchJob<T,unsigned char>* jobs;
+                void operator()(unsigned int from, unsigned int to) {
+                    for (unsigned int i=from; i<to; i++) {
+                        const BatchJob<T,unsigned char>& j = jobs[i];
+                        ToUCharImage(j.src, j.w, j.h, j.dc, j.dst, j.pitch);
+                    }
+                }
+            };
+
+            template <class T> struct LuminanceBatch {
+                const BatchJob<T,T>* jobs;
+                void operator()(unsigned int from, unsigned int to) {
+                    for (unsigned int i=from; i<to; i++) {
+                        const BatchJob<T,T>& j = jobs[i];
+                        LuminanceToRGBA(j.src, j.w, j.h, j.dst, j.pitch);
+                    }
+                }
+            };
+
+            // loads the sources once and fills in the source fields
+            template <class S, class D>
+            static std::vector<BatchJob<S,D> > BatchSources(const std::vector<Texture2DPtr(S)>& src) {
+                std::vector<BatchJob<S,D> > jobs(src.size());
+                for (unsigned int i=0; i<src.size(); i++) {
+                    src[i]->Load();
+                    BatchJob<S,D>& j = jobs[i];
+                    j.src = src[i]->GetData();
+                    j.sw = j.w = src[i]->GetWidth();
+                    j.sh = j.h = src[i]->GetHeight();
+                    j.sc = j.dc = src[i]->GetChannels();
+                    j.dst = NULL;
+                    j.pitch = 0;
+                }
+                return jobs;
+            }
+
+            template <class T>
+            static std::vector<BatchJob<T,T> > BatchSources(const std::vector<Texture2DPtr(T)>& src) {
+                return BatchSources<T,T>(src);
+            }
+
+            template <class S, class D>
+            static unsigned long BatchTexels(const std::vector<BatchJob<S,D> >& jobs) {
+                unsigned long n = 0;
+                for (unsigned int i=0; i<jobs.size(); i++)
+                    n += (unsigned long)jobs[i].w * jobs[i].h;
+                return n;
+            }
+
+            /**
+             * Adds an arena entry per job, a zero width keeps the
+             * source size. Destination pointers are set by the caller
+             * once the arena has stopped growing.
+             *
+             * @return arena index of the first job
+             */
+            template <class S, class D>
+            static unsigned int ArenaTargets(std::vector<BatchJob<S,D> >& jobs,
+                                             TextureArena<D>& out, unsigned long size,
+                                             unsigned int width, unsigned int height,
+                                             bool rgba) {
+                out.Reserve(out.GetSize() + size);
+                unsigned int first = out.GetCount();
+                for (unsigned int i=0; i<jobs.size(); i++) {
+                    BatchJob<S,D>& j = jobs[i];
+                    if (width) { j.w = width; j.h = height; }
+                    if (rgba) j.dc = 4;
+                    j.pitch = j.w * j.dc;
+                    out.Add(j.w, j.h, j.dc);
+                }
+                return first;
+            }
+
+            template <class S, class D>
+            static void AtlasTargets(std::vector<BatchJob<S,D> >& jobs,
+                                     boost::shared_ptr<Texture2D<D> > atlas,
+                                     const std::vector<TextureRect>& rects,
+                                     bool rgba, bool resize) {
+                if (rects.size() != jobs.size())
+                    throw Core::Exception("atlas batch: one rectangle per texture");
+                unsigned int aw = atlas->GetWidth(), ah = atlas->GetHeight();
+                unsigned int ac = atlas->GetChannels();
+                D* adata = atlas->GetData();
+                for (unsigned int i=0; i<jobs.size(); i++) {
+                    BatchJob<S,D>& j = jobs[i];
+                    const TextureRect& r = rects[i];
+                    if (!resize && (r.width != j.sw || r.height != j.sh))
+                        throw Core::Exception("atlas batch: rectangle size differs from texture");
+                    if (r.x + r.width > aw || r.y + r.height > ah)
+                        throw Core::Exception("atlas batch: rectangle outside atlas");
+                    if (!rgba && j.sc != ac)
+                        throw Core::Exception("atlas batch: channel count differs from atlas");
+                    j.w = r.width;
+                    j.h = r.height;
+                    j.dc = ac;
+                    j.pitch = aw * ac;
+                    j.dst = adata + (r.y * aw + r.x) * ac;
+                }
+            }
+
+            template <class T>
+            static void ScaleImage(const T* src, unsigned int sw, unsigned int sh,
+                                   unsigned int sc, T* dst, unsigned int w,
+                                   unsigned int h, unsigned int c, unsigned int pitch) {
+                switch (sc == c ? c : 0) {
+                case 1: ScaleChannels<1>(src, sw, sh, sc, dst, w, h, c, pitch); break;
+                case 2: ScaleChannels<2>(src, sw, sh, sc, dst, w, h, c, pitch); break;
+                case 3: ScaleChannels<3>(src, sw, sh, sc, dst, w, h, c, pitch); break;
+                case 4: ScaleChannels<4>(src, sw, sh, sc, dst, w, h, c, pitch); break;
+                default: ScaleChannels<0>(src, sw, sh, sc, dst, w, h, c, pitch); break;
+                }
+            }
+
+            template <class T>
+            static void ToUCharImage(const T* src, unsigned int w, unsigned int h,
+                                     unsigned int c, unsigned char* dst, unsigned int pitch) {
+                // tightly packed output converts as one run
+                unsigned int rows = pitch == w * c ? 1 : h;
+                unsigned int run = pitch == w * c ? w * h : w;
+                for (unsigned int y=0; y<rows; y++) {
+                    const T* in = src + y * w * c;
+                    unsigned char* out = dst + y * pitch;
+                    switch (c) {
+                    case 1: ToUCharChannels<1>(in, out, run, c); break;
+                    case 2: ToUCharChannels<2>(in, out, run, c); break;
+                    case 3: ToUCharChannels<3>(in, out, run, c); break;
+                    case 4: ToUCharChannels<4>(in, out, run, c); break;
+                    default: ToUCharChannels<0>(in, out, run, c); break;
+                    }
+                }
+            }
+
+            template <class T>
+            static void LuminanceToRGBA(const T* din, unsigned int w, unsigned int h,
+                                        T* dout, unsigned int pitch) {
+                T max = (typeid(T)==typeid(unsigned char)) ? 255 : 1;
+                for (unsigned int y=0; y<h; y++) {
+                    T* row = dout + y * pitch;
+                    for (unsigned int x=0; x<w; x++) {
+                        row[x*4+0] = din[(x+y*w)];
+                        row[x*4+1] = din[(x+y*w)];
+                        row[x*4+2] = din[(x+y*w)];
+                        row[x*4+3] = max;
+                    }
+                }
+            }
+
+            // Channel count specialized kernels. C is the number of
+            // channels, or 0 for any count given at runtime, so the
+            // channel loops unroll for the common 1 to 4 channels.
+
+            template <unsigned int C, class T>
+            static void ScaleChannels(const T* src, unsigned int sw, unsigned int sh,
+                                      unsigned int srcChannels,
+                                      T* dst, unsigned int w, unsigned int h,
+                                      unsigned int channels, unsigned int pitch) {
+                // channels missing in the source are left at zero
+                const unsigned int nc = C ? C : channels;
+                const unsigned int sc = C ? C : srcChannels;
+                const unsigned int n = nc < sc ? nc : sc;
+                std::vector<unsigned int> x0(w), x1(w);
+                std::vector<REAL> tx(w);
+                for (unsigned int x=0; x<w; x++)
+                    EdgeWeights(x, w, sw, x0[x], x1[x], tx[x]);
+                for (unsigned int y=0; y<h; y++) {
+                    unsigned int y0, y1;
+                    REAL ty;
+                    EdgeWeights(y, h, sh, y0, y1, ty);
+                    const T* r0 = src + y0*sw*sc;
+                    const T* r1 = src + y1*sw*sc;
+                    T* out = dst + y*pitch;
+                    for (unsigned int x=0; x<w; x++) {
+                        const T* a0 = r0 + x0[x]*sc; const T* a1 = r0 + x1[x]*sc;
+                        const T* b0 = r1 + x0[x]*sc; const T* b1 = r1 + x1[x]*sc;
+                        for (unsigned int ch=0; ch<n; ch++) {
+                            REAL a = a0[ch] + (a1[ch] - a0[ch]) * tx[x];
+                            REAL b = b0[ch] + (b1[ch] - b0[ch]) * tx[x];
+                            out[x*nc+ch] = (T)(a + (b - a) * ty);
+                        }
+                        for (unsigned int ch=n; ch<nc; ch++)
+                            out[x*nc+ch] = 0;
+                    }
+                }
+            }
+
+            template <unsigned int C, class T>
+            static void ToUCharChannels(const T* in, unsigned char* out,
+                                        unsigned int pixels, unsigned int channels) {
+                const unsigned int nc = C ? C : channels;
+                for (unsigned int i=0; i<pixels; i++)
+                    for (unsigned int ch=0; ch<nc; ch++)
+                        out[i*nc+ch] = (unsigned char)(in[i*nc+ch] * 255);
+            }
+
+            // wrapped indices of i-halfsize for i in [0;n+2*halfsize)
+            static std::vector<unsigned int> WrapTable(unsigned int n, int halfsize) {
+                std::vector<unsigned int> t(n + 2*halfsize);
+                for (int i=0; i<(int)t.size(); i++) {
+                    int r = (i - halfsize) % (int)n;
+                    t[i] = r < 0 ? r + n : r;
+                }
+                return t;
+            }
+
+            template <unsigned int C>
+            static void BlurChannels(float* data, unsigned int w, unsigned int h,
+                                     unsigned int channels, int halfsize) {
+                const unsigned int nc = C ? C : channels;
+                const int taps = halfsize * 2 + 1;
+                std::vector<unsigned int> xs = WrapTable(w, halfsize);
+                std::vector<unsigned int> ys = WrapTable(h, halfsize);
+                std::vector<float> temp(w*h*nc);
+
+                for (unsigned int y = 0; y < h; ++y) {
+                    const float* row = data + y*w*nc;
+                    float* out = &temp[y*w*nc];
+                    for (unsigned int x = 0; x < w; ++x)
+                        for (unsigned int ch = 0; ch < nc; ++ch) {
+                            float s = 0;
+                            for (int X = 0; X < taps; ++X)
+                                s += row[xs[x+X]*nc+ch];
+                            out[x*nc+ch] = s / taps;
+                        }
+                }
+                for (unsigned int y = 0; y < h; ++y) {
+                    float* out = data + y*w*nc;
+                    for (unsigned int x = 0; x < w; ++x)
+                        for (unsigned int ch = 0; ch < nc; ++ch) {
+                            float s = 0;
+                            for (int Y = 0; Y < taps; ++Y)
+                                s += temp[(x + ys[y+Y]*w)*nc+ch];
+                            out[x*nc+ch] = s / taps;
+                        }
+                }
+            }
+
+            template <unsigned int C>
+            static void Blur3DChannels(float* data, unsigned int w, unsigned int h,
+                                       unsigned int d, unsigned int channels,
+                                       unsigned int itr, int halfsize) {
+                const unsigned int nc = C ? C : channels;
+                const int taps = halfsize * 2 + 1;
+                std::vector<unsigned int> xs = WrapTable(w, halfsize);
+                std::vector<unsigned int> ys = WrapTable(h, halfsize);
+                std::vector<unsigned int> zs = WrapTable(d, halfsize);
+                std::vector<float> tempX(w*h*d*nc), tempY(w*h*d*nc);
+
+                for (unsigned int i = 0; i < itr; ++i) {
+                    for (unsigned int z = 0; z < d; ++z)
+                        for (unsigned int y = 0; y < h; ++y) {
+                            const float* row = data + (y + z*h)*w*nc;
+                            float* out = &tempX[(y + z*h)*w*nc];
+                            for (unsigned int x = 0; x < w; ++x)
+                                for (unsigned int ch = 0; ch < nc; ++ch) {
+                                    float s = 0;
+                                    for (int X = 0; X < taps; ++X)
+                                        s += row[xs[x+X]*nc+ch];
+                                    out[x*nc+ch] = s / taps;
+                                }
+                        }
+                    for (unsigned int z = 0; z < d; ++z)
+                        for (unsigned int y = 0; y < h; ++y) {
+                            float* out = &tempY[(y + z*h)*w*nc];
+                            for (unsigned int x = 0; x < w; ++x)
+                                for (unsigned int ch = 0; ch < nc; ++ch) {
+                                    float s = 0;
+                                    for (int Y = 0; Y < taps; ++Y)
+                                        s += tempX[(x + (ys[y+Y] + z*h)*w)*nc+ch];
+                                    out[x*nc+ch] = s / taps;
+                                }
+                        }
+                    for (unsigned int z = 0; z < d; ++z)
+                        for (unsigned int y = 0; y < h; ++y) {
+                            float* out = data + (y + z*h)*w*nc;
+                            for (unsigned int x = 0; x < w; ++x)
+                                for (unsigned int ch = 0; ch < nc; ++ch) {
+                                    float s = 0;
+                                    for (int Z = 0; Z < taps; ++Z)
+                                        s += tempY[(x + (y + zs[z+Z]*h)*w)*nc+ch];
+                                    out[x*nc+ch] = s / taps;
+                                }
+                        }
+                }
+            }
+
+            // linear interpolation weights for output coordinate i of n
+            // samples over a texture of size m, the last texel is
+            // repeated past the edge instead of blending with the first
+            static void EdgeWeights(unsigned int i, unsigned int n, unsigned int m,
+                                    unsigned int& i0, unsigned int& i1, REAL& t) {
+                REAL u = (REAL)i * m / n;
+                i0 = (unsigned int)u;
+                t = u - i0;
+                if (i0 >= m - 1) {
+                    i0 = i1 = m - 1;
+                    t = 0;
+                } else
+                    i1 = i0 + 1;
+            }
+
+            // wrap around linear interpolation weights for output
+            // coordinate i of n samples over a texture of size m
+            static void PeriodicWeights(unsigned int i, unsigned int n, unsigned int m,
+                                        unsigned int& i0, unsigned int& i1, REAL& t) {
+                REAL u = (REAL)i * m / n;
+                i0 = (unsigned int)u;
+                t = u - i0;
+                i0 %= m;
+                i1 = (i0 + 1) % m;
+            }
+
+            static REAL PeriodicSample(FloatTexture2DPtr tex, unsigned int x, unsigned int y,
+                                       unsigned int w, unsigned int h) {
+                unsigned int tw = tex->GetWidth(), th = tex->GetHeight();
+                unsigned int x0, x1, y0, y1;
+                REAL tx, ty;
+                PeriodicWeights(x, w, tw, x0, x1, tx);
+                PeriodicWeights(y, h, th, y0, y1, ty);
+                const float* data = tex->GetData();
+                REAL a = data[x0+y0*tw] + (data[x1+y0*tw] - data[x0+y0*tw]) * tx;
+                REAL b = data[x0+y1*tw] + (data[x1+y1*tw] - data[x0+y1*tw]) * tx;
+                return a + (b - a) * ty;
+            }
+
+            static REAL PeriodicSample(FloatTexture3DPtr tex, unsigned int x, unsigned int y,
+                                       unsigned int z, unsigned int w, unsigned int h,
+                                       unsigned int d) {
+                unsigned int tw = tex->GetWidth(), th = tex->GetHeight();
+                unsigned int td = tex->GetDepth();
+                unsigned int xs[2], ys[2], zs[2];
+                REAL tx, ty, tz;
+                PeriodicWeights(x, w, tw, xs[0], xs[1], tx);
+                PeriodicWeights(y, h, th, ys[0], ys[1], ty);
+                PeriodicWeights(z, d, td, zs[0], zs[1], tz);
+                const float* data = tex->GetData();
+                REAL v = 0;
+                for (unsigned int i=0; i<8; i++) {
+                    REAL wgt = ((i&1) ? tx : 1-tx) * ((i&2) ? ty : 1-ty)
+                        * ((i&4) ? tz : 1-tz);
+                    v += wgt * data[xs[i&1] + (ys[(i>>1)&1] + zs[i>>2]*th)*tw];
+                }
+                return v;
+            }
+
+            static REAL CloudExp(REAL v) {
+                REAL CloudCover = 0.215; // 0-255 =density
+                REAL CloudSharpness = 10; //0-1 =sharpness
+                v = 1.0 - exp( -CloudSharpness * (v - CloudCover) );
+                return v < 0 ? 0 : v;
+            }
+
+            // 8-bit kernels. SSE2 covers the bulk of each run, the
+            // scalar loops finish the tail and do the same arithmetic.
+
+            // byte each value gets through ToFloatTexture, curve and
+            // ToUCharTexture
+            static void CurveTable(REAL (*curve)(REAL), unsigned char lut[256]) {
+                for (unsigned int v=0; v<256; v++) {
+                    float s = (float)curve((float)(v / 255.0)) * 255;
+                    lut[v] = s <= 0 ? 0 : (s >= 255 ? 255 : (unsigned char)s);
+                }
+            }
+
+            // lookups have no SSE2 form, every stride'th byte is mapped
+            static void MapBytes(unsigned char* data, unsigned int count,
+                                 unsigned int stride, const unsigned char lut[256]) {
+                for (unsigned int i=0; i<count; i++)
+                    data[i*stride] = lut[data[i*stride]];
+            }
+
+            // zero every stride'th byte below cut
+            static void ThresholdBytes(unsigned char* data, unsigned int count,
+                                       unsigned int stride, unsigned int cut) {
+                unsigned int i = 0;
+#ifdef __SSE2__
+                if (stride == 1 && cut < 256) {
+                    const __m128i vc = _mm_set1_epi8((char)cut);
+                    const __m128i zero = _mm_setzero_si128();
+                    for (; i+16 <= count; i+=16) {
+                        __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+                        // cut - v saturates to zero where v >= cut
+                        __m128i keep = _mm_cmpeq_epi8(_mm_subs_epu8(vc, v), zero);
+                        _mm_storeu_si128((__m128i*)(data + i), _mm_and_si128(v, keep));
+                    }
+                }
+#endif
+                for (; i<count; i++)
+                    if (data[i*stride] < cut)
+                        data[i*stride] = 0;
+            }
+
+            static void CombineBytes(const unsigned char* l, const unsigned char* r,
+                                     int multiplier, unsigned char* out,
+                                     unsigned int count) {
+                unsigned int i = 0;
+#ifdef __SSE2__
+                // 255 * multiplier must fit a signed 16 bit lane
+                if (multiplier >= -128 && multiplier <= 128) {
+                    const __m128i m = _mm_set1_epi16((short)multiplier);
+                    const __m128i zero = _mm_setzero_si128();
+                    for (; i+16 <= count; i+=16) {
+                        __m128i a = _mm_loadu_si128((const __m128i*)(l + i));
+                        __m128i b = _mm_loadu_si128((const __m128i*)(r + i));
+                        __m128i lo = _mm_adds_epi16(_mm_unpacklo_epi8(a, zero),
+                                                    _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), m));
+                        __m128i hi = _mm_adds_epi16(_mm_unpackhi_epi8(a, zero),
+                                                    _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), m));
+                        _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(lo, hi));
+                    }
+                }
+#endif
+                for (; i<count; i++) {
+                    long v = l[i] + (long)multiplier * r[i];
+                    out[i] = v < 0 ? 0 : (v > 255 ? 255 : (unsigned char)v);
+                }
+            }
+
+            // channel 0 of tex at w x h, resampled into tmp if needed
+            static const unsigned char* FirstChannel(UCharTexture2DPtr tex,
+                                                     unsigned int w, unsigned int h,
+                                                     std::vector<unsigned char>& tmp) {
+                unsigned int tw = tex->GetWidth(), th = tex->GetHeight();
+                unsigned int tc = tex->GetChannels();
+                if (tw == w && th == h && tc == 1)
+                    return tex->GetData();
+                tmp.resize(w * h);
+                ScaleImage(tex->GetData(), tw, th, tc, &tmp[0], w, h, 1, w);
+                return &tmp[0];
+            }
+
+            // box filter in A sized sums, the vertical pass runs over
+            // whole rows and the horizontal pass over a row of column
+            // sums padded with its wrapped ends
+            template <class A>
+            static void BlurBytes(unsigned char* data, unsigned int w, unsigned int h,
+                                  unsigned int nc, int halfsize) {
+                const unsigned int taps = halfsize * 2 + 1;
+                const unsigned int row = w * nc;
+                std::vector<unsigned int> xs = WrapTable(w, halfsize);
+                std::vector<unsigned int> ys = WrapTable(h, halfsize);
+                std::vector<A> sums((w + 2*halfsize) * nc);
+                std::vector<const unsigned char*> rows(taps);
+                std::vector<unsigned char> temp(row * h);
+                A* centre = &sums[halfsize * nc];
+                for (unsigned int y = 0; y < h; ++y) {
+                    for (unsigned int Y = 0; Y < taps; ++Y)
+                        rows[Y] = data + ys[y+Y] * row;
+                    SumRows(&rows[0], taps, centre, row);
+                    for (int X = 0; X < halfsize; ++X)
+                        for (unsigned int ch = 0; ch < nc; ++ch) {
+                            sums[X*nc+ch] = centre[xs[X]*nc+ch];
+                            centre[(w+X)*nc+ch] = centre[xs[w+halfsize+X]*nc+ch];
+                        }
+                    SumTaps(&sums[0], taps, nc, &temp[y*row], row);
+                }
+                std::copy(temp.begin(), temp.end(), data);
+            }
+
+            template <class A>
+            static void SumRows(const unsigned char* const* rows, unsigned int taps,
+                                A* sums, unsigned int count) {
+                for (unsigned int i=0; i<count; i++) {
+                    A s = 0;
+                    for (unsigned int Y=0; Y<taps; Y++)
+                        s += rows[Y][i];
+                    sums[i] = s;
+                }
+            }
+
+            static void SumRows(const unsigned char* const* rows, unsigned int taps,
+                                unsigned short* sums, unsigned int count) {
+                unsigned int i = 0;
+#ifdef __SSE2__
+                const __m128i zero = _mm_setzero_si128();
+                for (; i+16 <= count; i+=16) {
+                    __m128i lo = zero, hi = zero;
+                    for (unsigned int Y=0; Y<taps; Y++) {
+                        __m128i v = _mm_loadu_si128((const __m128i*)(rows[Y] + i));
+                        lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(v, zero));
+                        hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(v, zero));
+                    }
+                    _mm_storeu_si128((__m128i*)(sums + i), lo);
+                    _mm_storeu_si128((__m128i*)(sums + i + 8), hi);
+                }
+#endif
+                for (; i<count; i++) {
+                    unsigned short s = 0;
+                    for (unsigned int Y=0; Y<taps; Y++)
+                        s += rows[Y][i];
+                    sums[i] = s;
+                }
+            }
+
+            template <class A>
+            static void SumTaps(const A* sums, unsigned int taps, unsigned int nc,
+                                unsigned char* out, unsigned int count) {
+                const unsigned int area = taps * taps;
+                for (unsigned int i=0; i<count; i++) {
+                    A s = 0;
+                    for (unsigned int X=0; X<taps; X++)
+                        s += sums[i + X*nc];
+                    out[i] = s / area;
+                }
+            }
+
+            static void SumTaps(const unsigned short* sums, unsigned int taps,
+                                unsigned int nc, unsigned char* out, unsigned int count) {
+                const unsigned int area = taps * taps;
+                unsigned int i = 0;
+#ifdef __SSE2__
+                // sums are multiples of 1/area apart, so the half step
+                // keeps the float quotient on the right side of each
+                // integer and truncation divides exactly
+                const __m128 inv = _mm_set1_ps(1.0f / area);
+                const __m128 half = _mm_set1_ps(0.5f / area);
+                const __m128i zero = _mm_setzero_si128();
+                for (; i+8 <= count; i+=8) {
+                    __m128i s = zero;
+                    for (unsigned int X=0; X<taps; X++)
+                        s = _mm_add_epi16(s, _mm_loadu_si128((const __m128i*)(sums + i + X*nc)));
+                    __m128 lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(s, zero));
+                    __m128 hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(s, zero));
+                    __m128i q = _mm_packs_epi32(_mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(lo, inv), half)),
+                                                _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(hi, inv), half)));
+                    _mm_storel_epi64((__m128i*)(out + i), _mm_packus_epi16(q, q));
+                }
+#endif
+                for (; i<count; i++) {
+                    unsigned short s = 0;
+                    for (unsigned int X=0; X<taps; X++)
+                        s += sums[i + X*nc];
+                    out[i] = s / area;
+                }
+            }
+
+            // Apply f to channel 0 of every occupied brick and of the
+            // background, the other channels are left as they are.
+            static void MapBricks(FloatBrickTexture3DPtr tex, REAL (*f)(REAL)) {
+                const unsigned int c = tex->GetChannels();
+                for (unsigned int bz=0; bz<tex->GetBricksZ(); bz++)
+                    for (unsigned int by=0; by<tex->GetBricksY(); by++)
+                        for (unsigned int bx=0; bx<tex->GetBricksX(); bx++) {
+                            float* brick = tex->GetBrick(bx,by,bz);
+                            if (!brick) continue;
+                            for (unsigned int i=0; i<FloatBrickTexture3D::BRICK_VOXELS*c; i+=c)
+                                brick[i] = f(brick[i]);
+                        }
+                tex->SetBackground(0, f(tex->GetBackground()[0]));
+            }
+
+            // One box filter pass along an axis of a Morton volume, in
+            // place. The tiles of a line along the axis are copied to
+            // a local buffer, then every voxel line in them is
+            // unpacked with its wrapped halo and filtered with a
+            // running sum straight into the tiles.
+            static void BlurTiles(FloatMortonTexture3DPtr tex,
+                                  unsigned int axis, int halfsize) {
+                const unsigned int T = FloatMortonTexture3D::TILE;
+                const unsigned int V = FloatMortonTexture3D::TILE_VOXELS;
+                const unsigned int c = tex->GetChannels();
+                const unsigned int dims[3] = { tex->GetWidth(), tex->GetHeight(), tex->GetDepth() };
+                const unsigned int tiles[3] = { tex->GetTilesX(), tex->GetTilesY(), tex->GetTilesZ() };
+                const unsigned int u = axis == 0 ? 1 : 0;
+                const unsigned int v = axis == 2 ? 1 : 2;
+                const unsigned int n = dims[axis];
+                const unsigned int taps = halfsize * 2 + 1;
+                const float norm = 1.0f / taps;
+
+                // Morton offset of each position inside a tile
+                std::vector<unsigned int> morton(V);
+                for (unsigned int z=0; z<T; z++)
+                    for (unsigned int y=0; y<T; y++)
+                        for (unsigned int x=0; x<T; x++)
+                            morton[x + (y + z*T)*T] = tex->Index(x,y,z);
+                const unsigned int step[3] = { 1, T, T*T };
+
+                std::vector<float> src(tiles[axis] * V * c);
+                std::vector<float> line((n + taps - 1) * c);
+                std::vector<float*> dst(tiles[axis]);
+
+                unsigned int t[3];
+                for (t[v]=0; t[v]<tiles[v]; t[v]++)
+                    for (t[u]=0; t[u]<tiles[u]; t[u]++) {
+                        for (unsigned int k=0; k<tiles[axis]; k++) {
+                            t[axis] = k;
+                            dst[k] = tex->GetTile(t[0],t[1],t[2]);
+                            std::memcpy(&src[k * V * c], dst[k], V * c * sizeof(float));
+                        }
+                        const unsigned int nu = std::min(T, dims[u] - t[u]*T);
+                        const unsigned int nv = std::min(T, dims[v] - t[v]*T);
+                        for (unsigned int q=0; q<nv; q++)
+                            for (unsigned int p=0; p<nu; p++) {
+                                const unsigned int base = p*step[u] + q*step[v];
+                                float* centre = &line[halfsize * c];
+                                for (unsigned int X=0; X<n; X++) {
+                                    const float* in = &src[((X / T) * V
+                                                            + morton[base + (X % T)*step[axis]]) * c];
+                                    for (unsigned int ch=0; ch<c; ch++)
+                                        centre[X*c+ch] = in[ch];
+                                }
+                                for (int X=0; X<halfsize; X++) {
+                                    const unsigned int lo = ((X - halfsize) % (int)n + n) % n;
+                                    const unsigned int hi = X % n;
+                                    for (unsigned int ch=0; ch<c; ch++) {
+                                        line[X*c+ch] = centre[lo*c+ch];
+                                        line[(n+halfsize+X)*c+ch] = centre[hi*c+ch];
+                                    }
+                                }
+                                for (unsigned int ch=0; ch<c; ch++) {
+                                    float sum = 0;
+                                    for (unsigned int i=0; i<taps-1; i++)
+                                        sum += line[i*c+ch];
+                                    for (unsigned int X=0; X<n; X++) {
+                                        sum += line[(X+taps-1)*c+ch];
+                                        dst[X / T][morton[base + (X % T)*step[axis]] * c + ch]
+                                            = sum * norm;
+                                        sum -= line[X*c+ch];
+                                    }
+                                }
+                            }
+                    }
+            }
+
+            // One box filter pass along an axis, in place. A line of
+            // bricks along the axis is filtered into per brick scratch
+            // buffers, so the halo reads see unfiltered neighbours, and
+            // written back when the whole line is done. Only bricks an
+            // occupied brick can reach are filtered.
+            static void BlurBricks(FloatBrickTexture3DPtr tex,
+                                   unsigned int axis, int halfsize) {
+                const unsigned int B = FloatBrickTexture3D::BRICK;
+                const unsigned int V = FloatBrickTexture3D::BRICK_VOXELS;
+                const unsigned int c = tex->GetChannels();
+                const unsigned int dims[3] = { tex->GetWidth(), tex->GetHeight(), tex->GetDepth() };
+                const unsigned int bricks[3] = { tex->GetBricksX(), tex->GetBricksY(), tex->GetBricksZ() };
+                // voxel strides inside a brick
+                const unsigned int stride[3] = { c, B*c, B*B*c };
+                const unsigned int u = axis == 0 ? 1 : 0;
+                const unsigned int v = axis == 2 ? 1 : 2;
+                const unsigned int n = bricks[axis];
+                const unsigned int taps = halfsize * 2 + 1;
+                const unsigned int span = B + taps - 1;
+                const float norm = 1.0f / taps;
+                const float* bg = tex->GetBackground();
+
+                // reach in bricks, one more when the far brick is partial
+                int reach = (halfsize + B - 1) / B;
+                if (dims[axis] % B) reach++;
+
+                std::vector<const float*> src(n);
+                std::vector<bool> target(n);
+                std::vector<float> scratch(n * V * c);
+                std::vector<float> line(span * c);
+
+                unsigned int b[3];
+                for (b[v]=0; b[v]<bricks[v]; b[v]++)
+                    for (b[u]=0; b[u]<bricks[u]; b[u]++) {
+                        bool any = false;
+                        std::fill(target.begin(), target.end(), false);
+                        for (unsigned int k=0; k<n; k++) {
+                            b[axis] = k;
+                            src[k] = tex->GetBrick(b[0],b[1],b[2]);
+                            if (!src[k]) continue;
+                            any = true;
+                            for (int o=-reach; o<=reach; o++) {
+                                int t = ((int)k + o) % (int)n;
+                                target[t < 0 ? t + n : t] = true;
+                            }
+                        }
+                        if (!any) continue;
+
+                        for (unsigned int k=0; k<n; k++) {
+                            if (!target[k]) continue;
+                            float* out = &scratch[k * V * c];
+                            int first = ((int)(k*B) - halfsize) % (int)dims[axis];
+                            if (first < 0) first += dims[axis];
+                            for (unsigned int q=0; q<B; q++)
+                                for (unsigned int p=0; p<B; p++) {
+                                    const unsigned int base = p*stride[u] + q*stride[v];
+                                    // gather the line with its halo, one
+                                    // run per brick it passes through
+                                    unsigned int pos = first;
+                                    for (unsigned int i=0; i<span; ) {
+                                        const unsigned int off = pos % B;
+                                        const unsigned int run =
+                                            std::min(std::min(B - off, dims[axis] - pos), span - i);
+                                        const float* in = src[pos / B];
+                                        for (unsigned int r=0; r<run; r++)
+                                            for (unsigned int ch=0; ch<c; ch++)
+                                                line[(i+r)*c+ch] = in
+                                                    ? in[base + (off+r)*stride[axis] + ch]
+                                                    : bg[ch];
+                                        i += run;
+                                        pos += run;
+                                        if (pos == dims[axis]) pos = 0;
+                                    }
+                                    for (unsigned int ch=0; ch<c; ch++) {
+                                        float sum = 0;
+                                        for (unsigned int i=0; i<taps; i++)
+                                            sum += line[i*c+ch];
+                                        out[base + ch] = sum * norm;
+                                        for (unsigned int x=1; x<B; x++) {
+                                            sum += line[(x+taps-1)*c+ch] - line[(x-1)*c+ch];
+                                            out[base + x*stride[axis] + ch] = sum * norm;
+                                        }
+                                    }
+                                }
+                        }
+
+                        // allocating may move the pool, src is stale now
+                        for (unsigned int k=0; k<n; k++) {
+                            if (!target[k]) continue;
+                            b[axis] = k;
+                            std::copy(scratch.begin() + k * V * c,
+                                      scratch.begin() + (k+1) * V * c,
+                                      tex->Allocate(b[0],b[1],b[2]));
+                        }
+                    }
+            }
         }; // class TexUtils
     } // NS Utils
 } // NS OpenEngine
@@ -5,20 +5,78 @@
 #include <Resources/Texture3D.h>
 #include <Utils/TextureTool.h>
 #include <Utils/TexUtils.h>
+#include <Utils/TexProfiler.h>
+#include <Utils/Convolution.h>
+#include <cmath>
+
+#ifdef DEBUG_PRINT
+#include <Utils/Convert.h>
+#include <cstring>
+#endif
 
 namespace OpenEngine {
 namespace Utils {
 
 typedef float REAL;
 
+/**
+ * Parameters of a single noise generation. A zResolution of zero
+ * requests a 2D texture, anything else a 3D texture. The meaning of
+ * the remaining fields is the same as for ValueNoise::Generate.
+ */
+struct NoiseParameters {
+    unsigned int xResolution, yResolution, zResolution;
+    unsigned int bandwidth;
+    float mResolution, mBandwidth;
+    unsigned int blur, layers, seed;
+    // normalize the result to [0;1] after generation, used by
+    // AsyncValueNoise and not part of the generated noise itself
+    bool normalize;
+
+    NoiseParameters()
+        : xResolution(0), yResolution(0), zResolution(0), bandwidth(0),
+          mResolution(0.5f), mBandwidth(0.5f), blur(1), layers(0), seed(0),
+          normalize(true) {}
+
+    bool Is3D() const { return zResolution != 0; }
+
+    // Strict ordering on the fields that determine the noise.
+    bool operator<(const NoiseParameters& o) const {
+        if (xResolution != o.xResolution) return xResolution < o.xResolution;
+        if (yResolution != o.yResolution) return yResolution < o.yResolution;
+        if (zResolution != o.zResolution) return zResolution < o.zResolution;
+        if (bandwidth != o.bandwidth) return bandwidth < o.bandwidth;
+        if (mResolution != o.mResolution) return mResolution < o.mResolution;
+        if (mBandwidth != o.mBandwidth) return mBandwidth < o.mBandwidth;
+        if (blur != o.blur) return blur < o.blur;
+        if (layers != o.layers) return layers < o.layers;
+        return seed < o.seed;
+    }
+};
+
 class ValueNoise {
  private:
+#ifdef DEBUG_PRINT
+    static void DumpLayer(FloatTexture2DPtr tex, std::string name) {
+        unsigned int w = tex->GetWidth();
+        unsigned int h = tex->GetHeight();
+        FloatTexture2DPtr copy(new FloatTexture2D(w,h,1));
+        std::memcpy(copy->GetData(), tex->GetData(), sizeof(float)*w*h);
+        TexUtils::Normalize(copy,0,1);
+        TextureTool<unsigned char>::
+            DumpTexture(TexUtils::ToUCharTexture(TexUtils::ToRGBAinAlphaChannel(copy)),
+                        name);
+    }
+#endif
+
     static FloatTexture2DPtr CreateNoise(unsigned int periodX,
                                          unsigned int periodY,
                                          unsigned int amplitude,
                                          unsigned int seed = 0) {
         unsigned int w = periodX;
         unsigned int h = periodY;
+        TEXUTILS_PROFILE_SCOPE("ValueNoise::CreateNoise", w * h,
+                               w * h * sizeof(float), -1);
         FloatTexture2DPtr output(new FloatTexture2D(w,h,1));
 
         RandomGenerator r;
@@ -40,6 +98,8 @@ class ValueNoise {
         unsigned int w = periodX;
         unsigned int h = periodY;
         unsigned int d = periodZ;
+        TEXUTILS_PROFILE_SCOPE("ValueNoise::CreateNoise3D", w * h * d,
+                               w * h * d * sizeof(float), -1);
         FloatTexture3DPtr output(new FloatTexture3D(w,h,d,1));
 
         //logger.info << "amplitude: " << amplitude << logger.end;
@@ -64,22 +124,20 @@ class ValueNoise {
                                       unsigned int blur,
                                       unsigned int layers,
                                       RandomGenerator& r) {
+            TEXUTILS_PROFILE_SCOPE("ValueNoise::Layer",
+                                   xResolution * yResolution,
+                                   xResolution * yResolution * sizeof(float),
+                                   layers);
 
             FloatTexture2DPtr noise =
                 CreateNoise(xResolution, yResolution, bandwidth, 
                             r.UniformInt(0,256));
 
 #ifdef DEBUG_PRINT
-            FloatTexture2DPtr noiseClone(noise->Clone());
-            Normalize(noiseClone,0,1); 
-            FloatTexture2DPtr noiseTexture = 
-                ToRGBAinAlphaChannel(noiseClone);
-            TextureTool<unsigned char>::
-                DumpTexture(ToUCharTexture(noiseTexture),
-                            std::string("generated") +
-                            "-rx" + Convert::ToString(xResolution) +
-                            "-b"  + Convert::ToString(bandwidth) +
-                            ".png");
+            DumpLayer(noise, std::string("generated") +
+                      "-rx" + Convert::ToString(xResolution) +
+                      "-b"  + Convert::ToString(bandwidth) +
+                      ".png");
 #endif
             if (layers != 0) {
                 FloatTexture2DPtr smallTex = 
@@ -95,23 +153,16 @@ class ValueNoise {
                 TexUtils::Blur(noise, blur);
 
 #ifdef DEBUG_PRINT
-                FloatTexture2DPtr smallClone(noise->Clone());
-                Normalize(smallClone,0,1);
-                FloatTexture2DPtr smallTexture = 
-                    ToRGBAinAlphaChannel(smallClone);
-                TextureTool<unsigned char>::
-                    DumpTexture(ToUCharTexture(smallTexture),
-                                std::string("combined") +
-                                "-l" + Convert::ToString(layers) +
-                                "-b" + Convert::ToString(bandwidth) +
-                                ".png");
+                DumpLayer(noise, std::string("combined") +
+                          "-l" + Convert::ToString(layers) +
+                          "-b" + Convert::ToString(bandwidth) +
+                          ".png");
 #endif
             }
 
 #ifdef DEBUG_PRINT
-            logger.info << "resolution: " << resolution;
+            logger.info << "resolution: " << xResolution << "x" << yResolution;
             logger.info << " bandwidth: " << bandwidth << logger.end;
-            logger.info << "multiplier:" << multiplier << logger.end;
 #endif
             return noise;
     }
@@ -125,6 +176,11 @@ class ValueNoise {
                                         unsigned int blur,
                                         unsigned int layers,
                                         RandomGenerator& r) {
+            TEXUTILS_PROFILE_SCOPE("ValueNoise::Layer3D",
+                                   xResolution * yResolution * zResolution,
+                                   xResolution * yResolution * zResolution
+                                   * sizeof(float),
+                                   layers);
 
             FloatTexture3DPtr noise =
                 CreateNoise3D(xResolution, yResolution, zResolution,
@@ -152,6 +208,9 @@ class ValueNoise {
                     multiplier *= -1;
                 noise = TexUtils::Combine3D(smallTex, noise, multiplier);
                 TexUtils::Blur3D(noise, blur);
+#ifdef DEBUG_PRINT
+                logger.info << "multiplier:" << multiplier << logger.end;
+#endif
                 /*
                 {
                     string layername = "combinedlayers";
@@ -164,19 +223,105 @@ class ValueNoise {
             }
 
 #ifdef DEBUG_PRINT
-            logger.info << "resolution: " << resolution;
+            logger.info << "resolution: " << xResolution << "x"
+                        << yResolution << "x" << zResolution;
             logger.info << " bandwidth: " << bandwidth << logger.end;
-/*             Save(small, "small-r"+ */
-/*                  Convert::ToString(resolution) + "-b" + */
-/*                  Convert::ToString(bandwidth)); */
-            logger.info << "multiplier:" << multiplier << logger.end;
-/*             Save(noise, "noise-r"+ */
-/*                  Convert::ToString(resolution) + "-b" + */
-/*                  Convert::ToString(bandwidth)); */
 #endif
             return noise;
     }
 
+    // Divisor of period closest to the wanted resolution, at most max.
+    static unsigned int PeriodicResolution(float wanted, unsigned int period,
+                                           unsigned int max) {
+        unsigned int best = 1;
+        for (unsigned int d=1; d<=max && d<=period; d++)
+            if (period % d == 0 &&
+                std::fabs(d - wanted) <= std::fabs(best - wanted))
+                best = d;
+        return best;
+    }
+
+    static FloatTexture2DPtr GenerateTileable(unsigned int xResolution,
+                                              unsigned int yResolution,
+                                              unsigned int xPeriod,
+                                              unsigned int yPeriod,
+                                              unsigned int bandwidth,
+                                              float mResolution,
+                                              float mBandwidth,
+                                              unsigned int blur,
+                                              unsigned int layers,
+                                              RandomGenerator& r) {
+            TEXUTILS_PROFILE_SCOPE("ValueNoise::TileableLayer",
+                                   xResolution * yResolution,
+                                   xResolution * yResolution * sizeof(float),
+                                   layers);
+
+            FloatTexture2DPtr noise =
+                CreateNoise(xResolution, yResolution, bandwidth,
+                            r.UniformInt(0,256));
+
+            if (layers != 0) {
+                FloatTexture2DPtr smallTex =
+                    GenerateTileable(PeriodicResolution(xResolution * mResolution,
+                                                        xPeriod, xResolution),
+                                     PeriodicResolution(yResolution * mResolution,
+                                                        yPeriod, yResolution),
+                                     xPeriod, yPeriod,
+                                     bandwidth * mBandwidth,
+                                     mResolution, mBandwidth,
+                                     blur, layers-1, r);
+                noise = TexUtils::CombinePeriodic(noise, smallTex);
+                // single wrapping pass, like TexUtils::Blur
+                Convolution::Separable(noise, Convolution::BoxKernel(1));
+            }
+            return noise;
+    }
+
+    static FloatTexture3DPtr GenerateTileable3D(unsigned int xResolution,
+                                                unsigned int yResolution,
+                                                unsigned int zResolution,
+                                                unsigned int xPeriod,
+                                                unsigned int yPeriod,
+                                                unsigned int zPeriod,
+                                                unsigned int bandwidth,
+                                                float mResolution,
+                                                float mBandwidth,
+                                                unsigned int blur,
+                                                unsigned int layers,
+                                                RandomGenerator& r) {
+            TEXUTILS_PROFILE_SCOPE("ValueNoise::TileableLayer3D",
+                                   xResolution * yResolution * zResolution,
+                                   xResolution * yResolution * zResolution
+                                   * sizeof(float),
+                                   layers);
+
+            FloatTexture3DPtr noise =
+                CreateNoise3D(xResolution, yResolution, zResolution,
+                              bandwidth, r.UniformInt(0,256));
+
+            if (layers != 0) {
+                FloatTexture3DPtr smallTex =
+                    GenerateTileable3D(PeriodicResolution(xResolution * mResolution,
+                                                          xPeriod, xResolution),
+                                       PeriodicResolution(yResolution * mResolution,
+                                                          yPeriod, yResolution),
+                                       PeriodicResolution(zResolution * mResolution,
+                                                          zPeriod, zResolution),
+                                       xPeriod, yPeriod, zPeriod,
+                                       bandwidth * mBandwidth,
+                                       mResolution, mBandwidth,
+                                       blur, layers-1, r);
+                int multiplier = 1;
+                if (layers % 2 == 0)
+                    multiplier *= -1;
+                noise = TexUtils::CombinePeriodic3D(smallTex, noise, multiplier);
+                std::vector<float> box = Convolution::BoxKernel(1);
+                for (unsigned int i=0; i<blur; i++)
+                    Convolution::Separable3D(noise, box);
+            }
+            return noise;
+    }
+
  public:
     static FloatTexture2DPtr Generate(unsigned int xResolution,
                                       unsigned int yResolution,
@@ -188,11 +333,8 @@ class ValueNoise {
                                       unsigned int seed) {
 
 #ifdef DEBUG_PRINT
-        logger.info << "resolution: " << resolution;
+        logger.info << "resolution: " << xResolution << "x" << yResolution;
         logger.info << " bandwidth: " << bandwidth << logger.end;
-        Save(noise, "noise-r"+
-             Convert::ToString(resolution) + "-b" +
-             Convert::ToString(bandwidth));
 #endif
 
         RandomGenerator r;
@@ -212,11 +354,9 @@ class ValueNoise {
                                         unsigned int seed) {
 
 #ifdef DEBUG_PRINT
-        logger.info << "resolution: " << resolution;
+        logger.info << "resolution: " << xResolution << "x"
+                    << yResolution << "x" << zResolution;
         logger.info << " bandwidth: " << bandwidth << logger.end;
-/*         Save(noise, "noise-r"+ */
-/*              Convert::ToString(resolution) + "-b" + */
-/*              Convert::ToString(bandwidth)); */
 #endif
 
         RandomGenerator r;
@@ -226,6 +366,58 @@ class ValueNoise {
                           mBandwidth, blur, layers, r);
     }
 
+    /**
+     * Seamless variant of Generate. Every octave uses a lattice whose
+     * size divides the output size, picking the divisor closest to
+     * the size Generate would use, and all interpolation and blurring
+     * wraps around, so the result tiles without seams.
+     */
+    static FloatTexture2DPtr GenerateTileable(unsigned int xResolution,
+                                              unsigned int yResolution,
+                                              unsigned int bandwidth,
+                                              float mResolution,
+                                              float mBandwidth,
+                                              unsigned int blur,
+                                              unsigned int layers,
+                                              unsigned int seed) {
+        RandomGenerator r;
+        r.Seed(seed);
+        return GenerateTileable(xResolution, yResolution,
+                                xResolution, yResolution,
+                                bandwidth, mResolution, mBandwidth,
+                                blur, layers, r);
+    }
+
+    // Seamless variant of Generate3D, see GenerateTileable.
+    static FloatTexture3DPtr GenerateTileable3D(unsigned int xResolution,
+                                                unsigned int yResolution,
+                                                unsigned int zResolution,
+                                                unsigned int bandwidth,
+                                                float mResolution,
+                                                float mBandwidth,
+                                                unsigned int blur,
+                                                unsigned int layers,
+                                                unsigned int seed) {
+        RandomGenerator r;
+        r.Seed(seed);
+        return GenerateTileable3D(xResolution, yResolution, zResolution,
+                                  xResolution, yResolution, zResolution,
+                                  bandwidth, mResolution, mBandwidth,
+                                  blur, layers, r);
+    }
+
+    static FloatTexture2DPtr Generate(const NoiseParameters& p) {
+        return Generate(p.xResolution, p.yResolution, p.bandwidth,
+                        p.mResolution, p.mBandwidth, p.blur, p.layers,
+                        p.seed);
+    }
+
+    static FloatTexture3DPtr Generate3D(const NoiseParameters& p) {
+        return Generate3D(p.xResolution, p.yResolution, p.zResolution,
+                          p.bandwidth, p.mResolution, p.mBandwidth,
+                          p.blur, p.layers, p.seed);
+    }
+
 };
 
 } // NS Utils